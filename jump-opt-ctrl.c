@@ -134,7 +134,7 @@ int mem_alu_opt_ctrl(u4 cur_fn, u4 cur_rnuma, u4 cur_rnumb, u4 cur_rnumc,
           case 0:
             switch (cur_rnumb){
               case 14:
-              case 15: printf("push\n");
+              case 15: SM_LOG(LOG_HAZARD, "push\n");
                        return (next_rnumb == cur_rnuma || next_rnuma == cur_rnuma);
               default: return (next_rnumb == cur_rnumc || next_rnuma == cur_rnumc);
             }
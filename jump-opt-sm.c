@@ -5,15 +5,13 @@
 
  Version 0.7   circa April, 2016
 
-  gcc -fno-asynchronous-unwind-tables -Wall -O2 -o sm jump-opt-sm.c
+  gcc -fno-asynchronous-unwind-tables -Wall -O2 -pthread -o sm jump-opt-sm.c
 */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 
-#include "jump-opt-ctrl.c"
-
 typedef unsigned short u4;
 typedef unsigned short u8;
 typedef unsigned short u16;
@@ -66,94 +64,6 @@ u16 bit_reverse( u16 n )
 #define DATA_SHIFT (0)
 
 
-// The state of SM.
-
-i16  mem[ MEMSIZE ];
-i16  reg[ REGS ];
-u16  pc;
-
-void micro_step( )
-{
-  u16 instruction = (u16) mem[ pc ];
-  pc = (u16) pc + 1;         // Increment program counter
-
-  u16 fn    = (u16) ((instruction >> 12) & BITS_4);
-  u16 rnumc = (u16) ((instruction >>  8) & BITS_4);
-  u16 rnumb = (u16) ((instruction >>  4) & BITS_4);
-  u16 rnuma = (u16) ((instruction      ) & BITS_4);
-  u16 data  = (u16) ((instruction      ) & BITS_8);
-  u16 addr;
-
-  i16 regc  = reg[ rnumc ];
-  i16 regb  = reg[ rnumb ];
-  i16 rega  = reg[ rnuma ];
-
-  // Instruction-by-instruction debugging statement
-  // printf(" %5d, %2d,  %3d,   %2d,   %2d,   %2d,  %5d,  %5d,  %5d.\n",
-  //        pc-1, fn, data, rnumc, rnumb, rnuma, regc, regb, rega );
-
-  switch ( fn ) {
-  case  0:
-    switch ( rnumb ) {
-    case  0:                                               break;  // noop00        0
-
-    case  1: reg[ rnumc ] = mem[ (u16) rega ];             break;  // ldmem         5
-
-    case  2: mem[ (u16) regc ] = rega;                     break;  // stmem         6
-
-    case  3: rega = rega - 1;                                      //               7
-             reg[ rnuma ] = rega;
-             mem[ (u16) rega ] = pc;
-             pc = (u16) regc;                              break;  // call
-
-    case  4: pc = (u16) mem[ (u16) rega ];                         //               8
-             reg[ rnuma ] = rega + 1;                      break;  // return
-
-    case  5: pc = (regc) ? ((u16) rega)      : pc;         break;  // jump          4
-    case  6: pc = (regc) ? ((u16) rega) + pc : pc;         break;  // bra, branch   4
-
-    case  7:                                               break;  // unassigned    0
-    case  8:                                               break;  // unassigned    0
-
-    case  9: reg[ rnumc ] = ~ rega;                        break;  // not           1
-    case 10: reg[ rnumc ] = - rega;                        break;  // neg, negate   1
-    case 11: reg[ rnumc ] = ! rega;                        break;  // cnot          1
-    case 12: reg[ rnumc ] = pop_count( rega );             break;  // popcnt        1
-    case 13: reg[ rnumc ] = bit_reverse( rega );           break;  // bitrev        1
-
-    case 14: reg[ rnumc ] = mem[ (u16) rega ];                     //               9
-             reg[ rnuma ] = rega + 1;                      break;  // pop
-
-    case 15: addr = (u16) rega - 1;                                //              10
-             mem[ addr ] = regc;
-             reg[ rnuma ] = addr;                          break;  // push
-    default:  break;
-    }                                                      break;  // End of case 0
-  case  1: reg[ rnumc ] =  regb  +  rega;                  break;  // add           2
-  case  2: reg[ rnumc ] =  regb  -  rega;                  break;  // sub           2
-  case  3: reg[ rnumc ] =  regb  *  rega;                  break;  // mul           2
-  case  4: reg[ rnumc ] =  regb  /  rega;                  break;  // div           2
-
-  case  5: reg[ rnumc ] =  regb  ^  rega;                  break;  // xor           2
-  case  6: reg[ rnumc ] =  regb  &  rega;                  break;  // and           2
-  case  7: reg[ rnumc ] =  regb  |  rega;                  break;  // lor           2
-
-  case  8: reg[ rnumc ] =  regb << (rega & 0xF);           break;  // sleft         2
-  case  9: reg[ rnumc ] =  regb >> (rega & 0xF);           break;  // sright        2
-
-  case 10: reg[ rnumc ] =  regb  <  rega;                  break;  // lt            2
-  case 11: reg[ rnumc ] =  regb <=  rega;                  break;  // lteq          2
-
-  case 12: reg[ rnumc ] = (regb) ?  rega : regc;           break;  // cmove         3
-  case 13: reg[ rnumc ] = (regb) ?  rega + regc : regc;    break;  // cadd          3
-
-  case 14: reg[ rnumc ] = (regc & 0xFF00) | data;          break;  // immlow        3
-  case 15: reg[ rnumc ] = (data << 8) | (regc & 0x00FF);   break;  // immhgh        3
-  default: break;
-  }
-}
-
-
 // Pipeline registers
 
 typedef struct{
@@ -166,6 +76,13 @@ typedef struct{
   u4   rnumb;    // rB or subfunction nibble
   u4   rnuma;    // rA
   u16  valP;     // incremented PC
+  u4   ptaken;   // -p: fetch predicted this control instruction taken
+  u16  pnext;    // -p: pc fetch went on to after this instruction
+  u16  phist;    // -p: branch history when this was fetched
+  u16  rmark;    // -R: return address stack when this was fetched,
+  u16  rtop;     //     its ras_mark and top entry
+  u16  seq;      // -S: number of the fetch
+  u32  tid;      // -T: fetch number, 0 for a bubble
 } d_register;
 
 typedef struct{
@@ -178,6 +95,13 @@ typedef struct{
   i16  valA;     // value of register rA
   u8   data;     // immediate data
   u16  valP;     // incremented PC (same as valP in d_register)
+  u4   ptaken;   // prediction (same as in d_register)
+  u16  pnext;
+  u16  phist;
+  u16  rmark;
+  u16  rtop;
+  u16  seq;
+  u32  tid;      // -T: fetch number, 0 for a bubble
 } e_register;
 
 typedef struct{
@@ -189,6 +113,13 @@ typedef struct{
   i16  valC;     // value of register rC
   i16  valA;     // value of register rA
   u16  valP;     // incremented PC (same as valP in e_register)
+  u4   ptaken;   // prediction (same as in d_register)
+  u16  pnext;
+  u16  phist;
+  u16  rmark;
+  u16  rtop;
+  u16  seq;
+  u32  tid;      // -T: fetch number, 0 for a bubble
 } m_register;
 
 typedef struct{
@@ -197,16 +128,28 @@ typedef struct{
   u4   rnumb;    // rB or subfunction nibble
   u4   rnuma;    // rA
   i16  aluR;     // ALU result
-  i16  memV;     // memory value
+  i16  memV;     // memory value, loaded or stored
   i16  valC;     // value of register rC
+  u16  valP;     // incremented PC (same as valP in m_register)
+  u16  addr;     // memory address accessed
+  u4   ptaken;   // prediction (same as in d_register)
+  u16  pnext;
+  u16  phist;
+  u16  rmark;
+  u16  rtop;
+  u16  seq;
+  u32  tid;      // -T: fetch number, 0 for a bubble
 } w_register;
 
-// Declare the pipeline registers.
-f_register cF, nF;
-d_register cD, nD;
-e_register cE, nE;
-m_register cM, nM;
-w_register cW, nW;
+#define SM_VARIANT "jump-opt"   // this simulator in batch manifests
+#include "sm-options.c"
+#include "sm-context.c"
+#include "sm-trace.c"
+#include "jump-opt-ctrl.c"
+#include "sm-forward.c"
+#include "sm-rtrace.c"
+#include "sm-cycles.c"
+#include "sm-isa.c"
 
 i16 mux_2(int ctrl, i16 a, i16 b)
 {
@@ -260,7 +203,7 @@ i16 alu(u4 fn, u4 rnumb,
   case  1: aluR =  regb  +  rega;                 break;  // add         2
   case  2: aluR =  regb  -  rega;                 break;  // sub         2
   case  3: aluR =  regb  *  rega;                 break;  // mul         2
-  case  4: aluR =  regb  /  rega;                 break;  // div         2
+  case  4: aluR = sm_div( regb, rega );           break;  // div         2
   case  5: aluR =  regb  ^  rega;                 break;  // xor         2
   case  6: aluR =  regb  &  rega;                 break;  // and         2
   case  7: aluR =  regb  |  rega;                 break;  // lor         2
@@ -278,76 +221,283 @@ i16 alu(u4 fn, u4 rnumb,
   return aluR;
 }
 
-// The state of the pipelined SM.
-
-i16  pipe_mem[ MEMSIZE ];
-i16  pipe_reg[ REGS ];
-u16  pipe_pc;
-
-int paused = 0;
-d_register pause_caused_byE,pause_caused_byM, pause_caused_byW;
-int pause_counter = 0;
-int stage = 0;
-
-void unblock_pipe (){
-  if(paused){
-    if (pause_counter == stage -1){
-      pause_counter = 0;  
-      paused = 0;
-      printf("unblocked\n");
-      switch(stage){
-        case 1: cD = pause_caused_byW; break;
-        case 2: cD = pause_caused_byM; break;
-        case 3: cD = pause_caused_byE; break;
+void unblock_pipe (sm_context *sm){
+  if(sm->paused){
+    if (sm->pause_counter == sm->stage -1){
+      sm->pause_counter = 0;  
+      sm->paused = 0;
+      SM_LOG(LOG_HAZARD, "unblocked\n");
+      switch(sm->stage){
+        case 1: sm->cD = sm->pause_caused_byW; break;
+        case 2: sm->cD = sm->pause_caused_byM; break;
+        case 3: sm->cD = sm->pause_caused_byE; break;
         default: break;
       }
     }else {
-      pause_counter ++;
-      printf("counter is %d\n",pause_counter);
+      sm->pause_counter ++;
+      SM_LOG(LOG_HAZARD, "counter is %d\n",sm->pause_counter);
     }
   }
 }
 
-void determine_stage (){
-  if (!paused){
-    if (mem_alu_opt_ctrl(cE.fn, cE.rnuma, cE.rnumb, cE.rnumc, cD.fn, cD.rnuma, cD.rnumb, cD.rnumc))
-      stage = 3;
-    else if( mem_alu_opt_ctrl(cM.fn, cM.rnuma, cM.rnumb, cM.rnumc, cD.fn, cD.rnuma, cD.rnumb, cD.rnumc))
-      stage = 2;
-    else if(mem_alu_opt_ctrl(cW.fn, cW.rnuma, cW.rnumb, cW.rnumc, cD.fn, cD.rnuma, cD.rnumb, cD.rnumc))
-      stage = 1;
-    else stage = 0;
+void determine_stage (sm_context *sm){
+  if (!sm->paused){
+    if (mem_alu_opt_ctrl(sm->cE.fn, sm->cE.rnuma, sm->cE.rnumb, sm->cE.rnumc, sm->cD.fn, sm->cD.rnuma, sm->cD.rnumb, sm->cD.rnumc))
+      sm->stage = 3;
+    else if( mem_alu_opt_ctrl(sm->cM.fn, sm->cM.rnuma, sm->cM.rnumb, sm->cM.rnumc, sm->cD.fn, sm->cD.rnuma, sm->cD.rnumb, sm->cD.rnumc))
+      sm->stage = 2;
+    else if(mem_alu_opt_ctrl(sm->cW.fn, sm->cW.rnuma, sm->cW.rnumb, sm->cW.rnumc, sm->cD.fn, sm->cD.rnuma, sm->cD.rnumb, sm->cD.rnumc))
+      sm->stage = 1;
+    else sm->stage = 0;
   }
-  printf("stage = %d\n",stage);
+  SM_LOG(LOG_HAZARD, "stage = %d\n",sm->stage);
 
 }
 
 // block num_clocks cycles if next stage needs previous 1,2,3 stages' alu result
 // stage is how many clocks that we need to pause, E = 3, M = 2, W = 1
-void block_pipe(){
-  if(!paused){
-    if(stage){
-      paused = 1; 
-      printf("blocked\n");
-      switch(stage){
-        case 1: pause_caused_byW = cD; break;
-        case 2: pause_caused_byM = cD; break;
-        case 3: pause_caused_byE = cD; break;
+void block_pipe(sm_context *sm){
+  if(!sm->paused){
+    if(sm->stage){
+      sm->paused = 1; 
+      SM_LOG(LOG_HAZARD, "blocked\n");
+      switch(sm->stage){
+        case 1: sm->pause_caused_byW = sm->cD; break;
+        case 2: sm->pause_caused_byM = sm->cD; break;
+        case 3: sm->pause_caused_byE = sm->cD; break;
         default: break;
       }
-      cD.fn    = 0;
-      cD.rnumc = 0;
-      cD.rnumb = 7;
-      cD.rnuma = 0;
-      cD.valP  = 0;        
+      sm->cD.fn    = 0;
+      sm->cD.rnumc = 0;
+      sm->cD.rnumb = 7;
+      sm->cD.rnuma = 0;
+      sm->cD.valP  = 0;
+      sm->cD.tid   = 0;
     }
   }
 }
 
-void jump_detect(){
-  if(pc_ctrl(cD.fn,cD.rnuma,cD.rnumb,cD.rnumc)){
-    paused = 1;
-    stage = 4;
+// With a predictor (-p), fetch only pauses for a control instruction
+// it predicted taken without knowing where to; with -D, never for jump
+// and bra, which decode resolves.
+void jump_detect(sm_context *sm){
+  int early = sm->early && (sm->cD.rnumb == 5 || sm->cD.rnumb == 6);
+
+  if(pc_ctrl(sm->cD.fn,sm->cD.rnuma,sm->cD.rnumb,sm->cD.rnumc) &&
+     (!sm->speculate || (sm->cD.ptaken && sm->cD.pnext == sm->cD.valP && !early))){
+    sm->paused = 1;
+    sm->stage = 4;
+    SM_LOG(LOG_CONTROL, "control pause at %d\n", sm->cD.valP - 1);
+  }
+}
+
+// Squash the instruction in a pipe register, leaving a bubble.
+#define SQUASH( r ) \
+  do { if ( ( r ).fn || ( r ).rnumb != 7 ) sm->perf.squashed++; \
+       memset( &( r ), 0, sizeof( r ) ); ( r ).rnumb = 7; } while ( 0 )
+
+// Put the return address stack back as fetch left it just after the
+// instruction at valP - 1, from the state it had before.
+void ras_repair(sm_context *sm, u4 fn, u4 rnumb, u16 valP, u16 rmark, u16 rtop){
+  long overflows = sm->ras.overflows, underflows = sm->ras.underflows;
+
+  if(!sm->ras.depth)
+    return;
+  ras_restore(&sm->ras, rmark, rtop);
+  if(!fn && rnumb == 3)
+    ras_push(&sm->ras, valP);
+  else if(!fn && rnumb == 4)
+    ras_pop(&sm->ras);
+  sm->ras.overflows = overflows;
+  sm->ras.underflows = underflows;
+}
+
+// -S: fetch goes straight on past control instructions, which take
+// effect after their delay slots.  Write-back files the target of a
+// taken one under the number of the fetch just past its slots, and
+// squashes whatever fetch already got from there on.
+void delay_resolve(sm_context *sm, int pc_sel, u16 target){
+  u16 s = sm->cW.seq + sm->delay + 1;
+
+  // No fetch goes back to this one now.
+  if((sm->cW.fn || sm->cW.rnumb != 7) && sm->delay_seq[ sm->cW.seq & 15 ] == sm->cW.seq)
+    sm->delay_set[ sm->cW.seq & 15 ] = 0;
+  if(!pc_sel || ((sm->cW.rnumb == 5 || sm->cW.rnumb == 6) && !sm->cW.valC))
+    return;
+  sm->delay_taken++;
+  sm->delay_seq[ s & 15 ] = s;
+  sm->delay_target[ s & 15 ] = target;
+  sm->delay_set[ s & 15 ] = 1;
+  SM_LOG(LOG_CONTROL, "redirect to %d after %d slots\n", target, sm->delay);
+  if((i16)(sm->fseq - s) > 0){
+    if((i16)(sm->cM.seq - s) >= 0)
+      SQUASH(sm->cM);
+    if((i16)(sm->cE.seq - s) >= 0)
+      SQUASH(sm->cE);
+    if((i16)(sm->cD.seq - s) >= 0)
+      SQUASH(sm->cD);
+    sm->fseq = s;
+  }
+}
+
+// -S: number the fetch, and go where a delayed control instruction
+// said this one goes, if any did.
+void delay_fetch(sm_context *sm){
+  int i = sm->fseq & 15;
+
+  if(sm->delay_set[ i ] && sm->delay_seq[ i ] == sm->fseq)
+    sm->pipe_pc = sm->delay_target[ i ];
+  sm->nD.seq = sm->fseq++;
+}
+
+// With a speculative fetch (-p, -D), check the control instruction in
+// write-back against the path fetch took after it.  On a wrong path the
+// younger instructions in decode, execute and memory are squashed
+// before they run, any stall they were in is dropped, and fetch is
+// redirected.
+void resolve_branch(sm_context *sm){
+  int pc_sel = pc_ctrl(sm->cW.fn, sm->cW.rnuma, sm->cW.rnumb, sm->cW.rnumc);
+  u16 target = mux_4(pc_sel, sm->cF.pc, sm->cW.aluR, sm->cW.memV, sm->cW.valC);
+
+  sm->redirect = 0;
+  if(sm->delayed){
+    delay_resolve(sm, pc_sel, target);
+    return;
+  }
+  if(!sm->speculate || !pc_sel)
+    return;
+  int taken = sm->cW.rnumb == 5 || sm->cW.rnumb == 6 ? sm->cW.valC != 0 : 1;
+  if(sm->bp.kind && !sm->early && (sm->cW.rnumb == 5 || sm->cW.rnumb == 6))   // jump, bra; -D: in decode
+    bp_resolve(&sm->bp, sm->cW.valP - 1, sm->cW.phist, sm->cW.ptaken, taken);
+  if(sm->ras.depth && sm->cW.rnumb == 4 && sm->cW.rmark >> 8){
+    // fetch took the target of this return from the stack.
+    sm->ras.predicted++;
+    if(target != sm->cW.pnext)
+      sm->ras.wrong++;
+  }
+  if(sm->btb.sets && taken){
+    // pnext is off the fall-through only when the BTB gave the target.
+    if(sm->cW.ptaken && sm->cW.pnext != sm->cW.valP && target != sm->cW.pnext)
+      sm->btb.mistargets++;
+    btb_update(&sm->btb, sm->cW.valP - 1, target);
+  }
+  if(target != sm->cW.pnext){
+    SQUASH(sm->cD);
+    SQUASH(sm->cE);
+    SQUASH(sm->cM);
+    sm->bp.redirects++;
+    SM_LOG(LOG_CONTROL, "redirect to %d\n", target);
+    // The history as fetch left it after this, had it gone the right way.
+    if(sm->cW.rnumb == 5 || sm->cW.rnumb == 6)
+      sm->bp.hist = sm->cW.phist << 1 | taken;
+    else
+      sm->bp.hist = sm->cW.phist;
+    ras_repair(sm, sm->cW.fn, sm->cW.rnumb, sm->cW.valP, sm->cW.rmark, sm->cW.rtop);
+    sm->paused = 0;
+    sm->pause_counter = 0;
+    sm->stage = 0;
+    sm->redirect = 1;
+  }
+}
+
+// With a speculative fetch (-p, -D), fetch runs ahead of stores; a
+// store memory just made to an instruction fetched after it (a call
+// pushing onto its target, say) squashes everything fetched after the
+// store, and fetch starts again behind it.
+void store_check(sm_context *sm){
+  u16 addr = mux_2(addr_ctrl(sm->cM.fn, sm->cM.rnuma, sm->cM.rnumb, sm->cM.rnumc), sm->cM.aluR, sm->cM.valA);
+  d_register *held = NULL;
+
+  if(!sm->speculate ||
+     mem_access_ctrl(sm->cM.fn, sm->cM.rnuma, sm->cM.rnumb, sm->cM.rnumc) != MWRITE)
+    return;
+  if(sm->paused && sm->stage < 4)
+    held = sm->stage == 1 ? &sm->pause_caused_byW :
+           sm->stage == 2 ? &sm->pause_caused_byM : &sm->pause_caused_byE;
+  if(!((sm->nM.fn || sm->nM.rnumb != 7) && sm->nM.valP - 1 == addr) &&
+     !((sm->nE.fn || sm->nE.rnumb != 7) && sm->nE.valP - 1 == addr) &&
+     !((sm->nD.fn || sm->nD.rnumb != 7) && sm->nD.valP - 1 == addr) &&
+     !(held && held->valP - 1 == addr))
+    return;
+
+  // The store's own path goes on behind it: to its target for call,
+  // unless that is after delay slots.
+  u16 next = pc_ctrl(sm->cM.fn, sm->cM.rnuma, sm->cM.rnumb, sm->cM.rnumc) && !sm->delayed ?
+             sm->cM.valC : sm->cM.valP;
+  SQUASH(sm->nM);
+  SQUASH(sm->nE);
+  SQUASH(sm->nD);
+  sm->nF.pc = sm->pipe_pc = next;
+  sm->nW.pnext = next;
+  sm->bp.hist = sm->cM.phist;
+  ras_repair(sm, sm->cM.fn, sm->cM.rnumb, sm->cM.valP, sm->cM.rmark, sm->cM.rtop);
+  sm->fseq = sm->cM.seq + 1;
+  sm->paused = 0;
+  sm->pause_counter = 0;
+  sm->stage = 0;
+}
+
+// -D: resolve the jump or bra decode just read its operands for.  When
+// fetch went elsewhere after it this cycle, the instruction it fetched
+// is squashed and fetch goes to the right place in the next one, so a
+// wrong path costs one slot instead of three.
+void early_branch(sm_context *sm){
+  if(!sm->early || sm->nE.fn || (sm->nE.rnumb != 5 && sm->nE.rnumb != 6))
+    return;
+  int taken = sm->nE.valC != 0;
+  u16 target = alu(sm->nE.fn, sm->nE.rnumb, sm->nE.valA, sm->nE.valB,
+                   sm->nE.valC, sm->nE.data, sm->nE.valP);
+
+  sm->early_branches++;
+  sm->early_taken += taken;
+  if(sm->bp.kind)
+    bp_resolve(&sm->bp, sm->nE.valP - 1, sm->nE.phist, sm->nE.ptaken, taken);
+  if(sm->btb.sets && taken && sm->nE.ptaken && sm->nE.pnext != sm->nE.valP && target != sm->nE.pnext)
+    sm->btb.mistargets++;
+  if(target != sm->nE.pnext){
+    if(sm->ras.depth)   // fetch's push or pop for the squashed instruction
+      ras_restore(&sm->ras, sm->nD.rmark, sm->nD.rtop);
+    SQUASH(sm->nD);
+    sm->nF.pc = sm->pipe_pc = target;
+    sm->bp.hist = sm->nE.phist << 1 | taken;
+    sm->bp.redirects++;
+    SM_LOG(LOG_CONTROL, "early redirect to %d\n", target);
+  }
+  // Write-back finds it on the path fetch took.
+  sm->nE.ptaken = taken;
+  sm->nE.pnext = target;
+}
+
+// Predict the control instruction fetch just put in nD: jump and bra
+// by the predictor, if any, or not taken; call and return taken but for
+// -p flush.  Fetch goes next to where the return address stack says a
+// return goes or, for the rest, where the BTB says a taken one goes, if
+// they know.
+void predict(sm_context *sm){
+  sm->nD.phist = sm->bp.hist;
+  sm->nD.rmark = ras_mark(&sm->ras);
+  sm->nD.rtop = sm->ras.addr[ sm->ras.top ];
+  sm->nD.ptaken = 0;
+  if(!sm->speculate || sm->delayed || sm->paused ||
+     !pc_ctrl(sm->nD.fn, sm->nD.rnuma, sm->nD.rnumb, sm->nD.rnumc))
+    return;
+  if(sm->nD.rnumb == 5 || sm->nD.rnumb == 6)
+    sm->nD.ptaken = sm->bp.kind && bp_predict(&sm->bp, sm->nD.valP - 1);
+  else
+    sm->nD.ptaken = sm->bp.kind != BP_FLUSH;
+  if(sm->ras.depth && sm->nD.rnumb == 3)
+    ras_push(&sm->ras, sm->nD.valP);
+  if(sm->ras.depth && sm->nD.rnumb == 4){
+    int target = ras_pop(&sm->ras);
+    if(target >= 0){
+      sm->pipe_pc = target;
+      return;
+    }
+  }
+  if(sm->nD.ptaken && sm->btb.sets){
+    int target = btb_lookup(&sm->btb, sm->nD.valP - 1);
+    if(target >= 0)
+      sm->pipe_pc = target;
   }
 }
 
@@ -357,172 +507,251 @@ void jump_detect(){
 #define NO_MEM_ACCESS 2
 
 // Fetch stage
-void fetch()
+void fetch(sm_context *sm)
 {
 
-  int pc_sel = pc_ctrl(cW.fn, cW.rnuma, cW.rnumb, cW.rnumc);
-  pipe_pc = mux_4(pc_sel, cF.pc, cW.aluR, cW.memV, cW.valC);
-  u16 instruction = mux_2(paused, pipe_mem[ pipe_pc ], 0x0070);
-  if(!paused) {
-    pipe_pc++;
-  }
+  int pc_sel = pc_ctrl(sm->cW.fn, sm->cW.rnuma, sm->cW.rnumb, sm->cW.rnumc);
+  sm->pipe_pc = mux_4(pc_sel, sm->cF.pc, sm->cW.aluR, sm->cW.memV, sm->cW.valC);
+  // A predicting fetch is already on the path the instruction in
+  // write-back takes, unless resolve_branch found it on a wrong one.
+  if(sm->speculate && !sm->redirect)
+    sm->pipe_pc = sm->cF.pc;
+  if(sm->delayed && !sm->paused)
+    delay_fetch(sm);
+  u16 instruction = mux_2(sm->paused, sm->pipe_mem[ sm->pipe_pc ], 0x0070);
+  if(!sm->paused) {
+    sm->pipe_pc++;
+  } else
+    perf_pause(&sm->perf, sm->stage);
   // Update the nD register
-  nD.fn    = (instruction >> 12) & BITS_4;
-  nD.rnumc = (instruction >>  8) & BITS_4;
-  nD.rnumb = (instruction >>  4) & BITS_4;
-  nD.rnuma = (instruction      ) & BITS_4;
-  nD.valP  = pipe_pc;
+  sm->nD.fn    = (instruction >> 12) & BITS_4;
+  sm->nD.rnumc = (instruction >>  8) & BITS_4;
+  sm->nD.rnumb = (instruction >>  4) & BITS_4;
+  sm->nD.rnuma = (instruction      ) & BITS_4;
+  sm->nD.valP  = sm->pipe_pc;
+  sm->nD.tid   = !sm->paused ? ++sm->fetched : 0;
+  predict(sm);
+  sm->nD.pnext = sm->pipe_pc;
 
   // Update the nF register
-  nF.pc = pipe_pc;
+  sm->nF.pc = sm->pipe_pc;
   //pc not incremented
 
 }  
 
 // Decode stage
-void decode()
+void decode(sm_context *sm)
 {
-  nE.fn = cD.fn;
-  nE.rnumc = cD.rnumc;
-  nE.rnumb = cD.rnumb;
-  nE.rnuma = cD.rnuma;
-  nE.valC = pipe_reg[cD.rnumc];
-  nE.valB = pipe_reg[cD.rnumb];
-  nE.valA = pipe_reg[cD.rnuma];
-  nE.data = (cD.rnumb << 4) | cD.rnuma;
-
-  nE.valP = cD.valP;
+  sm->nE.fn = sm->cD.fn;
+  sm->nE.rnumc = sm->cD.rnumc;
+  sm->nE.rnumb = sm->cD.rnumb;
+  sm->nE.rnuma = sm->cD.rnuma;
+  sm->nE.valC = forward_reg(sm, sm->cD.rnumc);
+  sm->nE.valB = forward_reg(sm, sm->cD.rnumb);
+  sm->nE.valA = forward_reg(sm, sm->cD.rnuma);
+  sm->nE.data = (sm->cD.rnumb << 4) | sm->cD.rnuma;
+
+  sm->nE.valP = sm->cD.valP;
+  sm->nE.tid = sm->cD.tid;
+  sm->nE.ptaken = sm->cD.ptaken;
+  sm->nE.pnext = sm->cD.pnext;
+  sm->nE.phist = sm->cD.phist;
+  sm->nE.rmark = sm->cD.rmark;
+  sm->nE.rtop = sm->cD.rtop;
+  sm->nE.seq = sm->cD.seq;
 }
 
 
 // Execute stage
-void execute()
+void execute(sm_context *sm)
 {
-  nM.fn = cE.fn;
-  nM.rnumc = cE.rnumc;
-  nM.rnumb = cE.rnumb;
-  nM.rnuma = cE.rnuma;
-
-  nM.aluR = alu(cE.fn, cE.rnumb,
-    cE.valA, cE.valB, cE.valC, cE.data,
-    cE.valP);
-
-  nM.valC = cE.valC;
-  nM.valA = cE.valA;
-  nM.valP = cE.valP;
+  sm->nM.fn = sm->cE.fn;
+  sm->nM.rnumc = sm->cE.rnumc;
+  sm->nM.rnumb = sm->cE.rnumb;
+  sm->nM.rnuma = sm->cE.rnuma;
+
+  sm->nM.aluR = alu(sm->cE.fn, sm->cE.rnumb,
+    sm->cE.valA, sm->cE.valB, sm->cE.valC, sm->cE.data,
+    sm->cE.valP);
+
+  sm->nM.valC = sm->cE.valC;
+  sm->nM.valA = sm->cE.valA;
+  sm->nM.valP = sm->cE.valP;
+  sm->nM.tid = sm->cE.tid;
+  sm->nM.ptaken = sm->cE.ptaken;
+  sm->nM.pnext = sm->cE.pnext;
+  sm->nM.phist = sm->cE.phist;
+  sm->nM.rmark = sm->cE.rmark;
+  sm->nM.rtop = sm->cE.rtop;
+  sm->nM.seq = sm->cE.seq;
 }
 
 // Memory stage
-void memory()
+void memory(sm_context *sm)
 {
-  int mem_access = mem_access_ctrl(cM.fn, cM.rnuma, cM.rnumb, cM.rnumc);
-  int addr_sel = addr_ctrl(cM.fn, cM.rnuma, cM.rnumb, cM.rnumc);
-  int memInput_sel = memInput_ctrl(cM.fn, cM.rnuma, cM.rnumb, cM.rnumc);
+  int mem_access = mem_access_ctrl(sm->cM.fn, sm->cM.rnuma, sm->cM.rnumb, sm->cM.rnumc);
+  int addr_sel = addr_ctrl(sm->cM.fn, sm->cM.rnuma, sm->cM.rnumb, sm->cM.rnumc);
+  int memInput_sel = memInput_ctrl(sm->cM.fn, sm->cM.rnuma, sm->cM.rnumb, sm->cM.rnumc);
 
-  nW.fn = cM.fn;
-  nW.rnumc = cM.rnumc;
-  nW.rnumb = cM.rnumb;
-  nW.rnuma = cM.rnuma;
-  nW.aluR = cM.aluR;
+  sm->nW.fn = sm->cM.fn;
+  sm->nW.rnumc = sm->cM.rnumc;
+  sm->nW.rnumb = sm->cM.rnumb;
+  sm->nW.rnuma = sm->cM.rnuma;
+  sm->nW.aluR = sm->cM.aluR;
 
-  u16 addr = mux_2(addr_sel, cM.aluR, cM.valA);
+  u16 addr = mux_2(addr_sel, sm->cM.aluR, sm->cM.valA);
   // MREAD = 0, MWRITE = 1, NO_MEM_ACCESS = 2
   if(mem_access == MREAD){
-    nW.memV = pipe_mem[addr];  
+    sm->nW.memV = sm->pipe_mem[addr];  
 
 
 
   }
   else if(mem_access == MWRITE)
-    pipe_mem[addr] = mux_3(memInput_sel, cM.valA, cM.valC, cM.valP);
-
-  nW.valC = cM.valC;
+    sm->pipe_mem[addr] = sm->nW.memV = mux_3(memInput_sel, sm->cM.valA, sm->cM.valC, sm->cM.valP + sm->delay);
+
+  sm->nW.valC = sm->cM.valC;
+  sm->nW.valP = sm->cM.valP;
+  sm->nW.addr = addr;
+  sm->nW.tid = sm->cM.tid;
+  sm->nW.ptaken = sm->cM.ptaken;
+  sm->nW.pnext = sm->cM.pnext;
+  sm->nW.phist = sm->cM.phist;
+  sm->nW.rmark = sm->cM.rmark;
+  sm->nW.rtop = sm->cM.rtop;
+  sm->nW.seq = sm->cM.seq;
 }
 
 // Write-back stage
-void write_back()
+void write_back(sm_context *sm)
 {
-  int reg_sel = reg_ctrl(cW.fn, cW.rnuma, cW.rnumb, cW.rnumc);
-  int mem_wb = mem_wb_ctrl(cW.fn, cW.rnuma, cW.rnumb, cW.rnumc);
-  int alu_wb = alu_wb_ctrl(cW.fn, cW.rnuma, cW.rnumb, cW.rnumc);
+  int reg_sel = reg_ctrl(sm->cW.fn, sm->cW.rnuma, sm->cW.rnumb, sm->cW.rnumc);
+  int mem_wb = mem_wb_ctrl(sm->cW.fn, sm->cW.rnuma, sm->cW.rnumb, sm->cW.rnumc);
+  int alu_wb = alu_wb_ctrl(sm->cW.fn, sm->cW.rnuma, sm->cW.rnumb, sm->cW.rnumc);
 
   if(mem_wb){ 
-    pipe_reg[cW.rnumc] = cW.memV;
+    sm->pipe_reg[sm->cW.rnumc] = sm->cW.memV;
     // int a;
     // for(a = 0; a < 16; a += 2)
     //   printf("reg[%d] = %d   reg[%d] = %d\n",a, pipe_reg[a], a+1, pipe_reg[a+1]);
   }
-  if(alu_wb) pipe_reg[mux_2(reg_sel, cW.rnuma, cW.rnumc)] = cW.aluR;
+  if(alu_wb) sm->pipe_reg[mux_2(reg_sel, sm->cW.rnuma, sm->cW.rnumc)] = sm->cW.aluR;
+  if ( sm->rtrace && sm->cW.tid ) // -r: retiring a fetched instruction
+    rt_pipe( sm );
+  if ( sm->rcheck && sm->cW.tid ) // -k
+    rt_check( sm );
  }
 
 // Step the pipe by one clock cycle.
-void pipe_step()
+void pipe_step(sm_context *sm)
 { 
-  jump_detect();
-  unblock_pipe();
-  determine_stage ();
-  block_pipe();
-
-  // Run the five stages on the current pipe register values.
-  fetch();
-  decode();
-  execute();
-  memory();
-  write_back();
+  resolve_branch(sm);
+
+  if ( sm->forward ) {
+    int hold = load_use(sm);
+    u16 hist = sm->bp.hist;
+    u16 rmark = ras_mark(&sm->ras), rtop = sm->ras.addr[ sm->ras.top ];
+    u16 fseq = sm->fseq;
+
+    // A jump held for a load starts its pause once the hold is over.
+    if ( ! hold )
+      jump_detect(sm);
+    unblock_pipe(sm);
+
+    // Run the stages from write-back to fetch, so that decode can take
+    // its operands from the results of this cycle; see sm-forward.c.
+    write_back(sm);
+    memory(sm);
+    execute(sm);
+    decode(sm);
+    fetch(sm);
+    if ( hold ) {
+      hold_decode(sm);
+      sm->bp.hist = hist;   // the fetch is done again next cycle
+      ras_restore(&sm->ras, rmark, rtop);
+      sm->fseq = fseq;
+    } else
+      early_branch(sm);
+  } else {
+    jump_detect(sm);
+    unblock_pipe(sm);
+    determine_stage (sm);
+    block_pipe(sm);
+
+    // Run the five stages on the current pipe register values.
+    fetch(sm);
+    decode(sm);
+    execute(sm);
+    memory(sm);
+    write_back(sm);
+  }
+  store_check(sm);
+
+  if ( sm->trace ) // -T
+    trace_pipe( sm );
+  if ( sm->cycles ) // -C
+    cy_pipe( sm );
+
+  // Count the cycle, and the instruction or bubble write_back finished
+  // in it; see sm-perf.c.
+  perf_cycle( &sm->perf, sm->cW.fn, sm->cW.rnumb );
+  if ( sm->prof ) // -H
+    prof_cycle( sm->prof, sm->perf.cycles, sm->cW.fn, sm->cW.rnumb, sm->cW.valP );
+
   // Update the current pipe registers with their next value.
-  cF = nF;
-  cD = nD;
-  cE = nE;
-  cM = nM;
-  cW = nW;
+  sm->cF = sm->nF;
+  sm->cD = sm->nD;
+  sm->cE = sm->nE;
+  sm->cM = sm->nM;
+  sm->cW = sm->nW;
 }
 
 // Initialize current pipeline registers.
-void init_pipeline_regs() {
+void init_pipeline_regs(sm_context *sm) {
   // F register
-  cF.pc = 0;
+  sm->cF.pc = sm->pipe_pc;   // the entry pc sm_load set, 0 by default
 
   // D register
-  cD.fn = 0;
-  cD.rnumc = 0;
-  cD.rnumb = 0;
-  cD.rnuma = 0;
-  cD.valP = 0;
+  sm->cD.fn = 0;
+  sm->cD.rnumc = 0;
+  sm->cD.rnumb = 0;
+  sm->cD.rnuma = 0;
+  sm->cD.valP = 0;
 
   // E register
-  cE.fn = 0;
-  cE.rnumc = 0;
-  cE.rnumb = 0;
-  cE.rnuma = 0;
-  cE.valC = 0;
-  cE.valB = 0;
-  cE.valA = 0;
-  cE.data = 0;
-  cE.valP = 0;
+  sm->cE.fn = 0;
+  sm->cE.rnumc = 0;
+  sm->cE.rnumb = 0;
+  sm->cE.rnuma = 0;
+  sm->cE.valC = 0;
+  sm->cE.valB = 0;
+  sm->cE.valA = 0;
+  sm->cE.data = 0;
+  sm->cE.valP = 0;
 
   // M register
-  cM.fn = 0;
-  cM.rnumc = 0;
-  cM.rnumb = 0;
-  cM.rnuma = 0;
-  cM.aluR = 0;
-  cM.valC = 0;
-  cM.valA = 0;
-  cM.valP = 0;
+  sm->cM.fn = 0;
+  sm->cM.rnumc = 0;
+  sm->cM.rnumb = 0;
+  sm->cM.rnuma = 0;
+  sm->cM.aluR = 0;
+  sm->cM.valC = 0;
+  sm->cM.valA = 0;
+  sm->cM.valP = 0;
 
   // W register
-  cW.fn = 0;
-  cW.rnumc = 0;
-  cW.rnumb = 0;
-  cW.rnuma = 0;
-  cW.aluR = 0;
-  cW.memV = 0;
-  cW.valC = 0;
+  sm->cW.fn = 0;
+  sm->cW.rnumc = 0;
+  sm->cW.rnumb = 0;
+  sm->cW.rnuma = 0;
+  sm->cW.aluR = 0;
+  sm->cW.memV = 0;
+  sm->cW.valC = 0;
 }
 
 // Compare routine
 
-int compare_ISA_to_pipeline_prog_state () {
+int compare_ISA_to_pipeline_prog_state (sm_context *sm) {
   unsigned int i;
 
   // if ( pc != pipe_pc ) {
@@ -538,57 +767,115 @@ int compare_ISA_to_pipeline_prog_state () {
   // }
 
   for( i = 0; i < REGS; i++ )
-    if ( reg[ i ] != pipe_reg[ i ] ) {
-      printf( "ERROR:  reg[ %d ] is:  %d, pipe_reg[ %d ] is: %d.\n", i, reg[i], i, pipe_reg[i] );
+    if ( sm->reg[ i ] != sm->pipe_reg[ i ] ) {
+      SM_PRINTF( "ERROR:  reg[ %d ] is:  %d, pipe_reg[ %d ] is: %d.\n", i, sm->reg[i], i, sm->pipe_reg[i] );
       int a;
       for(a = 0; a < 16; a += 2)
-        printf("reg[%d] = %d   reg[%d] = %d\n",a, reg[a], a+1, reg[a+1]);
-      printf("\n");
+        SM_PRINTF("reg[%d] = %d   reg[%d] = %d\n",a, sm->reg[a], a+1, sm->reg[a+1]);
+      SM_PRINTF("\n");
       for(a = 0; a < 16; a += 2)
-        printf("pipe_reg[%d] = %d   pipe_reg[%d] = %d\n",a, pipe_reg[a], a+1, pipe_reg[a+1]);
+        SM_PRINTF("pipe_reg[%d] = %d   pipe_reg[%d] = %d\n",a, sm->pipe_reg[a], a+1, sm->pipe_reg[a+1]);
       return( 0 );
     }
 
   for( i = 0; i < MEMSIZE; i++ )
-    if ( mem[ i ] != pipe_mem[ i ] ) {
-      printf( "ERROR:  mem[ %d ] is:  %d, pipe_mem[ %d ] is: %d.\n", i, mem[i], i, pipe_mem[i] );
-      exit( 0 );
+    if ( sm->mem[ i ] != sm->pipe_mem[ i ] ) {
+      SM_PRINTF( "ERROR:  mem[ %d ] is:  %d, pipe_mem[ %d ] is: %d.\n", i, sm->mem[i], i, sm->pipe_mem[i] );
+      return( 0 );
     }
 
   return( 1 );
 }
 
-void print_sm_state() {
+void print_sm_state(sm_context *sm) {
   unsigned int i;
 
   printf( "Program Counter (PC),       %6d,   HEX:  %4x\n\n",
-	  (u16) pc, (u16) pc );
+	  (u16) sm->pc, (u16) sm->pc );
 
   printf( "Reg number, Integer, Natural,  Hex\n" );
   for ( i = 0; i < REGS; i++ )
-    printf( "Reg  %4d:  %7d, %7u,  %4x\n", i, reg[ i ], (u16) reg[ i ], (u16) reg[ i ] );
+    printf( "Reg  %4d:  %7d, %7u,  %4x\n", i, sm->reg[ i ], (u16) sm->reg[ i ], (u16) sm->reg[ i ] );
 
   printf( "\n" );
 
   printf( "Mem address, Integer, Natural,  Hex\n" );
   for ( i = 0; i < 54; i++ )
-    printf( "Mem  %6d: %7d, %7u,  %4x\n", i, mem[ i ], (u16) mem[ i ], (u16) mem[ i ] );
+    printf( "Mem  %6d: %7d, %7u,  %4x\n", i, sm->mem[ i ], (u16) sm->mem[ i ], (u16) sm->mem[ i ] );
+}
+
+
+// Run the pipeline for up to pipe_count cycles, stopping early once it
+// has drained.  Returns the number of cycles counted.
+long pipe_run( sm_context *sm, long pipe_count )
+{
+  long i;
+
+  for ( i = 0; i < pipe_count; i++ ){
+    SM_LOG(LOG_FETCH, "pipe_pc = %d\n",sm->pipe_pc);
+    pipe_step( sm );
+    if((!sm->cD.fn) && (sm->cD.rnumb == 7))
+      i--;
+    if(!sm->cW.fn && !sm->cW.rnumc&& !sm->cW.rnumb && !sm->cW.rnuma && 
+       !sm->cD.fn && !sm->cD.rnumc&& !sm->cD.rnumb && !sm->cD.rnuma &&
+       !sm->cE.fn && !sm->cE.rnumc&& !sm->cE.rnumb && !sm->cE.rnuma &&
+       !sm->cM.fn && !sm->cM.rnumc&& !sm->cM.rnumb && !sm->cM.rnuma)
+      break;
+  }
+  return i;
 }
 
+// -D: run program name again, quietly, with jump and bra resolved in
+// write-back, and print what resolving them in decode saved per taken
+// branch, if both runs ran the same program (same_run).
+void early_compare( sm_context *sm, char *name, long pipe_count )
+{
+  sm_context *ref = sm_new();
+  int verbose = sm_verbose;
+
+  ref->early = 0;
+  ref->speculate = ref->bp.kind != BP_NONE;
+  sm_load( ref, name );
+  init_pipeline_regs( ref );
+  sm_verbose = 0;
+  pipe_run( ref, pipe_count );
+  sm_verbose = verbose;
+
+  printf( "Write-back resolution: %ld cycles, %ld instructions retired, CPI %.3f; ",
+          ref->perf.cycles, ref->perf.retired, cpi( ref ) );
+  if ( same_run( sm, ref ) )
+    printf( "decode resolution divides the CPI by %.3f and saves %ld cycles, "
+            "%.2f per taken branch (%ld of %ld taken).\n",
+            cpi( sm ) ? cpi( ref ) / cpi( sm ) : 0.0,
+            ref->perf.cycles - sm->perf.cycles,
+            sm->early_taken ? (double) ( ref->perf.cycles - sm->perf.cycles ) / sm->early_taken : 0.0,
+            sm->early_taken, sm->early_branches );
+  else
+    printf( "it did not complete the same program as the decode-resolution "
+            "run, so there is no saving to report.\n" );
+  sm_free( ref );
+}
+
+#include "sm-batch.c"
 
 int main (int argc, char *argv[], char *env[] )
 {
 
-  #define MAXLINELEN (1000)
-  char buf[ MAXLINELEN ];
   long int i = 0;
-  u32 address;
-  int value_at_address;
   long int count;       // Number of ISA-level instructions to execute
   long int pipe_count;  // Number of pipeline-level cycles to execute
+  sm_context *sm;       // Both machines, ISA-level and pipelined
+
+  // Strip the options; what is left are the three positional arguments.
+  int first = parse_options( argc, argv );
+  argc -= first - 1;
+  argv += first - 1;
+
+  if ( batch_file != NULL )
+    exit( batch_run( batch_file ) );
 
   if ( argc != 4 ) {
-    printf( "Three input arguments: <n> <p> <filename>.\n" );
+    printf( "Three input arguments: [options] <n> <p> <filename>.\n" );
     printf( "where <n> is a positive number of ISA-level instructions to execute,\n" );
     printf( "where <p> is a positive number of pipeline-level cycles to execute, and\n" );
     printf( "<filename> is a file containing lines with address-value pairs.\n\n" );
@@ -600,6 +887,8 @@ int main (int argc, char *argv[], char *env[] )
     printf( "SM ISA-level emulator for 10 steps, run the SM pipeline-level emulator,\n" );
     printf( "compare the state of the ISA-level and pipeline-level emulator, and\n");
     printf( "finally compare the programmer-visible state of the two emulations.\n" );
+    printf( "\n" );
+    print_options();
     exit( 1 );
     }
 
@@ -629,52 +918,42 @@ int main (int argc, char *argv[], char *env[] )
     exit( 1 );
   }
 
-  // Open file for the program.
-  FILE *file = fopen( argv[ 3 ], "r" );
-
-  if ( file == NULL ) {
-    printf( "%s not found.\n", argv[ 3 ] );
-    exit( 1 );
+  sm = sm_new();
+  if ( prof_file != NULL ) // -H
+    sm->prof = prof_new();
+  if ( trace_file != NULL ) // -T
+    sm->trace = trace_open( trace_file );
+  if ( cycles_file != NULL ) // -C
+    sm->cycles = cy_open( cycles_file );
+  if ( rtrace_file != NULL ) // -r
+    sm->rtrace = rt_open( rtrace_file );
+  if ( rcheck_file != NULL ) { // -k
+    sm->rcheck = rt_read_open( rcheck_file );
+    if ( ! rt_read_seek( sm->rcheck, 0, 0 ) ) {
+      printf( "%s has no ISA-level records.\n", rcheck_file );
+      exit( 1 );
+    }
   }
 
   // Read and display input arguments...
 
   printf( "Max number of SM Instructions to execute: %ld.\n", count );
 
-  // Initialize all memory locations and all registers
-  for ( i = 0; i < MEMSIZE - 1; i++ ) {
-    mem[ i ] = 0;
-    pipe_mem[ i ] = 0;
-  }
-
-  for ( i = 0; i < REGS; i++ ) {
-    reg[ i ] = 0;
-    pipe_reg[ i ] = 0;
-  }
-
-  pc = 0;  // Note:  Initial pc is 0.
-  pipe_pc = 0;
+  // Load the program into both memories; sm_new starts both machines
+  // with all memory and registers zero and pc 0.
+  int status = sm_load( sm, argv[ 3 ] );
+  if ( status )
+    exit( status );
 
-  init_pipeline_regs(); // Initialize current pipeline registers.
+  init_pipeline_regs(sm); // Initialize current pipeline registers.
 
-  while( !feof( file ) ) {
-    if ( fgets( buf, MAXLINELEN-1, file ) != NULL )
-      sscanf( buf, "%u %i", &address, &value_at_address );
-    if ( ! ( address < 65536 ) ) {
-      printf( "Out of range address: %u.\n", address );
-      exit( 2 );
-    }
-    if ( ! ( -32768 <= value_at_address && value_at_address < 65536 ) ) {
-      printf( "Out of range value at address: %u, %d.\n", address, value_at_address );
-      exit( 2 );
-    }
+  dcache_flush( sm ); // Program is loaded, nothing is decoded yet.
 
-    mem[ address ] = (i16) value_at_address;
-    pipe_mem[ address ] = (i16) value_at_address;
+  if ( lanes_file != NULL ) { // -l: the lanes replace both runs below
+    lanes_run( sm, count, lanes_file );
+    exit( 0 );
   }
 
-  fclose( file );
-
   // Put some instructions in the memory...
   // I compile to x86 with the following command:
   //   gcc -fno-asynchronous-unwind-tables -O2 -S <prog_to_compile.c>
@@ -688,31 +967,71 @@ int main (int argc, char *argv[], char *env[] )
 
   // Finally, run the program...
 
-  for ( i   = 0; i < count; i++ ){
-    printf("pc = %d\n",pc);
-    micro_step( );
-  }
+  if ( ! isa_run( sm, count ) )
+    exit( 3 );
 
-  for ( i = 0; i < pipe_count; i++ ){
-    printf("pipe_pc = %d\n",pipe_pc);
-    pipe_step( );
-    if((!cD.fn) && (cD.rnumb == 7))
-      i--;
-    if(!cW.fn && !cW.rnumc&& !cW.rnumb && !cW.rnuma && 
-       !cD.fn && !cD.rnumc&& !cD.rnumb && !cD.rnuma &&
-       !cE.fn && !cE.rnumc&& !cE.rnumb && !cE.rnuma &&
-       !cM.fn && !cM.rnumc&& !cM.rnumb && !cM.rnuma)
-      break;
-  }
-  int result = compare_ISA_to_pipeline_prog_state( );
+  i = pipe_run( sm, pipe_count );
+  int result = compare_ISA_to_pipeline_prog_state( sm );
   int a;
   for(a = 0; a < 16; a += 2)
-    printf("reg[%d] = %d   reg[%d] = %d\n",a, reg[a], a+1, reg[a+1]);
+    printf("reg[%d] = %d   reg[%d] = %d\n",a, sm->reg[a], a+1, sm->reg[a+1]);
   printf("\n");
   for(a = 0; a < 16; a += 2)
-    printf("pipe_reg[%d] = %d   pipe_reg[%d] = %d\n",a, pipe_reg[a], a+1, pipe_reg[a+1]);
+    printf("pipe_reg[%d] = %d   pipe_reg[%d] = %d\n",a, sm->pipe_reg[a], a+1, sm->pipe_reg[a+1]);
 
   printf("\nnumber of pipline instructions executed = %ld\n",i);
+  printf( "Pipeline: %ld cycles, %ld instructions retired, CPI %.3f.\n",
+          sm->perf.cycles, sm->perf.retired,
+          sm->perf.retired ? (double) sm->perf.cycles / sm->perf.retired : 0.0 );
+  perf_print( &sm->perf );
+  if ( perf_file != NULL ) // -P
+    perf_write( &sm->perf, SM_VARIANT, argv[ 3 ], perf_file );
+  if ( sm->prof ) // -H
+    prof_report( sm->prof, sm->mem, prof_file );
+  if ( sm->trace ) { // -T
+    printf( "Trace: %u instructions fetched, written to %s.\n", sm->fetched, trace_file );
+    trace_close( sm->trace );
+    sm->trace = NULL;
+  }
+  if ( sm->cycles ) { // -C
+    cy_flush( sm->cycles );
+    printf( "Cycle records: %u cycles, written to %s.\n", sm->cycles->written, cycles_file );
+    cy_close( sm->cycles );
+    sm->cycles = NULL;
+  }
+  if ( sm->rtrace ) { // -r
+    printf( "Retirement trace: %u ISA-level and %u pipeline records, written to %s.\n",
+            sm->rtrace->seq[ 0 ], sm->rtrace->seq[ 1 ], rtrace_file );
+    rt_close( sm->rtrace );
+    sm->rtrace = NULL;
+  }
+  if ( sm->rcheck ) { // -k
+    if ( ! sm->rcheck->mismatched )
+      printf( "Retirement check: %ld instructions retired as in %s.\n",
+              sm->rcheck->matched, rcheck_file );
+    rt_read_close( sm->rcheck );
+    sm->rcheck = NULL;
+  }
+  if ( sm->bp.kind ) // -p
+    printf( "Predictor %s: %ld branches, %ld mispredicted, %.1f%% accurate; "
+            "%ld redirects, %ld slots squashed.\n",
+            bp_name( sm->bp.kind ), sm->bp.branches, sm->bp.mispredicted,
+            sm->bp.branches ? 100.0 * ( sm->bp.branches - sm->bp.mispredicted ) / sm->bp.branches : 100.0,
+            sm->bp.redirects, sm->perf.squashed );
+  if ( sm->btb.sets ) // -B
+    printf( "BTB %d x %d: %ld hits, %ld misses, %ld mistargets.\n",
+            sm->btb.sets, sm->btb.ways, sm->btb.hits, sm->btb.misses, sm->btb.mistargets );
+  if ( sm->ras.depth ) // -R
+    printf( "RAS %d: %ld returns predicted, %ld wrong; %ld overflows, %ld underflows.\n",
+            sm->ras.depth, sm->ras.predicted, sm->ras.wrong,
+            sm->ras.overflows, sm->ras.underflows );
+  if ( sm->delayed ) // -S
+    printf( "Delay slots %d: %ld control transfers, %ld slots squashed.\n",
+            sm->delay, sm->delay_taken, sm->perf.squashed );
+  if ( sm->forward && ! sm->delayed ) // -f: compare with the stall-only pipeline
+    forward_compare( sm, argv[ 3 ], pipe_count );
+  if ( sm->early ) // -D: and with write-back resolution
+    early_compare( sm, argv[ 3 ], pipe_count );
   // Output final RAX value.
 
   // printf( "Final value of R0 is: %d.\n", reg[ 0 ] );
@@ -730,7 +1049,7 @@ int main (int argc, char *argv[], char *env[] )
 // print_sm_state can be changes to print more or less, or maybe
 // changed so that it also prints memory locations starting at 4096!
 
-//  print_sm_state(); // Print partial state.
+//  print_sm_state(sm); // Print partial state.
 
   exit( !result );
 }
@@ -5,15 +5,13 @@
 
  Version 0.7   circa April, 2016
 
-  gcc -fno-asynchronous-unwind-tables -Wall -O2 -o sm mem-alu-opt-sm.c
+  gcc -fno-asynchronous-unwind-tables -Wall -O2 -pthread -o sm mem-alu-opt-sm.c
 */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 
-#include "mem-alu-opt-pipeline-ctrl.c"
-
 typedef unsigned short u4;
 typedef unsigned short u8;
 typedef unsigned short u16;
@@ -66,94 +64,6 @@ u16 bit_reverse( u16 n )
 #define DATA_SHIFT (0)
 
 
-// The state of SM.
-
-i16  mem[ MEMSIZE ];
-i16  reg[ REGS ];
-u16  pc;
-
-void micro_step( )
-{
-  u16 instruction = (u16) mem[ pc ];
-  pc = (u16) pc + 1;         // Increment program counter
-
-  u16 fn    = (u16) ((instruction >> 12) & BITS_4);
-  u16 rnumc = (u16) ((instruction >>  8) & BITS_4);
-  u16 rnumb = (u16) ((instruction >>  4) & BITS_4);
-  u16 rnuma = (u16) ((instruction      ) & BITS_4);
-  u16 data  = (u16) ((instruction      ) & BITS_8);
-  u16 addr;
-
-  i16 regc  = reg[ rnumc ];
-  i16 regb  = reg[ rnumb ];
-  i16 rega  = reg[ rnuma ];
-
-  // Instruction-by-instruction debugging statement
-  // printf(" %5d, %2d,  %3d,   %2d,   %2d,   %2d,  %5d,  %5d,  %5d.\n",
-  //        pc-1, fn, data, rnumc, rnumb, rnuma, regc, regb, rega );
-
-  switch ( fn ) {
-  case  0:
-    switch ( rnumb ) {
-    case  0:                                               break;  // noop00        0
-
-    case  1: reg[ rnumc ] = mem[ (u16) rega ];             break;  // ldmem         5
-
-    case  2: mem[ (u16) regc ] = rega;                     break;  // stmem         6
-
-    case  3: rega = rega - 1;                                      //               7
-             reg[ rnuma ] = rega;
-             mem[ (u16) rega ] = pc;
-             pc = (u16) regc;                              break;  // call
-
-    case  4: pc = (u16) mem[ (u16) rega ];                         //               8
-             reg[ rnuma ] = rega + 1;                      break;  // return
-
-    case  5: pc = (regc) ? ((u16) rega)      : pc;         break;  // jump          4
-    case  6: pc = (regc) ? ((u16) rega) + pc : pc;         break;  // bra, branch   4
-
-    case  7:                                               break;  // unassigned    0
-    case  8:                                               break;  // unassigned    0
-
-    case  9: reg[ rnumc ] = ~ rega;                        break;  // not           1
-    case 10: reg[ rnumc ] = - rega;                        break;  // neg, negate   1
-    case 11: reg[ rnumc ] = ! rega;                        break;  // cnot          1
-    case 12: reg[ rnumc ] = pop_count( rega );             break;  // popcnt        1
-    case 13: reg[ rnumc ] = bit_reverse( rega );           break;  // bitrev        1
-
-    case 14: reg[ rnumc ] = mem[ (u16) rega ];                     //               9
-             reg[ rnuma ] = rega + 1;                      break;  // pop
-
-    case 15: addr = (u16) rega - 1;                                //              10
-             mem[ addr ] = regc;
-             reg[ rnuma ] = addr;                          break;  // push
-    default:  break;
-    }                                                      break;  // End of case 0
-  case  1: reg[ rnumc ] =  regb  +  rega;                  break;  // add           2
-  case  2: reg[ rnumc ] =  regb  -  rega;                  break;  // sub           2
-  case  3: reg[ rnumc ] =  regb  *  rega;                  break;  // mul           2
-  case  4: reg[ rnumc ] =  regb  /  rega;                  break;  // div           2
-
-  case  5: reg[ rnumc ] =  regb  ^  rega;                  break;  // xor           2
-  case  6: reg[ rnumc ] =  regb  &  rega;                  break;  // and           2
-  case  7: reg[ rnumc ] =  regb  |  rega;                  break;  // lor           2
-
-  case  8: reg[ rnumc ] =  regb << (rega & 0xF);           break;  // sleft         2
-  case  9: reg[ rnumc ] =  regb >> (rega & 0xF);           break;  // sright        2
-
-  case 10: reg[ rnumc ] =  regb  <  rega;                  break;  // lt            2
-  case 11: reg[ rnumc ] =  regb <=  rega;                  break;  // lteq          2
-
-  case 12: reg[ rnumc ] = (regb) ?  rega : regc;           break;  // cmove         3
-  case 13: reg[ rnumc ] = (regb) ?  rega + regc : regc;    break;  // cadd          3
-
-  case 14: reg[ rnumc ] = (regc & 0xFF00) | data;          break;  // immlow        3
-  case 15: reg[ rnumc ] = (data << 8) | (regc & 0x00FF);   break;  // immhgh        3
-  default: break;
-  }
-}
-
-
 // Pipeline registers
 
 typedef struct{
@@ -166,6 +76,7 @@ typedef struct{
   u4   rnumb;    // rB or subfunction nibble
   u4   rnuma;    // rA
   u16  valP;     // incremented PC
+  u32  tid;      // -T: fetch number, 0 for a bubble
 } d_register;
 
 typedef struct{
@@ -178,6 +89,7 @@ typedef struct{
   i16  valA;     // value of register rA
   u8   data;     // immediate data
   u16  valP;     // incremented PC (same as valP in d_register)
+  u32  tid;      // -T: fetch number, 0 for a bubble
 } e_register;
 
 typedef struct{
@@ -189,6 +101,7 @@ typedef struct{
   i16  valC;     // value of register rC
   i16  valA;     // value of register rA
   u16  valP;     // incremented PC (same as valP in e_register)
+  u32  tid;      // -T: fetch number, 0 for a bubble
 } m_register;
 
 typedef struct{
@@ -197,16 +110,22 @@ typedef struct{
   u4   rnumb;    // rB or subfunction nibble
   u4   rnuma;    // rA
   i16  aluR;     // ALU result
-  i16  memV;     // memory value
+  i16  memV;     // memory value, loaded or stored
   i16  valC;     // value of register rC
+  u16  valP;     // incremented PC (same as valP in m_register)
+  u16  addr;     // memory address accessed
+  u32  tid;      // -T: fetch number, 0 for a bubble
 } w_register;
 
-// Declare the pipeline registers.
-f_register cF, nF;
-d_register cD, nD;
-e_register cE, nE;
-m_register cM, nM;
-w_register cW, nW;
+#define SM_VARIANT "mem-alu-opt"   // this simulator in batch manifests
+#include "sm-options.c"
+#include "sm-context.c"
+#include "sm-trace.c"
+#include "mem-alu-opt-pipeline-ctrl.c"
+#include "sm-forward.c"
+#include "sm-rtrace.c"
+#include "sm-cycles.c"
+#include "sm-isa.c"
 
 i16 mux_2(int ctrl, i16 a, i16 b)
 {
@@ -260,7 +179,7 @@ i16 alu(u4 fn, u4 rnumb,
   case  1: aluR =  regb  +  rega;                 break;  // add         2
   case  2: aluR =  regb  -  rega;                 break;  // sub         2
   case  3: aluR =  regb  *  rega;                 break;  // mul         2
-  case  4: aluR =  regb  /  rega;                 break;  // div         2
+  case  4: aluR = sm_div( regb, rega );           break;  // div         2
   case  5: aluR =  regb  ^  rega;                 break;  // xor         2
   case  6: aluR =  regb  &  rega;                 break;  // and         2
   case  7: aluR =  regb  |  rega;                 break;  // lor         2
@@ -278,68 +197,58 @@ i16 alu(u4 fn, u4 rnumb,
   return aluR;
 }
 
-// The state of the pipelined SM.
-
-i16  pipe_mem[ MEMSIZE ];
-i16  pipe_reg[ REGS ];
-u16  pipe_pc;
-
-int paused = 0;
-d_register pause_caused_byE,pause_caused_byM, pause_caused_byW;
-int pause_counter = 0;
-int stage = 0;
-
-void unblock_pipe (){
-  if(paused){
-    if (pause_counter == stage -1){
-      pause_counter = 0;  
-      paused = 0;
-      printf("unblocked\n");
-      switch(stage){
-        case 1: cD = pause_caused_byW; break;
-        case 2: cD = pause_caused_byM; break;
-        case 3: cD = pause_caused_byE; break;
+void unblock_pipe (sm_context *sm){
+  if(sm->paused){
+    if (sm->pause_counter == sm->stage -1){
+      sm->pause_counter = 0;  
+      sm->paused = 0;
+      SM_LOG(LOG_HAZARD, "unblocked\n");
+      switch(sm->stage){
+        case 1: sm->cD = sm->pause_caused_byW; break;
+        case 2: sm->cD = sm->pause_caused_byM; break;
+        case 3: sm->cD = sm->pause_caused_byE; break;
         default: break;
       }
     }else {
-      pause_counter ++;
-      printf("counter is %d\n",pause_counter);
+      sm->pause_counter ++;
+      SM_LOG(LOG_HAZARD, "counter is %d\n",sm->pause_counter);
     }
   }
 }
 
-void determine_stage (){
-  if (!paused){
-    if (mem_alu_opt_ctrl(cE.fn, cE.rnuma, cE.rnumb, cE.rnumc, cD.fn, cD.rnuma, cD.rnumb, cD.rnumc))
-      stage = 3;
-    else if( mem_alu_opt_ctrl(cM.fn, cM.rnuma, cM.rnumb, cM.rnumc, cD.fn, cD.rnuma, cD.rnumb, cD.rnumc))
-      stage = 2;
-    else if(mem_alu_opt_ctrl(cW.fn, cW.rnuma, cW.rnumb, cW.rnumc, cD.fn, cD.rnuma, cD.rnumb, cD.rnumc))
-      stage = 1;
-    else stage = 0;
+void determine_stage (sm_context *sm){
+  if (!sm->paused){
+    if (mem_alu_opt_ctrl(sm->cE.fn, sm->cE.rnuma, sm->cE.rnumb, sm->cE.rnumc, sm->cD.fn, sm->cD.rnuma, sm->cD.rnumb, sm->cD.rnumc))
+      sm->stage = 3;
+    else if( mem_alu_opt_ctrl(sm->cM.fn, sm->cM.rnuma, sm->cM.rnumb, sm->cM.rnumc, sm->cD.fn, sm->cD.rnuma, sm->cD.rnumb, sm->cD.rnumc))
+      sm->stage = 2;
+    else if(mem_alu_opt_ctrl(sm->cW.fn, sm->cW.rnuma, sm->cW.rnumb, sm->cW.rnumc, sm->cD.fn, sm->cD.rnuma, sm->cD.rnumb, sm->cD.rnumc))
+      sm->stage = 1;
+    else sm->stage = 0;
   }
-  printf("stage = %d\n",stage);
+  SM_LOG(LOG_HAZARD, "stage = %d\n",sm->stage);
 
 }
 
 // block num_clocks cycles if next stage needs previous 1,2,3 stages' alu result
 // stage is how many clocks that we need to pause, E = 3, M = 2, W = 1
-void block_pipe(){
-  if(!paused){
-    if(stage){
-      paused = 1; 
-      printf("blocked\n");
-      switch(stage){
-        case 1: pause_caused_byW = cD; break;
-        case 2: pause_caused_byM = cD; break;
-        case 3: pause_caused_byE = cD; break;
+void block_pipe(sm_context *sm){
+  if(!sm->paused){
+    if(sm->stage){
+      sm->paused = 1; 
+      SM_LOG(LOG_HAZARD, "blocked\n");
+      switch(sm->stage){
+        case 1: sm->pause_caused_byW = sm->cD; break;
+        case 2: sm->pause_caused_byM = sm->cD; break;
+        case 3: sm->pause_caused_byE = sm->cD; break;
         default: break;
       }
-      cD.fn    = 0;
-      cD.rnumc = 0;
-      cD.rnumb = 7;
-      cD.rnuma = 0;
-      cD.valP  = 0;        
+      sm->cD.fn    = 0;
+      sm->cD.rnumc = 0;
+      sm->cD.rnumb = 7;
+      sm->cD.rnuma = 0;
+      sm->cD.valP  = 0;
+      sm->cD.tid   = 0;
     }
   }
 }
@@ -351,171 +260,207 @@ void block_pipe(){
 #define NO_MEM_ACCESS 2
 
 // Fetch stage
-void fetch()
+void fetch(sm_context *sm)
 {
 
-  int pc_sel = pc_ctrl(cW.fn, cW.rnuma, cW.rnumb, cW.rnumc);
-  pipe_pc = mux_4(pc_sel, cF.pc, cW.aluR, cW.memV, cW.valC);
-  u16 instruction = mux_2(paused, pipe_mem[ pipe_pc ], 0x0070);
-  if(!paused) {
-    pipe_pc++;
-  }
+  int pc_sel = pc_ctrl(sm->cW.fn, sm->cW.rnuma, sm->cW.rnumb, sm->cW.rnumc);
+  sm->pipe_pc = mux_4(pc_sel, sm->cF.pc, sm->cW.aluR, sm->cW.memV, sm->cW.valC);
+  u16 instruction = mux_2(sm->paused, sm->pipe_mem[ sm->pipe_pc ], 0x0070);
+  if(!sm->paused) {
+    sm->pipe_pc++;
+  } else
+    perf_pause(&sm->perf, sm->stage);
   // Update the nD register
-  nD.fn    = (instruction >> 12) & BITS_4;
-  nD.rnumc = (instruction >>  8) & BITS_4;
-  nD.rnumb = (instruction >>  4) & BITS_4;
-  nD.rnuma = (instruction      ) & BITS_4;
-  nD.valP  = pipe_pc;
+  sm->nD.fn    = (instruction >> 12) & BITS_4;
+  sm->nD.rnumc = (instruction >>  8) & BITS_4;
+  sm->nD.rnumb = (instruction >>  4) & BITS_4;
+  sm->nD.rnuma = (instruction      ) & BITS_4;
+  sm->nD.valP  = sm->pipe_pc;
+  sm->nD.tid   = !sm->paused ? ++sm->fetched : 0;
 
   // Update the nF register
-  nF.pc = pipe_pc;
+  sm->nF.pc = sm->pipe_pc;
   //pc not incremented
 
 }  
 
 // Decode stage
-void decode()
+void decode(sm_context *sm)
 {
-  nE.fn = cD.fn;
-  nE.rnumc = cD.rnumc;
-  nE.rnumb = cD.rnumb;
-  nE.rnuma = cD.rnuma;
-  nE.valC = pipe_reg[cD.rnumc];
-  nE.valB = pipe_reg[cD.rnumb];
-  nE.valA = pipe_reg[cD.rnuma];
-  nE.data = (cD.rnumb << 4) | cD.rnuma;
-
-  nE.valP = cD.valP;
+  sm->nE.fn = sm->cD.fn;
+  sm->nE.rnumc = sm->cD.rnumc;
+  sm->nE.rnumb = sm->cD.rnumb;
+  sm->nE.rnuma = sm->cD.rnuma;
+  sm->nE.valC = forward_reg(sm, sm->cD.rnumc);
+  sm->nE.valB = forward_reg(sm, sm->cD.rnumb);
+  sm->nE.valA = forward_reg(sm, sm->cD.rnuma);
+  sm->nE.data = (sm->cD.rnumb << 4) | sm->cD.rnuma;
+
+  sm->nE.valP = sm->cD.valP;
+  sm->nE.tid = sm->cD.tid;
 }
 
 
 // Execute stage
-void execute()
+void execute(sm_context *sm)
 {
-  nM.fn = cE.fn;
-  nM.rnumc = cE.rnumc;
-  nM.rnumb = cE.rnumb;
-  nM.rnuma = cE.rnuma;
-
-  nM.aluR = alu(cE.fn, cE.rnumb,
-    cE.valA, cE.valB, cE.valC, cE.data,
-    cE.valP);
-
-  nM.valC = cE.valC;
-  nM.valA = cE.valA;
-  nM.valP = cE.valP;
+  sm->nM.fn = sm->cE.fn;
+  sm->nM.rnumc = sm->cE.rnumc;
+  sm->nM.rnumb = sm->cE.rnumb;
+  sm->nM.rnuma = sm->cE.rnuma;
+
+  sm->nM.aluR = alu(sm->cE.fn, sm->cE.rnumb,
+    sm->cE.valA, sm->cE.valB, sm->cE.valC, sm->cE.data,
+    sm->cE.valP);
+
+  sm->nM.valC = sm->cE.valC;
+  sm->nM.valA = sm->cE.valA;
+  sm->nM.valP = sm->cE.valP;
+  sm->nM.tid = sm->cE.tid;
 }
 
 // Memory stage
-void memory()
+void memory(sm_context *sm)
 {
-  int mem_access = mem_access_ctrl(cM.fn, cM.rnuma, cM.rnumb, cM.rnumc);
-  int addr_sel = addr_ctrl(cM.fn, cM.rnuma, cM.rnumb, cM.rnumc);
-  int memInput_sel = memInput_ctrl(cM.fn, cM.rnuma, cM.rnumb, cM.rnumc);
+  int mem_access = mem_access_ctrl(sm->cM.fn, sm->cM.rnuma, sm->cM.rnumb, sm->cM.rnumc);
+  int addr_sel = addr_ctrl(sm->cM.fn, sm->cM.rnuma, sm->cM.rnumb, sm->cM.rnumc);
+  int memInput_sel = memInput_ctrl(sm->cM.fn, sm->cM.rnuma, sm->cM.rnumb, sm->cM.rnumc);
 
-  nW.fn = cM.fn;
-  nW.rnumc = cM.rnumc;
-  nW.rnumb = cM.rnumb;
-  nW.rnuma = cM.rnuma;
-  nW.aluR = cM.aluR;
+  sm->nW.fn = sm->cM.fn;
+  sm->nW.rnumc = sm->cM.rnumc;
+  sm->nW.rnumb = sm->cM.rnumb;
+  sm->nW.rnuma = sm->cM.rnuma;
+  sm->nW.aluR = sm->cM.aluR;
 
-  u16 addr = mux_2(addr_sel, cM.aluR, cM.valA);
+  u16 addr = mux_2(addr_sel, sm->cM.aluR, sm->cM.valA);
   // MREAD = 0, MWRITE = 1, NO_MEM_ACCESS = 2
   if(mem_access == MREAD){
-    nW.memV = pipe_mem[addr];  
+    sm->nW.memV = sm->pipe_mem[addr];  
 
 
 
   }
   else if(mem_access == MWRITE)
-    pipe_mem[addr] = mux_3(memInput_sel, cM.valA, cM.valC, cM.valP);
+    sm->pipe_mem[addr] = sm->nW.memV = mux_3(memInput_sel, sm->cM.valA, sm->cM.valC, sm->cM.valP);
 
-  nW.valC = cM.valC;
+  sm->nW.valC = sm->cM.valC;
+  sm->nW.valP = sm->cM.valP;
+  sm->nW.addr = addr;
+  sm->nW.tid = sm->cM.tid;
 }
 
 // Write-back stage
-void write_back()
+void write_back(sm_context *sm)
 {
-  int reg_sel = reg_ctrl(cW.fn, cW.rnuma, cW.rnumb, cW.rnumc);
-  int mem_wb = mem_wb_ctrl(cW.fn, cW.rnuma, cW.rnumb, cW.rnumc);
-  int alu_wb = alu_wb_ctrl(cW.fn, cW.rnuma, cW.rnumb, cW.rnumc);
+  int reg_sel = reg_ctrl(sm->cW.fn, sm->cW.rnuma, sm->cW.rnumb, sm->cW.rnumc);
+  int mem_wb = mem_wb_ctrl(sm->cW.fn, sm->cW.rnuma, sm->cW.rnumb, sm->cW.rnumc);
+  int alu_wb = alu_wb_ctrl(sm->cW.fn, sm->cW.rnuma, sm->cW.rnumb, sm->cW.rnumc);
 
   if(mem_wb){ 
-    pipe_reg[cW.rnumc] = cW.memV;
+    sm->pipe_reg[sm->cW.rnumc] = sm->cW.memV;
     // int a;
     // for(a = 0; a < 16; a += 2)
     //   printf("reg[%d] = %d   reg[%d] = %d\n",a, pipe_reg[a], a+1, pipe_reg[a+1]);
   }
-  if(alu_wb) pipe_reg[mux_2(reg_sel, cW.rnuma, cW.rnumc)] = cW.aluR;
+  if(alu_wb) sm->pipe_reg[mux_2(reg_sel, sm->cW.rnuma, sm->cW.rnumc)] = sm->cW.aluR;
+  if ( sm->rtrace && sm->cW.tid ) // -r: retiring a fetched instruction
+    rt_pipe( sm );
+  if ( sm->rcheck && sm->cW.tid ) // -k
+    rt_check( sm );
  }
 
 // Step the pipe by one clock cycle.
-void pipe_step()
+void pipe_step(sm_context *sm)
 { 
-  unblock_pipe();
-  determine_stage ();
-  block_pipe();
-
-  // Run the five stages on the current pipe register values.
-  fetch();
-  decode();
-  execute();
-  memory();
-  write_back();
+  if ( sm->forward ) {
+    int hold = load_use(sm);
+
+    // Run the stages from write-back to fetch, so that decode can take
+    // its operands from the results of this cycle; see sm-forward.c.
+    write_back(sm);
+    memory(sm);
+    execute(sm);
+    decode(sm);
+    fetch(sm);
+    if ( hold )
+      hold_decode(sm);
+  } else {
+    unblock_pipe(sm);
+    determine_stage (sm);
+    block_pipe(sm);
+
+    // Run the five stages on the current pipe register values.
+    fetch(sm);
+    decode(sm);
+    execute(sm);
+    memory(sm);
+    write_back(sm);
+  }
+  if ( sm->trace ) // -T
+    trace_pipe( sm );
+  if ( sm->cycles ) // -C
+    cy_pipe( sm );
+
+  // Count the cycle, and the instruction or bubble write_back finished
+  // in it; see sm-perf.c.
+  perf_cycle( &sm->perf, sm->cW.fn, sm->cW.rnumb );
+  if ( sm->prof ) // -H
+    prof_cycle( sm->prof, sm->perf.cycles, sm->cW.fn, sm->cW.rnumb, sm->cW.valP );
+
   // Update the current pipe registers with their next value.
-  cF = nF;
-  cD = nD;
-  cE = nE;
-  cM = nM;
-  cW = nW;
+  sm->cF = sm->nF;
+  sm->cD = sm->nD;
+  sm->cE = sm->nE;
+  sm->cM = sm->nM;
+  sm->cW = sm->nW;
 }
 
 // Initialize current pipeline registers.
-void init_pipeline_regs() {
+void init_pipeline_regs(sm_context *sm) {
   // F register
-  cF.pc = 0;
+  sm->cF.pc = sm->pipe_pc;   // the entry pc sm_load set, 0 by default
 
   // D register
-  cD.fn = 0;
-  cD.rnumc = 0;
-  cD.rnumb = 0;
-  cD.rnuma = 0;
-  cD.valP = 0;
+  sm->cD.fn = 0;
+  sm->cD.rnumc = 0;
+  sm->cD.rnumb = 0;
+  sm->cD.rnuma = 0;
+  sm->cD.valP = 0;
 
   // E register
-  cE.fn = 0;
-  cE.rnumc = 0;
-  cE.rnumb = 0;
-  cE.rnuma = 0;
-  cE.valC = 0;
-  cE.valB = 0;
-  cE.valA = 0;
-  cE.data = 0;
-  cE.valP = 0;
+  sm->cE.fn = 0;
+  sm->cE.rnumc = 0;
+  sm->cE.rnumb = 0;
+  sm->cE.rnuma = 0;
+  sm->cE.valC = 0;
+  sm->cE.valB = 0;
+  sm->cE.valA = 0;
+  sm->cE.data = 0;
+  sm->cE.valP = 0;
 
   // M register
-  cM.fn = 0;
-  cM.rnumc = 0;
-  cM.rnumb = 0;
-  cM.rnuma = 0;
-  cM.aluR = 0;
-  cM.valC = 0;
-  cM.valA = 0;
-  cM.valP = 0;
+  sm->cM.fn = 0;
+  sm->cM.rnumc = 0;
+  sm->cM.rnumb = 0;
+  sm->cM.rnuma = 0;
+  sm->cM.aluR = 0;
+  sm->cM.valC = 0;
+  sm->cM.valA = 0;
+  sm->cM.valP = 0;
 
   // W register
-  cW.fn = 0;
-  cW.rnumc = 0;
-  cW.rnumb = 0;
-  cW.rnuma = 0;
-  cW.aluR = 0;
-  cW.memV = 0;
-  cW.valC = 0;
+  sm->cW.fn = 0;
+  sm->cW.rnumc = 0;
+  sm->cW.rnumb = 0;
+  sm->cW.rnuma = 0;
+  sm->cW.aluR = 0;
+  sm->cW.memV = 0;
+  sm->cW.valC = 0;
 }
 
 // Compare routine
 
-int compare_ISA_to_pipeline_prog_state () {
+int compare_ISA_to_pipeline_prog_state (sm_context *sm) {
   unsigned int i;
 
   // if ( pc != pipe_pc ) {
@@ -531,57 +476,87 @@ int compare_ISA_to_pipeline_prog_state () {
   // }
 
   for( i = 0; i < REGS; i++ )
-    if ( reg[ i ] != pipe_reg[ i ] ) {
-      printf( "ERROR:  reg[ %d ] is:  %d, pipe_reg[ %d ] is: %d.\n", i, reg[i], i, pipe_reg[i] );
+    if ( sm->reg[ i ] != sm->pipe_reg[ i ] ) {
+      SM_PRINTF( "ERROR:  reg[ %d ] is:  %d, pipe_reg[ %d ] is: %d.\n", i, sm->reg[i], i, sm->pipe_reg[i] );
       int a;
       for(a = 0; a < 16; a += 2)
-        printf("reg[%d] = %d   reg[%d] = %d\n",a, reg[a], a+1, reg[a+1]);
-      printf("\n");
+        SM_PRINTF("reg[%d] = %d   reg[%d] = %d\n",a, sm->reg[a], a+1, sm->reg[a+1]);
+      SM_PRINTF("\n");
       for(a = 0; a < 16; a += 2)
-        printf("pipe_reg[%d] = %d   pipe_reg[%d] = %d\n",a, pipe_reg[a], a+1, pipe_reg[a+1]);
+        SM_PRINTF("pipe_reg[%d] = %d   pipe_reg[%d] = %d\n",a, sm->pipe_reg[a], a+1, sm->pipe_reg[a+1]);
       return( 0 );
     }
 
   for( i = 0; i < MEMSIZE; i++ )
-    if ( mem[ i ] != pipe_mem[ i ] ) {
-      printf( "ERROR:  mem[ %d ] is:  %d, pipe_mem[ %d ] is: %d.\n", i, mem[i], i, pipe_mem[i] );
-      exit( 0 );
+    if ( sm->mem[ i ] != sm->pipe_mem[ i ] ) {
+      SM_PRINTF( "ERROR:  mem[ %d ] is:  %d, pipe_mem[ %d ] is: %d.\n", i, sm->mem[i], i, sm->pipe_mem[i] );
+      return( 0 );
     }
 
   return( 1 );
 }
 
-void print_sm_state() {
+void print_sm_state(sm_context *sm) {
   unsigned int i;
 
   printf( "Program Counter (PC),       %6d,   HEX:  %4x\n\n",
-	  (u16) pc, (u16) pc );
+	  (u16) sm->pc, (u16) sm->pc );
 
   printf( "Reg number, Integer, Natural,  Hex\n" );
   for ( i = 0; i < REGS; i++ )
-    printf( "Reg  %4d:  %7d, %7u,  %4x\n", i, reg[ i ], (u16) reg[ i ], (u16) reg[ i ] );
+    printf( "Reg  %4d:  %7d, %7u,  %4x\n", i, sm->reg[ i ], (u16) sm->reg[ i ], (u16) sm->reg[ i ] );
 
   printf( "\n" );
 
   printf( "Mem address, Integer, Natural,  Hex\n" );
   for ( i = 0; i < 54; i++ )
-    printf( "Mem  %6d: %7d, %7u,  %4x\n", i, mem[ i ], (u16) mem[ i ], (u16) mem[ i ] );
+    printf( "Mem  %6d: %7d, %7u,  %4x\n", i, sm->mem[ i ], (u16) sm->mem[ i ], (u16) sm->mem[ i ] );
 }
 
 
+// Run the pipeline for up to pipe_count cycles, stopping early once it
+// has drained.  Returns the number of cycles counted.
+long pipe_run( sm_context *sm, long pipe_count )
+{
+  long i;
+
+  for ( i = 0; i < pipe_count; i++ ){
+    pipe_step( sm );
+    //if(!((!cD.fn) && (cD.rnumb == 7))) {
+      int a;
+      for(a = 0; a < 16; a += 2)
+        SM_LOG(LOG_STATE, "p_reg[%d] = %d   p_reg[%d] = %d\n",a, sm->pipe_reg[a], a+1, sm->pipe_reg[a+1]);
+      SM_LOG(LOG_STATE, "\n");
+   // }
+      if(!sm->cW.fn && !sm->cW.rnumc&& !sm->cW.rnumb && !sm->cW.rnuma && 
+         !sm->cD.fn && !sm->cD.rnumc&& !sm->cD.rnumb && !sm->cD.rnuma &&
+         !sm->cE.fn && !sm->cE.rnumc&& !sm->cE.rnumb && !sm->cE.rnuma &&
+         !sm->cM.fn && !sm->cM.rnumc&& !sm->cM.rnumb && !sm->cM.rnuma)
+        break;
+  }
+  return i;
+}
+
+#include "sm-batch.c"
+
 int main (int argc, char *argv[], char *env[] )
 {
 
-  #define MAXLINELEN (1000)
-  char buf[ MAXLINELEN ];
   long int i = 0;
-  u32 address;
-  int value_at_address;
   long int count;       // Number of ISA-level instructions to execute
   long int pipe_count;  // Number of pipeline-level cycles to execute
+  sm_context *sm;       // Both machines, ISA-level and pipelined
+
+  // Strip the options; what is left are the three positional arguments.
+  int first = parse_options( argc, argv );
+  argc -= first - 1;
+  argv += first - 1;
+
+  if ( batch_file != NULL )
+    exit( batch_run( batch_file ) );
 
   if ( argc != 4 ) {
-    printf( "Three input arguments: <n> <p> <filename>.\n" );
+    printf( "Three input arguments: [options] <n> <p> <filename>.\n" );
     printf( "where <n> is a positive number of ISA-level instructions to execute,\n" );
     printf( "where <p> is a positive number of pipeline-level cycles to execute, and\n" );
     printf( "<filename> is a file containing lines with address-value pairs.\n\n" );
@@ -593,6 +568,8 @@ int main (int argc, char *argv[], char *env[] )
     printf( "SM ISA-level emulator for 10 steps, run the SM pipeline-level emulator,\n" );
     printf( "compare the state of the ISA-level and pipeline-level emulator, and\n");
     printf( "finally compare the programmer-visible state of the two emulations.\n" );
+    printf( "\n" );
+    print_options();
     exit( 1 );
     }
 
@@ -622,52 +599,42 @@ int main (int argc, char *argv[], char *env[] )
     exit( 1 );
   }
 
-  // Open file for the program.
-  FILE *file = fopen( argv[ 3 ], "r" );
-
-  if ( file == NULL ) {
-    printf( "%s not found.\n", argv[ 3 ] );
-    exit( 1 );
+  sm = sm_new();
+  if ( prof_file != NULL ) // -H
+    sm->prof = prof_new();
+  if ( trace_file != NULL ) // -T
+    sm->trace = trace_open( trace_file );
+  if ( cycles_file != NULL ) // -C
+    sm->cycles = cy_open( cycles_file );
+  if ( rtrace_file != NULL ) // -r
+    sm->rtrace = rt_open( rtrace_file );
+  if ( rcheck_file != NULL ) { // -k
+    sm->rcheck = rt_read_open( rcheck_file );
+    if ( ! rt_read_seek( sm->rcheck, 0, 0 ) ) {
+      printf( "%s has no ISA-level records.\n", rcheck_file );
+      exit( 1 );
+    }
   }
 
   // Read and display input arguments...
 
   printf( "Max number of SM Instructions to execute: %ld.\n", count );
 
-  // Initialize all memory locations and all registers
-  for ( i = 0; i < MEMSIZE - 1; i++ ) {
-    mem[ i ] = 0;
-    pipe_mem[ i ] = 0;
-  }
+  // Load the program into both memories; sm_new starts both machines
+  // with all memory and registers zero and pc 0.
+  int status = sm_load( sm, argv[ 3 ] );
+  if ( status )
+    exit( status );
 
-  for ( i = 0; i < REGS; i++ ) {
-    reg[ i ] = 0;
-    pipe_reg[ i ] = 0;
-  }
-
-  pc = 0;  // Note:  Initial pc is 0.
-  pipe_pc = 0;
-
-  init_pipeline_regs(); // Initialize current pipeline registers.
+  init_pipeline_regs(sm); // Initialize current pipeline registers.
 
-  while( !feof( file ) ) {
-    if ( fgets( buf, MAXLINELEN-1, file ) != NULL )
-      sscanf( buf, "%u %i", &address, &value_at_address );
-    if ( ! ( address < 65536 ) ) {
-      printf( "Out of range address: %u.\n", address );
-      exit( 2 );
-    }
-    if ( ! ( -32768 <= value_at_address && value_at_address < 65536 ) ) {
-      printf( "Out of range value at address: %u, %d.\n", address, value_at_address );
-      exit( 2 );
-    }
+  dcache_flush( sm ); // Program is loaded, nothing is decoded yet.
 
-    mem[ address ] = (i16) value_at_address;
-    pipe_mem[ address ] = (i16) value_at_address;
+  if ( lanes_file != NULL ) { // -l: the lanes replace both runs below
+    lanes_run( sm, count, lanes_file );
+    exit( 0 );
   }
 
-  fclose( file );
-
   // Put some instructions in the memory...
   // I compile to x86 with the following command:
   //   gcc -fno-asynchronous-unwind-tables -O2 -S <prog_to_compile.c>
@@ -681,34 +648,53 @@ int main (int argc, char *argv[], char *env[] )
 
   // Finally, run the program...
 
-  for ( i   = 0; i < count; i++ ){
-    printf("pc = %d\n",pc);
-    micro_step( );
-  }
+  if ( ! isa_run( sm, count ) )
+    exit( 3 );
 
-  for ( i = 0; i < pipe_count; i++ ){
-    pipe_step( );
-    //if(!((!cD.fn) && (cD.rnumb == 7))) {
-      int a;
-      for(a = 0; a < 16; a += 2)
-        printf("p_reg[%d] = %d   p_reg[%d] = %d\n",a, pipe_reg[a], a+1, pipe_reg[a+1]);
-      printf("\n");
-   // }
-      if(!cW.fn && !cW.rnumc&& !cW.rnumb && !cW.rnuma && 
-         !cD.fn && !cD.rnumc&& !cD.rnumb && !cD.rnuma &&
-         !cE.fn && !cE.rnumc&& !cE.rnumb && !cE.rnuma &&
-         !cM.fn && !cM.rnumc&& !cM.rnumb && !cM.rnuma)
-        break;
-  }
-  int result = compare_ISA_to_pipeline_prog_state( );
+  i = pipe_run( sm, pipe_count );
+  int result = compare_ISA_to_pipeline_prog_state( sm );
   int a;
   for(a = 0; a < 16; a += 2)
-    printf("reg[%d] = %d   reg[%d] = %d\n",a, reg[a], a+1, reg[a+1]);
+    printf("reg[%d] = %d   reg[%d] = %d\n",a, sm->reg[a], a+1, sm->reg[a+1]);
   printf("\n");
   for(a = 0; a < 16; a += 2)
-    printf("pipe_reg[%d] = %d   pipe_reg[%d] = %d\n",a, pipe_reg[a], a+1, pipe_reg[a+1]);
+    printf("pipe_reg[%d] = %d   pipe_reg[%d] = %d\n",a, sm->pipe_reg[a], a+1, sm->pipe_reg[a+1]);
 
   printf("\nnumber of pipline instructions executed = %ld\n",i);
+  printf( "Pipeline: %ld cycles, %ld instructions retired, CPI %.3f.\n",
+          sm->perf.cycles, sm->perf.retired,
+          sm->perf.retired ? (double) sm->perf.cycles / sm->perf.retired : 0.0 );
+  perf_print( &sm->perf );
+  if ( perf_file != NULL ) // -P
+    perf_write( &sm->perf, SM_VARIANT, argv[ 3 ], perf_file );
+  if ( sm->prof ) // -H
+    prof_report( sm->prof, sm->mem, prof_file );
+  if ( sm->trace ) { // -T
+    printf( "Trace: %u instructions fetched, written to %s.\n", sm->fetched, trace_file );
+    trace_close( sm->trace );
+    sm->trace = NULL;
+  }
+  if ( sm->cycles ) { // -C
+    cy_flush( sm->cycles );
+    printf( "Cycle records: %u cycles, written to %s.\n", sm->cycles->written, cycles_file );
+    cy_close( sm->cycles );
+    sm->cycles = NULL;
+  }
+  if ( sm->rtrace ) { // -r
+    printf( "Retirement trace: %u ISA-level and %u pipeline records, written to %s.\n",
+            sm->rtrace->seq[ 0 ], sm->rtrace->seq[ 1 ], rtrace_file );
+    rt_close( sm->rtrace );
+    sm->rtrace = NULL;
+  }
+  if ( sm->rcheck ) { // -k
+    if ( ! sm->rcheck->mismatched )
+      printf( "Retirement check: %ld instructions retired as in %s.\n",
+              sm->rcheck->matched, rcheck_file );
+    rt_read_close( sm->rcheck );
+    sm->rcheck = NULL;
+  }
+  if ( sm->forward ) // -f: compare with the stall-only pipeline
+    forward_compare( sm, argv[ 3 ], pipe_count );
   // Output final RAX value.
 
   // printf( "Final value of R0 is: %d.\n", reg[ 0 ] );
@@ -726,7 +712,7 @@ int main (int argc, char *argv[], char *env[] )
 // print_sm_state can be changes to print more or less, or maybe
 // changed so that it also prints memory locations starting at 4096!
 
-//  print_sm_state(); // Print partial state.
+//  print_sm_state(sm); // Print partial state.
 
   exit( !result );
 }
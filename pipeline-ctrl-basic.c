@@ -17,7 +17,6 @@ typedef unsigned short u4;
 // functions.
 
 // Show your work here.
-unsigned counter = 3;
 // pc_ctrl don't need to use ruma, and rumc
 int pc_ctrl(u4 fn, u4 rnuma, u4 rnumb, u4 rnumc)
 {
@@ -34,13 +33,14 @@ int pc_ctrl(u4 fn, u4 rnuma, u4 rnumb, u4 rnumc)
   }
 }
 
-int inst_ctrl(u4 fn, u4 rnuma, u4 rnumb, u4 rnumc)
+// The cycle counter lives in the context: sm->counter, 3 at reset.
+int inst_ctrl(sm_context *sm, u4 fn, u4 rnuma, u4 rnumb, u4 rnumc)
 {
-	if(counter == 3){
-		counter = 0;
+	if(sm->counter == 3){
+		sm->counter = 0;
 		return 0;
 	}else {
-    counter++;
+    sm->counter++;
 		return 1;
   }
 }
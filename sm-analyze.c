@@ -0,0 +1,507 @@
+/*
+ Analyser of the per-cycle pipeline records the SM simulators write
+ with -C; see sm-cycles.c.
+
+  gcc -fno-asynchronous-unwind-tables -Wall -O2 -pthread -o sm-analyze sm-analyze.c
+
+  sm-analyze [-c <from>:<to>] [-n <top>] [-j <threads>] <file>
+
+ For the cycles from <from> to <to> (all of them by default) it
+ reports:
+
+   stalls      the cycles fetch stalled, by cause, and the slots
+               squashed
+   bubbles     the pcs that caused the most: for a RAW or load-use
+               stall the instruction decode held, for a control stall
+               the youngest control instruction in the pipe, and for a
+               squash the oldest one
+   CPI         the pcs with the most cycles: each retirement costs its
+               own cycle and the bubbles write-back saw since the one
+               before, as -H counts them
+   branches    for every control instruction retired, how often the
+               next instruction retired was not the one after it
+   memory      the addresses loaded and stored the most
+
+ The file is mapped, not read, and the records in the range are cut
+ into chunks of AN_CHUNK that worker threads, one per core by default,
+ take in turn.  Each thread counts into its own tables; what crosses a
+ chunk boundary (the bubbles before the first retirement of a chunk,
+ and the outcome of its last control instruction) is settled from a
+ few numbers per chunk when the tables are summed.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef unsigned short u4;
+typedef unsigned short u16;
+typedef short i16;
+typedef unsigned int u32;
+
+#define MEMSIZE    (65536)
+
+#include "sm-perf.c"
+#include "sm-opnames.c"
+
+// The record of sm-cycles.c; the two must agree.
+#define CY_VERSION  1
+#define CY_NONE     0xFFFF
+#define CY_D        0
+#define CY_E        1
+#define CY_M        2
+#define CY_W        3
+#define CY_LOAD     1
+#define CY_STORE    2
+
+typedef struct{
+  u32  cycle;
+  u16  pc[ 4 ];
+  u16  inst[ 4 ];
+  u16  wait_pc;
+  u16  addr;
+  u16  fetch_pc;
+  unsigned char cause;
+  unsigned char squashed;
+  unsigned char flags;
+  unsigned char pad[ 3 ];
+} cy_record;
+
+_Static_assert( sizeof( cy_record ) == 32, "cy_record is 32 bytes" );
+
+#define AN_CHUNK    ( 1 << 20 )       // records a thread takes at once
+#define AN_THREADS  64
+#define AN_TOP      20                // default lines in each table
+#define AN_SQUASH   PERF_CAUSES       // caused[]: squashed slots
+#define AN_CAUSES   ( PERF_CAUSES + 1 )
+
+typedef struct{
+  unsigned long cycles, retired, bubbles, squashed, loads, stores;
+  unsigned long stalls[ PERF_CAUSES ];
+  unsigned long unowned;              // stall cycles no instruction caused
+  unsigned long retired_at[ MEMSIZE ];
+  unsigned long cycles_at[ MEMSIZE ];
+  unsigned long caused[ AN_CAUSES ][ MEMSIZE ];
+  unsigned long branches[ MEMSIZE ], taken[ MEMSIZE ];
+  unsigned long reads[ MEMSIZE ], writes[ MEMSIZE ];
+  u16  word[ MEMSIZE ];
+} an_counts;
+
+// What a chunk leaves to its neighbours.
+typedef struct{
+  int  retires;              // whether any instruction retired in it
+  u16  first_pc;             // the first that did
+  u16  last_pc, last_inst;   // and the last
+  unsigned long trail;       // bubbles after the last, all of them if none
+} an_edge;
+
+typedef struct{
+  const cy_record *rec;
+  long first, end;           // records of the range
+  long nchunks;
+  atomic_long next;          // chunk the next idle thread takes
+  an_edge *edge;
+} an_job;
+
+static inline int an_control( u16 inst )
+{
+  u4 rnumb = ( inst >> 4 ) & 0xF;
+
+  return ! ( inst >> 12 ) && rnumb >= 3 && rnumb <= 6;
+}
+
+// The instruction a stall of cause (PERF_*) in record r waited on.
+static inline u16 an_culprit( const cy_record *r, int cause )
+{
+  int s;
+
+  if ( cause == PERF_CONTROL ) {
+    for ( s = CY_D; s <= CY_W; s++ )
+      if ( r->pc[ s ] != CY_NONE && an_control( r->inst[ s ] ) )
+        return r->pc[ s ];
+    return CY_NONE;
+  }
+  return r->wait_pc;
+}
+
+// The instruction that squashed the slots of record r.
+static inline u16 an_squasher( const cy_record *r )
+{
+  int s;
+
+  for ( s = CY_W; s >= CY_D; s-- )
+    if ( r->pc[ s ] != CY_NONE && an_control( r->inst[ s ] ) )
+      return r->pc[ s ];
+  return CY_NONE;
+}
+
+void an_chunk( an_counts *c, an_edge *e, const cy_record *r, long n )
+{
+  unsigned long waiting = 0;
+  long i;
+
+  for ( i = 0; i < n; i++, r++ ) {
+    c->cycles++;
+    if ( r->cause ) {
+      int cause = r->cause - 1;
+      u16 pc = an_culprit( r, cause );
+      c->stalls[ cause ]++;
+      if ( pc != CY_NONE )
+        c->caused[ cause ][ pc ]++;
+      else
+        c->unowned++;
+    }
+    if ( r->squashed ) {
+      u16 pc = an_squasher( r );
+      c->squashed += r->squashed;
+      if ( pc != CY_NONE )
+        c->caused[ AN_SQUASH ][ pc ] += r->squashed;
+    }
+    if ( r->flags & CY_LOAD ) {
+      c->loads++;
+      c->reads[ r->addr ]++;
+    } else if ( r->flags & CY_STORE ) {
+      c->stores++;
+      c->writes[ r->addr ]++;
+    }
+
+    if ( r->cycle < 4 )      // the pipe filling from reset
+      continue;
+    if ( r->pc[ CY_W ] == CY_NONE ) {
+      c->bubbles++;
+      waiting++;
+      continue;
+    }
+    u16 pc = r->pc[ CY_W ];
+    c->retired++;
+    c->retired_at[ pc ]++;
+    c->cycles_at[ pc ] += 1 + waiting;
+    c->word[ pc ] = r->inst[ CY_W ];
+    waiting = 0;
+    if ( ! e->retires ) {
+      e->retires = 1;
+      e->first_pc = pc;
+    } else if ( an_control( e->last_inst ) ) {
+      c->branches[ e->last_pc ]++;
+      if ( pc != (u16) ( e->last_pc + 1 ) )
+        c->taken[ e->last_pc ]++;
+    }
+    e->last_pc = pc;
+    e->last_inst = r->inst[ CY_W ];
+  }
+  e->trail = waiting;
+}
+
+typedef struct{
+  an_job *job;
+  an_counts *counts;
+  pthread_t thread;
+} an_worker;
+
+void *an_work( void *arg )
+{
+  an_worker *w = arg;
+  an_job *job = w->job;
+  long k;
+
+  while ( ( k = atomic_fetch_add( &job->next, 1 ) ) < job->nchunks ) {
+    long first = job->first + k * AN_CHUNK;
+    long n = job->end - first < AN_CHUNK ? job->end - first : AN_CHUNK;
+    an_chunk( w->counts, &job->edge[ k ], job->rec + first, n );
+  }
+  return NULL;
+}
+
+// Add the tables of b to a.
+void an_add( an_counts *a, an_counts *b )
+{
+  int i, j;
+
+  a->cycles += b->cycles;
+  a->retired += b->retired;
+  a->bubbles += b->bubbles;
+  a->squashed += b->squashed;
+  a->loads += b->loads;
+  a->stores += b->stores;
+  a->unowned += b->unowned;
+  for ( i = 0; i < PERF_CAUSES; i++ )
+    a->stalls[ i ] += b->stalls[ i ];
+  for ( i = 0; i < MEMSIZE; i++ ) {
+    a->retired_at[ i ] += b->retired_at[ i ];
+    a->cycles_at[ i ] += b->cycles_at[ i ];
+    for ( j = 0; j < AN_CAUSES; j++ )
+      a->caused[ j ][ i ] += b->caused[ j ][ i ];
+    a->branches[ i ] += b->branches[ i ];
+    a->taken[ i ] += b->taken[ i ];
+    a->reads[ i ] += b->reads[ i ];
+    a->writes[ i ] += b->writes[ i ];
+    if ( b->retired_at[ i ] )
+      a->word[ i ] = b->word[ i ];
+  }
+}
+
+// Settle what crosses the chunk boundaries; returns the bubbles after
+// the last retirement of the range.
+unsigned long an_edges( an_counts *c, an_edge *edge, long nchunks )
+{
+  unsigned long carry = 0;
+  int have_last = 0;
+  u16 last_pc = 0, last_inst = 0;
+  long k;
+
+  for ( k = 0; k < nchunks; k++ ) {
+    an_edge *e = &edge[ k ];
+    if ( e->retires ) {
+      c->cycles_at[ e->first_pc ] += carry;
+      carry = 0;
+      if ( have_last && an_control( last_inst ) ) {
+        c->branches[ last_pc ]++;
+        if ( e->first_pc != (u16) ( last_pc + 1 ) )
+          c->taken[ last_pc ]++;
+      }
+      have_last = 1;
+      last_pc = e->last_pc;
+      last_inst = e->last_inst;
+    }
+    carry += e->trail;
+  }
+  return carry;
+}
+
+static unsigned long *an_sort_by;
+
+static int an_cmp( const void *a, const void *b )
+{
+  unsigned long wa = an_sort_by[ *(const int *) a ];
+  unsigned long wb = an_sort_by[ *(const int *) b ];
+
+  if ( wa != wb )
+    return wa < wb ? 1 : -1;
+  return *(const int *) a - *(const int *) b;
+}
+
+// Put the addresses with a nonzero key in pcs, the largest first, and
+// return how many there are.
+int an_top( unsigned long *key, int *pcs )
+{
+  int n = 0, i;
+
+  for ( i = 0; i < MEMSIZE; i++ )
+    if ( key[ i ] )
+      pcs[ n++ ] = i;
+  an_sort_by = key;
+  qsort( pcs, n, sizeof( int ), an_cmp );
+  return n;
+}
+
+static inline const char *an_op_name( u16 w )
+{
+  return prof_op_name[ prof_op( w >> 12, ( w >> 4 ) & 0xF ) ];
+}
+
+static inline double an_pct( unsigned long a, unsigned long b )
+{
+  return b ? 100.0 * a / b : 0.0;
+}
+
+void an_report( an_counts *c, unsigned long trail, long from, long to, int top )
+{
+  static int pcs[ MEMSIZE ];
+  static unsigned long total[ MEMSIZE ];
+  unsigned long stalled = 0, branches = 0, taken = 0;
+  int n, i, j;
+
+  printf( "Cycles %ld to %ld: %lu cycles, %lu instructions retired, CPI %.3f.\n",
+          from, to, c->cycles, c->retired,
+          c->retired ? (double) c->cycles / c->retired : 0.0 );
+
+  for ( i = 0; i < PERF_CAUSES; i++ )
+    stalled += c->stalls[ i ];
+  printf( "Stalls: %lu cycles, %lu bubbles, %lu slots squashed.\n",
+          stalled, c->bubbles, c->squashed );
+  for ( i = 0; i < PERF_CAUSES; i++ )
+    if ( c->stalls[ i ] )
+      printf( "  %-9s %12lu %6.2f%%\n", perf_cause_name[ i ], c->stalls[ i ],
+              an_pct( c->stalls[ i ], stalled ) );
+
+  for ( i = 0; i < MEMSIZE; i++ )
+    for ( total[ i ] = 0, j = 0; j < AN_CAUSES; j++ )
+      total[ i ] += c->caused[ j ][ i ];
+  n = an_top( total, pcs );
+  printf( "Bubbles caused: %d addresses; the most:\n", n );
+  printf( "     pc    word  op          total" );
+  for ( j = 0; j < PERF_CAUSES; j++ )
+    printf( " %9s", perf_cause_name[ j ] );
+  printf( "  squashed\n" );
+  for ( i = 0; i < n && i < top; i++ ) {
+    printf( "  %5d  0x%04x  %-7s %8lu", pcs[ i ], c->word[ pcs[ i ] ],
+            an_op_name( c->word[ pcs[ i ] ] ), total[ pcs[ i ] ] );
+    for ( j = 0; j < AN_CAUSES; j++ )
+      printf( " %9lu", c->caused[ j ][ pcs[ i ] ] );
+    printf( "\n" );
+  }
+  if ( c->unowned )
+    printf( "  (%lu stall cycles waited on no instruction)\n", c->unowned );
+
+  n = an_top( c->cycles_at, pcs );
+  printf( "Cycles per instruction: %d addresses; the most cycles:\n", n );
+  printf( "     pc    word  op         retired       cycles      CPI\n" );
+  for ( i = 0; i < n && i < top; i++ )
+    printf( "  %5d  0x%04x  %-7s %12lu %12lu %8.3f\n", pcs[ i ], c->word[ pcs[ i ] ],
+            an_op_name( c->word[ pcs[ i ] ] ), c->retired_at[ pcs[ i ] ],
+            c->cycles_at[ pcs[ i ] ],
+            (double) c->cycles_at[ pcs[ i ] ] / c->retired_at[ pcs[ i ] ] );
+  if ( trail )
+    printf( "  (%lu bubbles after the last retirement)\n", trail );
+
+  for ( i = 0; i < MEMSIZE; i++ ) {
+    branches += c->branches[ i ];
+    taken += c->taken[ i ];
+  }
+  n = an_top( c->branches, pcs );
+  printf( "Branches: %lu executed, %lu taken (%.2f%%); the most executed:\n",
+          branches, taken, an_pct( taken, branches ) );
+  printf( "     pc    word  op        executed        taken        %%\n" );
+  for ( i = 0; i < n && i < top; i++ )
+    printf( "  %5d  0x%04x  %-7s %12lu %12lu %8.2f\n", pcs[ i ], c->word[ pcs[ i ] ],
+            an_op_name( c->word[ pcs[ i ] ] ), c->branches[ pcs[ i ] ], c->taken[ pcs[ i ] ],
+            an_pct( c->taken[ pcs[ i ] ], c->branches[ pcs[ i ] ] ) );
+
+  for ( i = 0; i < MEMSIZE; i++ )
+    total[ i ] = c->reads[ i ] + c->writes[ i ];
+  n = an_top( total, pcs );
+  printf( "Memory: %lu loads and %lu stores at %d addresses; the most accessed:\n",
+          c->loads, c->stores, n );
+  printf( "   addr        loads       stores\n" );
+  for ( i = 0; i < n && i < top; i++ )
+    printf( "  %5d %12lu %12lu\n", pcs[ i ], c->reads[ pcs[ i ] ], c->writes[ pcs[ i ] ] );
+}
+
+// The first of the n records whose cycle is at least cycle.
+long an_find( const cy_record *rec, long n, long cycle )
+{
+  long lo = 0, hi = n;
+
+  while ( lo < hi ) {
+    long mid = lo + ( hi - lo ) / 2;
+    if ( rec[ mid ].cycle < cycle )
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+int main( int argc, char *argv[] )
+{
+  long from = 0, to = -1, n;
+  int top = AN_TOP, threads = sysconf( _SC_NPROCESSORS_ONLN ), i = 1, t;
+  const unsigned char *map;
+  struct stat st;
+  an_worker worker[ AN_THREADS ];
+  an_job job;
+  unsigned long trail;
+  int fd;
+
+  while ( i + 1 < argc && argv[ i ][ 0 ] == '-' ) {
+    if ( ! strcmp( argv[ i ], "-c" ) ) {
+      if ( sscanf( argv[ i + 1 ], "%ld:%ld", &from, &to ) != 2 || from < 0 || to < from ) {
+        printf( "Bad cycle range: %s.\n", argv[ i + 1 ] );
+        exit( 1 );
+      }
+    } else if ( ! strcmp( argv[ i ], "-n" ) ) {
+      top = atoi( argv[ i + 1 ] );
+      if ( top < 1 ) {
+        printf( "Bad number of lines: %s.\n", argv[ i + 1 ] );
+        exit( 1 );
+      }
+    } else if ( ! strcmp( argv[ i ], "-j" ) ) {
+      threads = atoi( argv[ i + 1 ] );
+      if ( threads < 1 ) {
+        printf( "Bad thread count: %s.\n", argv[ i + 1 ] );
+        exit( 1 );
+      }
+    } else {
+      printf( "Unknown option: %s.\n", argv[ i ] );
+      exit( 1 );
+    }
+    i += 2;
+  }
+  if ( i + 1 != argc ) {
+    printf( "Usage: sm-analyze [-c <from>:<to>] [-n <top>] [-j <threads>] <file>\n" );
+    printf( "  -c <from>:<to>  Only the cycles from <from> to <to>.\n" );
+    printf( "  -n <top>        Lines in each table (default %d).\n", AN_TOP );
+    printf( "  -j <threads>    Worker threads (default: one per core).\n" );
+    exit( 1 );
+  }
+  if ( threads < 1 )
+    threads = 1;
+  if ( threads > AN_THREADS )
+    threads = AN_THREADS;
+
+  fd = open( argv[ i ], O_RDONLY );
+  if ( fd < 0 || fstat( fd, &st ) ) {
+    printf( "%s not found.\n", argv[ i ] );
+    exit( 1 );
+  }
+  if ( st.st_size < 16 ) {
+    printf( "%s is not a file of cycle records.\n", argv[ i ] );
+    exit( 1 );
+  }
+  map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  if ( map == MAP_FAILED ) {
+    printf( "Cannot map %s: %s.\n", argv[ i ], strerror( errno ) );
+    exit( 1 );
+  }
+  close( fd );
+  if ( memcmp( map, "SMCY", 4 ) || map[ 4 ] != CY_VERSION || map[ 6 ] != sizeof( cy_record ) ) {
+    printf( "%s is not a file of cycle records, version %d.\n", argv[ i ], CY_VERSION );
+    exit( 1 );
+  }
+
+  job.rec = (const cy_record *) ( map + 16 );
+  n = ( st.st_size - 16 ) / sizeof( cy_record );
+  job.first = an_find( job.rec, n, from );
+  job.end = to < 0 ? n : an_find( job.rec, n, to + 1 );
+  if ( to < 0 )
+    to = job.end ? job.rec[ job.end - 1 ].cycle : 0;
+  job.nchunks = ( job.end - job.first + AN_CHUNK - 1 ) / AN_CHUNK;
+  atomic_init( &job.next, 0 );
+  job.edge = calloc( job.nchunks + 1, sizeof( an_edge ) );
+  if ( threads > job.nchunks )
+    threads = job.nchunks ? job.nchunks : 1;
+
+  for ( t = 0; t < threads; t++ ) {
+    worker[ t ].job = &job;
+    worker[ t ].counts = calloc( 1, sizeof( an_counts ) );
+    if ( job.edge == NULL || worker[ t ].counts == NULL ) {
+      printf( "Out of memory for the tables.\n" );
+      exit( 1 );
+    }
+  }
+  for ( t = 1; t < threads; t++ )
+    if ( pthread_create( &worker[ t ].thread, NULL, an_work, &worker[ t ] ) ) {
+      printf( "Cannot start worker thread %d.\n", t );
+      exit( 1 );
+    }
+  an_work( &worker[ 0 ] );
+  for ( t = 1; t < threads; t++ ) {
+    pthread_join( worker[ t ].thread, NULL );
+    an_add( worker[ 0 ].counts, worker[ t ].counts );
+    free( worker[ t ].counts );
+  }
+
+  trail = an_edges( worker[ 0 ].counts, job.edge, job.nchunks );
+  an_report( worker[ 0 ].counts, trail, from, to, top );
+
+  free( worker[ 0 ].counts );
+  free( job.edge );
+  munmap( (void *) map, st.st_size );
+  return 0;
+}
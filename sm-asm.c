@@ -0,0 +1,423 @@
+/*
+ Assembler for the SM ISA as micro_step runs it.
+
+  gcc -fno-asynchronous-unwind-tables -Wall -O2 -o sm-asm sm-asm.c
+
+  sm-asm [-l] <source> <image>
+
+ Writes the program in <source> to <image>, a binary image if its name
+ ends in .smimg and a text image otherwise (see sm-image.c); -l prints
+ a listing of the words and the lines they came from.
+
+ A line holds any number of labels, then one statement, then perhaps a
+ comment from ; or # to the end of the line:
+
+   loop:  add r3, r3, r1     ; r3 = r3 + r1
+
+ Instructions and their operands, rX being the registers r0 to r15 and
+ the word laid out as fn, rC, rB, rA from the top nibble down:
+
+   add sub mul div xor and lor sleft sright lt lteq cmove cadd
+                  rC, rB, rA   fn 1 to 13: rC = rB op rA, for cmove
+                               rC = rB ? rA : rC, for cadd rC = rB ?
+                               rA + rC : rC
+   immlow immhgh  rC, <expr>   fn 14, 15: the low or high byte of rC
+                               from the 8 bits of data
+   ldmem stmem call jump bra not neg cnot popcnt bitrev pop push
+                  rC, rA       fn 0 with these as rB, 1 to 15:
+                               ldmem rC = mem[rA], stmem mem[rC] = rA,
+                               call rC (target), rA (stack pointer),
+                               jump and bra to rA (bra: relative to the
+                               next pc) when rC is not 0, pop rC from
+                               and push rC onto the stack at rA
+   return         rA           pc = mem[rA], rA + 1
+   noop
+
+ and the pseudo-instruction
+
+   li             rC, <expr>   immlow then immhgh: rC = a 16-bit value
+
+ Directives and constants:
+
+   <name> = <expr>             a constant, defined before it is used
+   .org <expr>                 assemble on from this address
+   .word <expr>, ...           words of data
+   .entry <expr>               the pc to start at (binary images only)
+
+ Expressions are numbers as text images write them (decimal, 0x hex,
+ 0-prefixed octal), labels, constants, and . for the address of the
+ statement, combined with + - * / and parentheses.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef unsigned short u4;
+typedef unsigned short u16;
+typedef short i16;
+typedef unsigned int u32;
+
+#define MEMSIZE    (65536)
+
+#include "sm-opnames.c"
+#include "sm-image.c"
+
+#define ASM_NAME   32
+#define ASM_SYMS   4096
+
+typedef struct{
+  char name[ ASM_NAME ];
+  long value;
+} asm_sym;
+
+asm_sym asm_syms[ ASM_SYMS ];
+int  asm_nsyms;
+
+char *asm_file;
+long asm_line;
+long asm_loc;              // address of the statement
+int  asm_pass;             // 1: collect labels, 2: emit words
+
+i16  asm_mem[ MEMSIZE ];
+unsigned char asm_set[ MEMSIZE ];
+int  asm_entry = -1;
+int  asm_list;
+long asm_listed;            // the line -l listed last
+
+void asm_error( const char *msg, const char *what )
+{
+  printf( "%s:%ld: %s", asm_file, asm_line, msg );
+  if ( what )
+    printf( ": %s", what );
+  printf( ".\n" );
+  exit( 1 );
+}
+
+asm_sym *asm_lookup( const char *name )
+{
+  int i;
+
+  for ( i = 0; i < asm_nsyms; i++ )
+    if ( ! strcmp( asm_syms[ i ].name, name ) )
+      return &asm_syms[ i ];
+  return NULL;
+}
+
+void asm_define( const char *name, long value )
+{
+  asm_sym *s = asm_lookup( name );
+
+  if ( asm_pass == 2 )      // pass 1 defined it, with the same value
+    return;
+  if ( s != NULL )
+    asm_error( "defined twice", name );
+  if ( asm_nsyms == ASM_SYMS )
+    asm_error( "too many symbols", NULL );
+  s = &asm_syms[ asm_nsyms++ ];
+  strcpy( s->name, name );
+  s->value = value;
+}
+
+static inline const char *asm_space( const char *p )
+{
+  while ( *p == ' ' || *p == '\t' || *p == '\r' )
+    p++;
+  return p;
+}
+
+static inline int asm_ident( int c, int first )
+{
+  return c == '_' || c == '.' || ( ( c | 0x20 ) >= 'a' && ( c | 0x20 ) <= 'z' ) ||
+         ( ! first && c >= '0' && c <= '9' );
+}
+
+// Copy the name at p to name; returns the end of it, or NULL if there
+// is none.
+const char *asm_name( const char *p, char *name )
+{
+  int n = 0;
+
+  if ( ! asm_ident( *p, 1 ) )
+    return NULL;
+  while ( asm_ident( p[ n ], 0 ) ) {
+    if ( n == ASM_NAME - 1 )
+      asm_error( "name too long", NULL );
+    name[ n ] = p[ n ];
+    n++;
+  }
+  name[ n ] = '\0';
+  return p + n;
+}
+
+const char *asm_expr( const char *p, long *v, int need );
+
+// A term: a number, a name, ., a negated term or a parenthesised
+// expression.  With need 0, an undefined name counts as 0.
+const char *asm_term( const char *p, long *v, int need )
+{
+  char name[ ASM_NAME ];
+  const char *q;
+
+  p = asm_space( p );
+  if ( *p == '-' || *p == '+' ) {
+    int neg = *p == '-';
+    p = asm_term( p + 1, v, need );
+    if ( neg )
+      *v = -*v;
+    return p;
+  }
+  if ( *p == '(' ) {
+    p = asm_space( asm_expr( p + 1, v, need ) );
+    if ( *p != ')' )
+      asm_error( "missing )", NULL );
+    return p + 1;
+  }
+  if ( *p >= '0' && *p <= '9' ) {
+    q = load_int( p, p + strlen( p ), 0, v );
+    if ( asm_ident( *q, 0 ) )
+      asm_error( "bad number", p );
+    return q;
+  }
+  if ( *p == '.' && ! asm_ident( p[ 1 ], 0 ) ) {
+    *v = asm_loc;
+    return p + 1;
+  }
+  q = asm_name( p, name );
+  if ( q == NULL )
+    asm_error( "expression expected", *p ? p : NULL );
+  asm_sym *s = asm_lookup( name );
+  if ( s != NULL )
+    *v = s->value;
+  else if ( need || asm_pass == 2 )
+    asm_error( "undefined", name );
+  else
+    *v = 0;
+  return q;
+}
+
+const char *asm_product( const char *p, long *v, int need )
+{
+  long w;
+
+  p = asm_space( asm_term( p, v, need ) );
+  while ( *p == '*' || *p == '/' ) {
+    int op = *p;
+    p = asm_space( asm_term( p + 1, &w, need ) );
+    if ( op == '*' )
+      *v *= w;
+    else if ( w )
+      *v /= w;
+    else if ( asm_pass == 2 || need )
+      asm_error( "division by zero", NULL );
+  }
+  return p;
+}
+
+const char *asm_expr( const char *p, long *v, int need )
+{
+  long w;
+
+  p = asm_space( asm_product( p, v, need ) );
+  while ( *p == '+' || *p == '-' ) {
+    int op = *p;
+    p = asm_space( asm_product( p + 1, &w, need ) );
+    *v = op == '+' ? *v + w : *v - w;
+  }
+  return p;
+}
+
+const char *asm_register( const char *p, int *r )
+{
+  long v = 0;
+  const char *q;
+
+  p = asm_space( p );
+  if ( ( *p | 0x20 ) != 'r' || *++p < '0' || *p > '9' )
+    asm_error( "register expected", NULL );
+  q = load_int( p, p + strlen( p ), 10, &v );
+  if ( v > 15 || asm_ident( *q, 0 ) )
+    asm_error( "bad register", p - 1 );
+  *r = v;
+  return q;
+}
+
+const char *asm_comma( const char *p )
+{
+  p = asm_space( p );
+  if ( *p != ',' )
+    asm_error( "comma expected", *p ? p : NULL );
+  return p + 1;
+}
+
+void asm_emit( long word, const char *source )
+{
+  u16 a = asm_loc;
+
+  if ( asm_loc >= MEMSIZE )
+    asm_error( "past the end of memory", NULL );
+  if ( asm_pass == 2 ) {
+    if ( asm_set[ a ] )
+      asm_error( "address assembled twice", NULL );
+    asm_mem[ a ] = word;
+    asm_set[ a ] = 1;
+    if ( asm_list )   // the source with the first word of its statement
+      printf( "%5u  0x%04x  %s\n", a, (u16) word, asm_line == asm_listed ? "" : source );
+    asm_listed = asm_line;
+  }
+  asm_loc++;
+}
+
+// An 8-bit data field: a byte, signed or not.
+int asm_byte( long v )
+{
+  if ( asm_pass == 2 && ( v < -128 || v > 255 ) )
+    asm_error( "data out of 8-bit range", NULL );
+  return v & 0xFF;
+}
+
+// Assemble one line.
+void asm_statement( char *line )
+{
+  char name[ ASM_NAME ], *c;
+  const char *p, *q, *source;
+  long v;
+  int op, rc = 0, rb = 0, ra = 0;
+
+  for ( c = line; *c && *c != ';' && *c != '#'; c++ )
+    ;
+  *c = '\0';
+  while ( c > line && ( c[ -1 ] == ' ' || c[ -1 ] == '\t' || c[ -1 ] == '\r' ) )
+    *--c = '\0';
+
+  p = asm_space( line );
+  while ( ( q = asm_name( p, name ) ) != NULL && *asm_space( q ) == ':' ) {
+    asm_define( name, asm_loc );
+    p = asm_space( asm_space( q ) + 1 );
+  }
+  source = p;
+  if ( ! *p )
+    return;
+  if ( q == NULL )
+    asm_error( "statement expected", p );
+
+  if ( *asm_space( q ) == '=' ) {
+    p = asm_expr( asm_space( q ) + 1, &v, 1 );
+    if ( *p )
+      asm_error( "junk after the value", p );
+    asm_define( name, v );
+    return;
+  }
+
+  p = asm_space( q );
+  if ( ! strcmp( name, ".org" ) ) {
+    p = asm_expr( p, &v, 1 );
+    if ( *p || v < 0 || v >= MEMSIZE )
+      asm_error( "bad address", source );
+    asm_loc = v;
+    return;
+  }
+  if ( ! strcmp( name, ".entry" ) ) {
+    p = asm_expr( p, &v, 0 );
+    if ( *p || v < 0 || v >= MEMSIZE )
+      asm_error( "bad entry pc", source );
+    asm_entry = v;
+    return;
+  }
+  if ( ! strcmp( name, ".word" ) ) {
+    for ( ;; ) {
+      p = asm_expr( p, &v, 0 );
+      if ( asm_pass == 2 && ( v < -32768 || v > 65535 ) )
+        asm_error( "word out of 16-bit range", source );
+      asm_emit( v, source );
+      if ( ! *p )
+        return;
+      p = asm_comma( p );
+    }
+  }
+
+  if ( ! strcmp( name, "li" ) ) {
+    p = asm_expr( asm_comma( asm_register( p, &rc ) ), &v, 0 );
+    if ( *p )
+      asm_error( "junk after the operands", p );
+    if ( asm_pass == 2 && ( v < -32768 || v > 65535 ) )
+      asm_error( "value out of 16-bit range", source );
+    asm_emit( 14 << 12 | rc << 8 | ( v & 0xFF ), source );
+    asm_emit( 15 << 12 | rc << 8 | ( v >> 8 & 0xFF ), source );
+    return;
+  }
+
+  for ( op = 0; op < PROF_OPS; op++ )
+    if ( op != 7 && op != 8 && ! strcmp( name, prof_op_name[ op ] ) )
+      break;
+  if ( op == PROF_OPS )
+    asm_error( "unknown instruction", name );
+
+  if ( op == 0 )                               // noop
+    ;
+  else if ( op == 4 )                          // return rA
+    p = asm_register( p, &ra );
+  else if ( op < 16 )                          // fn 0: rC, rA
+    p = asm_register( asm_comma( asm_register( p, &rc ) ), &ra );
+  else if ( op < 29 )                          // rC, rB, rA
+    p = asm_register( asm_comma( asm_register( asm_comma( asm_register( p, &rc ) ), &rb ) ), &ra );
+  else {                                       // immlow, immhgh: rC, data
+    p = asm_expr( asm_comma( asm_register( p, &rc ) ), &v, 0 );
+    v = asm_byte( v );
+    rb = v >> 4;
+    ra = v & 0xF;
+  }
+  if ( *asm_space( p ) )
+    asm_error( "junk after the operands", asm_space( p ) );
+  if ( op < 16 )
+    rb = op;
+  asm_emit( ( op < 16 ? 0 : op - 15 ) << 12 | rc << 8 | rb << 4 | ra, source );
+}
+
+int main( int argc, char *argv[] )
+{
+  char *buf, *line;
+  size_t size;
+  int mapped, i = 1;
+
+  if ( argc == 4 && ! strcmp( argv[ 1 ], "-l" ) ) {
+    asm_list = 1;
+    i = 2;
+  }
+  if ( argc - i != 2 ) {
+    printf( "Usage: sm-asm [-l] <source> <image>\n" );
+    printf( "  Assemble <source> into <image>, binary if its name ends in\n" );
+    printf( "  .smimg, else text; -l prints a listing.\n" );
+    exit( 1 );
+  }
+  asm_file = argv[ i ];
+  if ( img_map( asm_file, &buf, &size, &mapped ) )
+    exit( 1 );
+
+  line = malloc( size + 1 );
+  if ( line == NULL ) {
+    printf( "Out of memory for %s.\n", asm_file );
+    exit( 1 );
+  }
+  for ( asm_pass = 1; asm_pass <= 2; asm_pass++ ) {
+    const char *p = buf, *end = buf + size;
+    asm_loc = 0;
+    for ( asm_line = 1; p < end; asm_line++ ) {
+      const char *eol = memchr( p, '\n', end - p );
+      if ( eol == NULL )
+        eol = end;
+      memcpy( line, p, eol - p );
+      line[ eol - p ] = '\0';
+      if ( strlen( line ) != (size_t) ( eol - p ) )
+        asm_error( "NUL in the source", NULL );
+      asm_statement( line );
+      p = eol + 1;
+    }
+  }
+  if ( buf != NULL )
+    img_unmap( buf, size, mapped );
+  free( line );
+
+  if ( sm_write_image( argv[ i + 1 ], asm_mem, asm_set, asm_entry ) )
+    exit( 1 );
+  return 0;
+}
@@ -0,0 +1,356 @@
+// Batch mode: run many simulations on a pool of worker threads.
+//
+//   sm [options] -b <manifest> [-j <threads>]
+//
+// Each manifest line is one job:
+//
+//   <filename> <n> <p> [<variant> [<state>]]
+//
+// where n and p are the ISA and pipeline instruction counts of the
+// usual command line and variant names the simulator the job is meant
+// for (basic, alu-opt, mem-alu-opt or jump-opt).  state, in hex, is the
+// sm_checksum the ISA-level run must end with; a job that ends with
+// another is reported as wrong-state, whatever the pipeline did.  Blank
+// lines and lines starting with # are skipped.  A binary runs only the
+// jobs of its own variant, and reports the rest as skipped, so a mixed
+// manifest is run through each of the four simulators.
+//
+// Every program file is parsed once, then each worker runs its jobs on
+// a context of its own.  Jobs are dealt out in contiguous runs, one per
+// worker; a worker that finishes its run steals the back half of the
+// longest-looking run still left.  One result line is printed per job,
+// in manifest order, once all jobs are done.  -e jit is kept only with
+// one worker, which then reuses its context, and the JIT's blocks,
+// from job to job; dcache_flush starts each job with none.
+
+#include <pthread.h>
+#include <unistd.h>
+
+typedef struct{
+  char *name;
+  int  status;        // sm_load_image: 0, or the exit status of the error
+  int  words;         // nonzero words of the image
+  u16  entry;         // pc to start at
+  u16  *addr;
+  i16  *value;
+} batch_image;
+
+typedef struct{
+  int  image;         // index into batch_images
+  char *variant;
+  long count, pipe_count;
+  int  line;
+  const char *result;
+  long cycles, retired;
+  double seconds;
+  u32  state;         // sm_checksum after the ISA-level run
+  u32  expect;        // and what it should be, if check_state
+  int  check_state;
+} batch_job;
+
+// The jobs a worker has still to run, [next, end), packed in one word
+// so the owner and a thief can both change it with a single CAS.
+typedef struct{
+  unsigned long long range;
+} __attribute__(( aligned( 64 ) )) batch_queue;
+
+#define BATCH_NEXT( r ) ( (unsigned) ( r ) )
+#define BATCH_END( r )  ( (unsigned) ( ( r ) >> 32 ) )
+#define BATCH_RANGE( next, end ) \
+  ( ( (unsigned long long) ( end ) << 32 ) | (unsigned) ( next ) )
+
+batch_image *batch_images;
+int batch_nimages;
+batch_job *batch_jobs;
+int batch_njobs;
+batch_queue *batch_queues;
+int batch_nthreads;
+int batch_next_image;
+pthread_barrier_t batch_barrier;
+
+// Parse image m into its sparse form.  Program files are small next to
+// MEMSIZE, so jobs copy the nonzero words rather than all of memory.
+void batch_parse( sm_context *sm, batch_image *m )
+{
+  int a, n = 0;
+
+  sm_reset( sm );
+  m->status = sm_load_image( sm->mem, m->name, NULL, &m->entry );
+  if ( m->status )
+    return;
+  for ( a = 0; a < MEMSIZE; a++ )
+    if ( sm->mem[ a ] )
+      n++;
+  m->addr = malloc( n * sizeof( u16 ) + 1 );
+  m->value = malloc( n * sizeof( i16 ) + 1 );
+  if ( m->addr == NULL || m->value == NULL ) {
+    printf( "Out of memory for %s.\n", m->name );
+    exit( 1 );
+  }
+  for ( a = 0; a < MEMSIZE; a++ )
+    if ( sm->mem[ a ] ) {
+      m->addr[ m->words ] = a;
+      m->value[ m->words++ ] = sm->mem[ a ];
+    }
+}
+
+void batch_one( sm_context *sm, batch_job *job )
+{
+  batch_image *m = &batch_images[ job->image ];
+  int i;
+
+  if ( strcmp( job->variant, SM_VARIANT ) ) {
+    job->result = "skip";
+    return;
+  }
+  if ( m->status ) {
+    job->result = "error";
+    return;
+  }
+
+  double start = host_seconds();
+
+  sm_reset( sm );
+  for ( i = 0; i < m->words; i++ )
+    sm->mem[ m->addr[ i ] ] = sm->pipe_mem[ m->addr[ i ] ] = m->value[ i ];
+  sm->pc = sm->pipe_pc = m->entry;
+  init_pipeline_regs( sm );
+  dcache_flush( sm );         // and, with -e jit, the previous job's blocks
+
+  if ( ! isa_run( sm, job->count ) )
+    job->result = "check-failed";
+  else {
+    pipe_run( sm, job->pipe_count );
+    job->result = compare_ISA_to_pipeline_prog_state( sm ) ? "pass" : "fail";
+    job->state = sm_checksum( sm );
+    if ( job->check_state && job->state != job->expect )
+      job->result = "wrong-state";
+  }
+  job->cycles = sm->perf.cycles;
+  job->retired = sm->perf.retired;
+  job->seconds = host_seconds() - start;
+}
+
+// Take the next job of queue q, or -1 when it is empty.
+int batch_pop( batch_queue *q )
+{
+  unsigned long long r = __atomic_load_n( &q->range, __ATOMIC_ACQUIRE );
+
+  while ( BATCH_NEXT( r ) < BATCH_END( r ) )
+    if ( __atomic_compare_exchange_n( &q->range, &r,
+                                      BATCH_RANGE( BATCH_NEXT( r ) + 1, BATCH_END( r ) ),
+                                      0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) )
+      return BATCH_NEXT( r );
+  return -1;
+}
+
+// Move the back half of another worker's run into queue own, and return
+// its first job, or -1 when every other queue is empty.
+int batch_steal( int self )
+{
+  int k;
+
+  for ( k = 1; k < batch_nthreads; k++ ) {
+    batch_queue *victim = &batch_queues[ ( self + k ) % batch_nthreads ];
+    unsigned long long r = __atomic_load_n( &victim->range, __ATOMIC_ACQUIRE );
+
+    while ( BATCH_NEXT( r ) < BATCH_END( r ) ) {
+      unsigned next = BATCH_NEXT( r ), end = BATCH_END( r );
+      unsigned half = end - ( end - next + 1 ) / 2;
+
+      if ( __atomic_compare_exchange_n( &victim->range, &r, BATCH_RANGE( next, half ),
+                                        0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) ) {
+        __atomic_store_n( &batch_queues[ self ].range,
+                          BATCH_RANGE( half + 1, end ), __ATOMIC_RELEASE );
+        return half;
+      }
+    }
+  }
+  return -1;
+}
+
+void *batch_worker( void *arg )
+{
+  int self = (int) (long) arg;
+  sm_context *sm = sm_new();
+  int j;
+
+  while ( ( j = __atomic_fetch_add( &batch_next_image, 1, __ATOMIC_RELAXED ) ) < batch_nimages )
+    batch_parse( sm, &batch_images[ j ] );
+  pthread_barrier_wait( &batch_barrier );
+
+  for ( ;; ) {
+    if ( ( j = batch_pop( &batch_queues[ self ] ) ) < 0 &&
+         ( j = batch_steal( self ) ) < 0 )
+      break;
+    batch_one( sm, &batch_jobs[ j ] );
+  }
+  sm_free( sm );
+  return NULL;
+}
+
+// Slot of file name in the open-addressed table of image indices.
+unsigned batch_slot( char *name, int *table, int size )
+{
+  unsigned h = 5381;
+  char *s;
+
+  for ( s = name; *s; s++ )
+    h = h * 33 + (unsigned char) *s;
+  for ( h %= size; table[ h ] >= 0; h = ( h + 1 ) % size )
+    if ( ! strcmp( batch_images[ table[ h ] ].name, name ) )
+      break;
+  return h;
+}
+
+// Find or add the image of file name, so manifests that name one
+// program many times parse it once.
+int batch_image_of( char *name, int *table, int size )
+{
+  unsigned h = batch_slot( name, table, size );
+
+  if ( table[ h ] >= 0 )
+    return table[ h ];
+  table[ h ] = batch_nimages;
+  memset( &batch_images[ batch_nimages ], 0, sizeof( batch_image ) );
+  batch_images[ batch_nimages ].name = strdup( name );
+  return batch_nimages++;
+}
+
+void batch_read( char *manifest )
+{
+  char buf[ 1000 ];
+  int line = 0, cap = 0, *table = NULL, size = 0;
+  FILE *file = fopen( manifest, "r" );
+
+  if ( file == NULL ) {
+    printf( "%s not found.\n", manifest );
+    exit( 1 );
+  }
+  while ( fgets( buf, sizeof( buf ), file ) != NULL ) {
+    char *name, *n, *p, *variant, *state, *end;
+    batch_job *job;
+
+    line++;
+    if ( ( name = strtok( buf, " \t\r\n" ) ) == NULL || name[ 0 ] == '#' )
+      continue;
+    n = strtok( NULL, " \t\r\n" );
+    p = strtok( NULL, " \t\r\n" );
+    variant = strtok( NULL, " \t\r\n" );
+    state = strtok( NULL, " \t\r\n" );
+    if ( p == NULL || strtok( NULL, " \t\r\n" ) != NULL ) {
+      printf( "%s:%d: expected <filename> <n> <p> [<variant> [<state>]].\n", manifest, line );
+      exit( 1 );
+    }
+
+    if ( batch_njobs == cap ) {
+      cap = cap ? 2 * cap : 64;
+      batch_jobs = realloc( batch_jobs, cap * sizeof( batch_job ) );
+      batch_images = realloc( batch_images, cap * sizeof( batch_image ) );
+      free( table );
+      size = 2 * cap + 1;
+      table = malloc( size * sizeof( int ) );
+      if ( batch_jobs == NULL || batch_images == NULL || table == NULL ) {
+        printf( "Out of memory for the batch manifest.\n" );
+        exit( 1 );
+      }
+      memset( table, -1, size * sizeof( int ) );
+      int k;
+      for ( k = 0; k < batch_nimages; k++ )
+        table[ batch_slot( batch_images[ k ].name, table, size ) ] = k;
+    }
+
+    job = &batch_jobs[ batch_njobs++ ];
+    memset( job, 0, sizeof( batch_job ) );
+    job->line = line;
+    job->count = strtol( n, &end, 10 );
+    if ( *end || job->count < 0 ) {
+      printf( "%s:%d: bad instruction count %s.\n", manifest, line, n );
+      exit( 1 );
+    }
+    job->pipe_count = strtol( p, &end, 10 );
+    if ( *end || job->pipe_count < 0 ) {
+      printf( "%s:%d: bad pipeline instruction count %s.\n", manifest, line, p );
+      exit( 1 );
+    }
+    if ( state != NULL ) {
+      job->expect = strtoul( state, &end, 16 );
+      job->check_state = 1;
+      if ( *end ) {
+        printf( "%s:%d: bad state checksum %s.\n", manifest, line, state );
+        exit( 1 );
+      }
+    }
+    job->variant = strdup( variant ? variant : SM_VARIANT );
+    job->image = batch_image_of( name, table, size );
+  }
+  fclose( file );
+  free( table );
+}
+
+// Run the jobs of manifest; returns the exit status of the simulator,
+// 0 when no job failed.
+int batch_run( char *manifest )
+{
+  int t, j, failed = 0, passed = 0, skipped = 0, errors = 0;
+  pthread_t *threads;
+
+  sm_verbose = 0;
+  batch_read( manifest );
+
+  batch_nthreads = batch_threads ? batch_threads : sysconf( _SC_NPROCESSORS_ONLN );
+  if ( batch_nthreads < 1 )
+    batch_nthreads = 1;
+  if ( batch_nthreads > batch_njobs && batch_njobs > 0 )
+    batch_nthreads = batch_njobs;
+  if ( isa_engine == ENGINE_JIT && batch_nthreads > 1 ) {
+    printf( "The JIT runs one simulation at a time, using the threaded engine.\n" );
+    isa_engine = ENGINE_THREADED;
+  }
+
+  batch_queues = aligned_alloc( 64, batch_nthreads * sizeof( batch_queue ) );
+  threads = malloc( batch_nthreads * sizeof( pthread_t ) );
+  if ( batch_queues == NULL || threads == NULL ) {
+    printf( "Out of memory for the batch workers.\n" );
+    exit( 1 );
+  }
+  for ( t = 0; t < batch_nthreads; t++ )
+    batch_queues[ t ].range =
+      BATCH_RANGE( (long) batch_njobs * t / batch_nthreads,
+                   (long) batch_njobs * ( t + 1 ) / batch_nthreads );
+
+  double start = host_seconds();
+
+  pthread_barrier_init( &batch_barrier, NULL, batch_nthreads );
+  for ( t = 1; t < batch_nthreads; t++ )
+    if ( pthread_create( &threads[ t ], NULL, batch_worker, (void *) (long) t ) ) {
+      printf( "Cannot start batch worker %d.\n", t );
+      exit( 1 );
+    }
+  batch_worker( (void *) 0L );
+  for ( t = 1; t < batch_nthreads; t++ )
+    pthread_join( threads[ t ], NULL );
+  pthread_barrier_destroy( &batch_barrier );
+
+  double seconds = host_seconds() - start;
+
+  for ( j = 0; j < batch_njobs; j++ ) {
+    batch_job *job = &batch_jobs[ j ];
+
+    printf( "%d %s file=%s variant=%s n=%ld p=%ld cycles=%ld retired=%ld state=%08x seconds=%.6f\n",
+            job->line, job->result, batch_images[ job->image ].name, job->variant,
+            job->count, job->pipe_count, job->cycles, job->retired, job->state, job->seconds );
+    if ( ! strcmp( job->result, "pass" ) )
+      passed++;
+    else if ( ! strcmp( job->result, "skip" ) )
+      skipped++;
+    else if ( ! strcmp( job->result, "error" ) )
+      errors++;
+    else
+      failed++;
+  }
+  printf( "Batch: %d jobs, %d passed, %d failed, %d skipped, %d errors, %d threads, %.6f s.\n",
+          batch_njobs, passed, failed, skipped, errors, batch_nthreads, seconds );
+  free( threads );
+  return failed || errors;
+}
@@ -0,0 +1,237 @@
+// Branch prediction for the speculative front end of jump-opt-sm.c:
+// direction predictors (-p), a branch target buffer (-B) and a return
+// address stack (-R).
+//
+//   static    every jump and bra predicted not taken
+//   bimodal   a table of 2-bit counters indexed by the branch pc
+//   gshare    the same table indexed by the pc xor the global history
+//             of the last hist_bits branch outcomes
+//   flush     every control instruction, call and return too, not
+//             taken: fetch never waits, and write-back squashes what
+//             it fetched whenever the pc goes elsewhere
+//
+// fetch predicts, and shifts the prediction into the history at once;
+// write-back trains the counter the prediction used and, when the
+// branch went the other way, rebuilds the history from the value it
+// had at fetch, which each instruction carries down the pipe.
+//
+// This file is included by sm-context.c, which keeps one predictor in
+// each context.
+
+// The BP_* kinds are defined in sm-options.c with the option.
+
+#define BP_MAX_BITS 16
+
+typedef struct{
+  int  kind;
+  int  index_bits;           // log2 of the number of counters
+  int  hist_bits;            // gshare: branch outcomes in the history
+  u16  hist;                 // global history, newest outcome in bit 0
+
+  // Counters: resolved jump and bra, and those predicted the wrong
+  // way; redirects of fetch off a wrong path.  The slots they squash
+  // are in the context's sm_perf.
+  long branches, mispredicted, redirects;
+
+  unsigned char counter[ 1 << BP_MAX_BITS ];   // 0, 1 not taken; 2, 3 taken
+} bpred;
+
+void bp_reset( bpred *bp, int kind, int index_bits, int hist_bits )
+{
+  bp->kind = kind;
+  bp->index_bits = index_bits;
+  bp->hist_bits = hist_bits;
+  bp->hist = 0;
+  bp->branches = bp->mispredicted = bp->redirects = 0;
+  if ( kind == BP_BIMODAL || kind == BP_GSHARE )
+    memset( bp->counter, 1, (size_t) 1 << index_bits );  // weakly not taken
+}
+
+// Counter used for the branch at pc when the history was hist.
+unsigned bp_index( bpred *bp, u16 pc, u16 hist )
+{
+  unsigned mask = ( 1u << bp->index_bits ) - 1;
+
+  if ( bp->kind == BP_GSHARE )
+    return ( pc ^ ( hist & ( ( 1u << bp->hist_bits ) - 1 ) ) ) & mask;
+  return pc & mask;
+}
+
+// Predict the jump or bra at pc; 1 for taken.
+int bp_predict( bpred *bp, u16 pc )
+{
+  int taken = 0;
+
+  if ( bp->kind == BP_BIMODAL || bp->kind == BP_GSHARE )
+    taken = bp->counter[ bp_index( bp, pc, bp->hist ) ] >= 2;
+  bp->hist = ( bp->hist << 1 ) | taken;
+  return taken;
+}
+
+// The jump or bra at pc, predicted with history hist, went the way of
+// taken; predicted says which way fetch went.
+void bp_resolve( bpred *bp, u16 pc, u16 hist, int predicted, int taken )
+{
+  bp->branches++;
+  if ( bp->kind == BP_BIMODAL || bp->kind == BP_GSHARE ) {
+    unsigned char *c = &bp->counter[ bp_index( bp, pc, hist ) ];
+    if ( taken && *c < 3 )
+      (*c)++;
+    else if ( ! taken && *c > 0 )
+      (*c)--;
+  }
+  if ( predicted != taken ) {
+    bp->mispredicted++;
+    bp->hist = ( hist << 1 ) | taken;
+  }
+}
+
+const char *bp_name( int kind )
+{
+  switch ( kind ) {
+  case BP_STATIC:  return "static";
+  case BP_BIMODAL: return "bimodal";
+  case BP_GSHARE:  return "gshare";
+  case BP_FLUSH:   return "flush";
+  default:         return "none";
+  }
+}
+
+// Branch target buffer (-B): where a control instruction predicted
+// taken goes, so fetch can follow it in the cycle it fetched it rather
+// than wait for write-back.  Set-associative, keyed on the fetch pc,
+// least recently used way replaced; filled by write-back with the
+// target of every taken control instruction.
+
+#define BTB_MAX 4096
+
+typedef struct{
+  u16  pc;
+  u16  target;
+  int  valid;
+  unsigned used;             // tick of the last hit or fill
+} btb_entry;
+
+typedef struct{
+  int  sets, ways;           // sets 0: no BTB
+  unsigned tick;
+
+  // Lookups by fetch that found a target and that did not; targets
+  // that write-back found wrong.
+  long hits, misses, mistargets;
+
+  btb_entry entry[ BTB_MAX ];
+} btb_table;
+
+void btb_reset( btb_table *b, int entries, int ways )
+{
+  b->sets = entries / ways;
+  b->ways = ways;
+  b->tick = 0;
+  b->hits = b->misses = b->mistargets = 0;
+  memset( b->entry, 0, sizeof( btb_entry ) * entries );
+}
+
+// The target of the control instruction at pc, or -1.
+int btb_lookup( btb_table *b, u16 pc )
+{
+  btb_entry *e = &b->entry[ ( pc & ( b->sets - 1 ) ) * b->ways ];
+  int w;
+
+  for ( w = 0; w < b->ways; w++ )
+    if ( e[ w ].valid && e[ w ].pc == pc ) {
+      e[ w ].used = ++b->tick;
+      b->hits++;
+      return e[ w ].target;
+    }
+  b->misses++;
+  return -1;
+}
+
+// The control instruction at pc was taken to target.
+void btb_update( btb_table *b, u16 pc, u16 target )
+{
+  btb_entry *e = &b->entry[ ( pc & ( b->sets - 1 ) ) * b->ways ];
+  btb_entry *victim = e;
+  int w;
+
+  for ( w = 0; w < b->ways; w++ ) {
+    if ( e[ w ].valid && e[ w ].pc == pc ) {
+      victim = &e[ w ];
+      break;
+    }
+    if ( ! e[ w ].valid || ( victim->valid && e[ w ].used < victim->used ) )
+      victim = &e[ w ];
+  }
+  victim->pc = pc;
+  victim->target = target;
+  victim->valid = 1;
+  victim->used = ++b->tick;
+}
+
+// Return address stack (-R): fetch pushes the address after each call
+// and pops the target of each return.  It is circular, so a call chain
+// deeper than the stack overwrites its oldest entries, and a return
+// that finds it empty falls back to the BTB.  Every instruction
+// carries the top and the entry on it from fetch, from which a
+// squash rebuilds the stack of the path fetch goes back to.
+
+#define RAS_MAX 64
+
+typedef struct{
+  int  depth;                // 0: no stack
+  int  top, count;
+
+  // Returns fetch predicted from the stack, and those write-back found
+  // going elsewhere; calls that overwrote an entry, and returns that
+  // found the stack empty.
+  long predicted, wrong, overflows, underflows;
+
+  u16  addr[ RAS_MAX ];
+} ras_stack;
+
+void ras_reset( ras_stack *r, int depth )
+{
+  r->depth = depth;
+  r->top = r->count = 0;
+  r->predicted = r->wrong = r->overflows = r->underflows = 0;
+}
+
+void ras_push( ras_stack *r, u16 addr )
+{
+  r->top = ( r->top + 1 ) % r->depth;
+  r->addr[ r->top ] = addr;
+  if ( r->count == r->depth )
+    r->overflows++;
+  else
+    r->count++;
+}
+
+// The predicted return address, or -1 when the stack is empty.
+int ras_pop( ras_stack *r )
+{
+  int addr;
+
+  if ( ! r->count ) {
+    r->underflows++;
+    return -1;
+  }
+  addr = r->addr[ r->top ];
+  r->top = ( r->top + r->depth - 1 ) % r->depth;
+  r->count--;
+  return addr;
+}
+
+// The state fetch saves with each instruction: top and count, and the
+// entry on top.
+u16 ras_mark( ras_stack *r )
+{
+  return r->top | r->count << 8;
+}
+
+void ras_restore( ras_stack *r, u16 mark, u16 top_addr )
+{
+  r->top = mark & 0xFF;
+  r->count = mark >> 8;
+  r->addr[ r->top ] = top_addr;
+}
@@ -0,0 +1,188 @@
+// The state of one simulation: the ISA-level SM, the pipelined SM and
+// the decode cache of the ISA-level engines.
+//
+// Every function that reads or changes simulator state takes the
+// context it works on, so a process can run any number of simulations,
+// one per context, on as many threads.  Contexts are aligned to a cache
+// line so two threads never share one.
+//
+// This file is included by each of the *-sm.c simulators after the
+// pipeline register types and sm-options.c, and before sm-trace.c,
+// sm-rtrace.c and sm-cycles.c.
+
+#include <stddef.h>
+
+#include "sm-image.c"
+#include "sm-bpred.c"
+#include "sm-perf.c"
+#include "sm-prof.c"
+
+typedef struct sm_trace sm_trace;     // see sm-trace.c
+typedef struct sm_rtrace sm_rtrace;   // see sm-rtrace.c
+typedef struct rt_reader rt_reader;
+typedef struct sm_cycles sm_cycles;   // see sm-cycles.c
+
+// Pre-decoded form of the instruction at one address; see sm-isa.c.
+typedef struct{
+  unsigned char xop;     // handler for run_isa: a superinstruction or op
+  unsigned char op;      // handler for this instruction alone (DOP_*)
+  unsigned char rnumc;   // rC
+  unsigned char rnumb;   // rB or subfunction nibble
+  unsigned char rnuma;   // rA
+  unsigned char data;    // immediate data
+  u16  imm;              // DOP_LI: the constant; compare-branch: rA of the branch
+} decoded_inst;
+
+typedef struct{
+  // The state of SM.
+  i16  reg[ REGS ];
+  u16  pc;
+
+  // The state of the pipelined SM.
+  i16  pipe_reg[ REGS ];
+  u16  pipe_pc;
+
+  // Pipeline registers, current and next.
+  f_register cF, nF;
+  d_register cD, nD;
+  e_register cE, nE;
+  m_register cM, nM;
+  w_register cW, nW;
+
+  // Stall control of the hazard-detecting variants.
+  int paused;
+  int stage;
+  int pause_counter;
+  d_register pause_caused_byE, pause_caused_byM, pause_caused_byW;
+
+  // Forward results to decode instead of stalling; see sm-forward.c.
+  int forward;
+
+  // Branch prediction of jump-opt's front end, and whether fetch must
+  // follow the instruction in write-back off a squashed wrong path.
+  bpred bp;
+  btb_table btb;
+  ras_stack ras;
+  int redirect;
+
+  // jump-opt: resolve jump and bra in decode (-D), counting them and
+  // the taken ones; and whether fetch runs past control instructions at
+  // all, as it does with -p or -D.
+  int early;
+  long early_branches, early_taken;
+  int speculate;
+
+  // -S: delayed control instructions, and their delay slots, 0 without.
+  // micro_step keeps the targets of the last few, due after so many
+  // more instructions; jump-opt numbers what it fetches and keeps them
+  // by the number of the fetch they redirect.
+  int delayed;
+  int delay;
+  u16 isa_delay_pc[ 4 ];
+  unsigned char isa_delay_set[ 4 ];
+  u16 fseq;
+  u16 delay_seq[ 16 ], delay_target[ 16 ];
+  unsigned char delay_set[ 16 ];
+  long delay_taken;
+
+  // Cycle counter of inst_ctrl in pipeline-ctrl-basic.c.
+  unsigned counter;
+
+  // Number of superinstructions run_isa executed.
+  long isa_fused;
+
+  // Set by dcache_flush to a number no other load of any context has,
+  // so sm-jit.c can tell whether its blocks come from this program.
+  unsigned long load_gen;
+
+  // Performance counters of the pipeline; see sm-perf.c.
+  sm_perf perf;
+
+  // -H: per-address and per-opcode profile, or NULL; see sm-prof.c.
+  sm_prof *prof;
+
+  // -T: pipeline trace, or NULL, and the number of the last instruction
+  // fetch took; see sm-trace.c.
+  sm_trace *trace;
+  u32 fetched;
+
+  // -r: retirement trace, and -k: the trace write-back is checked
+  // against, or NULL; see sm-rtrace.c.
+  sm_rtrace *rtrace;
+  rt_reader *rcheck;
+
+  // -C: per-cycle pipeline records, or NULL; see sm-cycles.c.
+  sm_cycles *cycles;
+
+  i16  mem[ MEMSIZE ];
+  i16  pipe_mem[ MEMSIZE ];
+  decoded_inst dcache[ MEMSIZE ];
+} __attribute__(( aligned( 64 ) )) sm_context;
+
+// Reset both machines: memory and registers zero, pc 0, and the
+// pipeline in the mode of the command line.  The decode cache must be
+// flushed (dcache_flush) once the program is in mem.
+void sm_reset( sm_context *sm )
+{
+  memset( sm, 0, offsetof( sm_context, dcache ) );
+  sm->counter = 3;
+  sm->forward = pipe_forward;
+  bp_reset( &sm->bp, bp_kind, bp_index_bits, bp_hist_bits );
+  if ( btb_entries )
+    btb_reset( &sm->btb, btb_entries, btb_ways );
+  if ( ras_depth )
+    ras_reset( &sm->ras, ras_depth );
+  sm->early = early_resolve;
+  sm->delayed = delay_slots >= 0;
+  sm->delay = sm->delayed ? delay_slots : 0;
+  sm->speculate = bp_kind != BP_NONE || early_resolve || sm->delayed;
+}
+
+sm_context *sm_new()
+{
+  sm_context *sm = aligned_alloc( 64, sizeof( sm_context ) );
+
+  if ( sm == NULL ) {
+    printf( "Out of memory for a simulator context.\n" );
+    exit( 1 );
+  }
+  sm_reset( sm );
+  return sm;
+}
+
+void sm_free( sm_context *sm )
+{
+  free( sm->prof );
+  free( sm );
+}
+
+// Fletcher-32 of the ISA-level registers and memory, in that order, as
+// u16: the state the workloads in workloads/ are checked against.
+u32 sm_checksum( sm_context *sm )
+{
+  u32 a = 0xFFFF, b = 0xFFFF;
+  int i;
+
+  for ( i = 0; i < REGS + MEMSIZE; i++ ) {
+    a += (u16) ( i < REGS ? sm->reg[ i ] : sm->mem[ i - REGS ] );
+    b += a;
+    if ( i % 359 == 358 || i == REGS + MEMSIZE - 1 ) {   // before the sums overflow
+      a = ( a & 0xFFFF ) + ( a >> 16 );
+      b = ( b & 0xFFFF ) + ( b >> 16 );
+    }
+  }
+  a = ( a & 0xFFFF ) + ( a >> 16 );
+  b = ( b & 0xFFFF ) + ( b >> 16 );
+  return b << 16 | a;
+}
+
+// Load the program in file name into the memory of both machines, and
+// start both at its entry pc if it has one.
+int sm_load( sm_context *sm, char *name )
+{
+  int status = sm_load_image( sm->mem, name, NULL, &sm->pc );
+
+  sm->pipe_pc = sm->pc;
+  memcpy( sm->pipe_mem, sm->mem, sizeof( sm->mem ) );
+  return status;
+}
@@ -0,0 +1,149 @@
+// Per-cycle pipeline records (-C <file>), for sm-analyze.c.
+//
+// At the end of every cycle pipe_step runs, one fixed-size record of
+// what the pipe held in it: the address and word of the instruction in
+// decode, execute, memory and write-back (CY_NONE for a bubble or a
+// squashed slot), the address memory accessed, and whether and why
+// fetch stalled.  The stall cause is the counter of sm-perf.c the cycle
+// added to, and for a RAW or load-use stall wait_pc is the instruction
+// decode holds for it; what a control stall or a squash waited on the
+// analyser finds in the stages.  A record in which write-back holds an
+// instruction is its retirement.
+//
+// The file is a 16-byte header, "SMCY", the format version and the
+// record size as two little-endian u16, 8 bytes zero, then one record
+// per cycle, in order, so record i is at 16 + i * 32 and a cycle range
+// is found by bisection.  The records are buffered and written in
+// blocks of CY_BLOCK.
+//
+// This file is included by each of the *-sm.c simulators after their
+// pipeline control functions, whose mem_access_ctrl it uses;
+// sm-context.c keeps a pointer to the records in each context, NULL
+// when there are none.
+
+#define CY_VERSION  1
+#define CY_BLOCK    32768        // records written at once
+
+#define CY_NONE     0xFFFF
+
+// Stage numbers in pc[] and inst[]
+#define CY_D        0
+#define CY_E        1
+#define CY_M        2
+#define CY_W        3
+
+// Record flags
+#define CY_LOAD     1
+#define CY_STORE    2
+
+typedef struct{
+  u32  cycle;
+  u16  pc[ 4 ];              // of the instruction in D, E, M and W
+  u16  inst[ 4 ];            // and its word
+  u16  wait_pc;              // RAW and load-use stalls: the instruction held
+  u16  addr;                 // CY_LOAD, CY_STORE: the address memory accessed
+  u16  fetch_pc;             // the address fetch read, CY_NONE for none
+  unsigned char cause;       // PERF_* + 1 of the stall, 0 for none
+  unsigned char squashed;    // slots squashed in the cycle
+  unsigned char flags;
+  unsigned char pad[ 3 ];
+} cy_record;
+
+struct sm_cycles{
+  FILE *f;
+  u32  written;
+  long stalls[ PERF_CAUSES ];  // sm->perf's at the last record
+  long squashed;
+  int  n;
+  cy_record rec[ CY_BLOCK ];
+};
+
+sm_cycles *cy_open( char *file )
+{
+  sm_cycles *c = calloc( 1, sizeof( sm_cycles ) );
+  unsigned char head[ 16 ] = { 'S', 'M', 'C', 'Y', CY_VERSION, 0, sizeof( cy_record ), 0 };
+
+  if ( c == NULL ) {
+    printf( "Out of memory for the cycle records.\n" );
+    exit( 1 );
+  }
+  c->f = fopen( file, "wb" );
+  if ( c->f == NULL || fwrite( head, sizeof( head ), 1, c->f ) != 1 ) {
+    printf( "Cannot write the cycle records to %s.\n", file );
+    exit( 1 );
+  }
+  return c;
+}
+
+void cy_flush( sm_cycles *c )
+{
+  if ( c->n && fwrite( c->rec, sizeof( cy_record ), c->n, c->f ) != (size_t) c->n ) {
+    printf( "Cannot write the cycle records.\n" );
+    exit( 1 );
+  }
+  c->written += c->n;
+  c->n = 0;
+}
+
+void cy_close( sm_cycles *c )
+{
+  cy_flush( c );
+  fclose( c->f );
+  free( c );
+}
+
+static inline void cy_stage( cy_record *r, int s, u32 tid, u4 fn, u4 rnumc, u4 rnumb, u4 rnuma,
+                             u16 valP )
+{
+  if ( tid ) {
+    r->pc[ s ] = valP - 1;
+    r->inst[ s ] = fn << 12 | rnumc << 8 | rnumb << 4 | rnuma;
+  } else {
+    r->pc[ s ] = CY_NONE;
+    r->inst[ s ] = 0;
+  }
+}
+
+// Record the cycle pipe_step has just run, before it counts the cycle.
+void cy_pipe( sm_context *sm )
+{
+  sm_cycles *c = sm->cycles;
+  cy_record *r = &c->rec[ c->n ];
+  int mem_access = mem_access_ctrl( sm->cM.fn, sm->cM.rnuma, sm->cM.rnumb, sm->cM.rnumc );
+  int i;
+
+  r->cycle = sm->perf.cycles;
+  cy_stage( r, CY_D, sm->cD.tid, sm->cD.fn, sm->cD.rnumc, sm->cD.rnumb, sm->cD.rnuma, sm->cD.valP );
+  cy_stage( r, CY_E, sm->cE.tid, sm->cE.fn, sm->cE.rnumc, sm->cE.rnumb, sm->cE.rnuma, sm->cE.valP );
+  cy_stage( r, CY_M, sm->cM.tid, sm->cM.fn, sm->cM.rnumc, sm->cM.rnumb, sm->cM.rnuma, sm->cM.valP );
+  cy_stage( r, CY_W, sm->cW.tid, sm->cW.fn, sm->cW.rnumc, sm->cW.rnumb, sm->cW.rnuma, sm->cW.valP );
+
+  r->flags = 0;
+  r->addr = 0;
+  if ( sm->cM.tid && ( mem_access == MREAD || mem_access == MWRITE ) ) {
+    r->flags = mem_access == MREAD ? CY_LOAD : CY_STORE;
+    r->addr = sm->nW.addr;
+  }
+  r->fetch_pc = sm->nD.tid && sm->nD.tid != sm->cD.tid ? sm->nD.valP - 1 : CY_NONE;
+
+  r->cause = 0;
+  for ( i = 0; i < PERF_CAUSES; i++ )
+    if ( sm->perf.stalls[ i ] != c->stalls[ i ] ) {
+      c->stalls[ i ] = sm->perf.stalls[ i ];
+      r->cause = i + 1;
+    }
+  r->squashed = sm->perf.squashed - c->squashed;
+  c->squashed = sm->perf.squashed;
+
+  r->wait_pc = CY_NONE;
+  if ( sm->paused && sm->stage >= 1 && sm->stage <= 3 ) {
+    d_register *p = sm->stage == 1 ? &sm->pause_caused_byW :
+                    sm->stage == 2 ? &sm->pause_caused_byM : &sm->pause_caused_byE;
+    if ( p->tid )
+      r->wait_pc = p->valP - 1;
+  } else if ( sm->cD.tid && sm->nD.tid == sm->cD.tid )   // -f: held for a load
+    r->wait_pc = sm->cD.valP - 1;
+
+  if ( ++c->n == CY_BLOCK )
+    cy_flush( c );
+}
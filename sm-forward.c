@@ -0,0 +1,144 @@
+// Forwarding (-f) for the hazard-detecting pipelines.
+//
+// Without it, an instruction in decode that reads a register an older
+// instruction has yet to write back waits in decode, behind 1 to 3
+// bubbles, until the value is in pipe_reg.  With it, pipe_step runs the
+// stages from write-back to fetch, so that when decode reads its
+// operands the ALU result of the instruction ahead of it is already in
+// nM.aluR and the results of the one ahead of that are in nW.aluR and
+// nW.memV; decode takes the youngest of these that writes the register.
+// Only a value loaded from memory by the instruction directly ahead
+// (ldmem, pop) is not there yet, and decode holds for one cycle.
+//
+// This file is included by alu-opt-sm.c, mem-alu-opt-sm.c and
+// jump-opt-sm.c after their pipeline control functions.
+
+// The register instruction fn/rnumb writes with its ALU result, or -1.
+int alu_dest( u4 fn, u4 rnuma, u4 rnumb, u4 rnumc )
+{
+  if ( ! alu_wb_ctrl( fn, rnuma, rnumb, rnumc ) )
+    return -1;
+  return reg_ctrl( fn, rnuma, rnumb, rnumc ) ? rnumc : rnuma;
+}
+
+// The register instruction fn/rnumb writes with a memory value, or -1.
+int mem_dest( u4 fn, u4 rnuma, u4 rnumb, u4 rnumc )
+{
+  return mem_wb_ctrl( fn, rnuma, rnumb, rnumc ) ? rnumc : -1;
+}
+
+// Does instruction fn/rnumb read register r?
+int reads_reg( u4 fn, u4 rnuma, u4 rnumb, u4 rnumc, int r )
+{
+  switch ( fn ) {
+  case  0:
+    switch ( rnumb ) {
+    case  0:
+    case  7:
+    case  8: return 0;                             // noop, unassigned
+    case  2:                                       // stmem
+    case  3:                                       // call
+    case  5:                                       // jump
+    case  6:                                       // bra
+    case 15: return r == rnuma || r == rnumc;      // push
+    default: return r == rnuma;
+    }
+  case 12:                                         // cmove
+  case 13: return r == rnuma || r == rnumb || r == rnumc;  // cadd
+  case 14:                                         // immlow
+  case 15: return r == rnumc;                      // immhgh
+  default: return r == rnuma || r == rnumb;
+  }
+}
+
+// Must the instruction in decode wait a cycle for a load in execute?
+int load_use( sm_context *sm )
+{
+  int r = mem_dest( sm->cE.fn, sm->cE.rnuma, sm->cE.rnumb, sm->cE.rnumc );
+
+  // pop writes rA after rC, so rC = rA leaves the ALU result in it.
+  if ( r < 0 || r == alu_dest( sm->cE.fn, sm->cE.rnuma, sm->cE.rnumb, sm->cE.rnumc ) )
+    return 0;
+  return reads_reg( sm->cD.fn, sm->cD.rnuma, sm->cD.rnumb, sm->cD.rnumc, r );
+}
+
+// Value of register r for decode.  Without forwarding, or when no
+// instruction in flight writes r, that is pipe_reg[ r ].
+i16 forward_reg( sm_context *sm, u4 r )
+{
+  if ( ! sm->forward )
+    return sm->pipe_reg[ r ];
+  if ( alu_dest( sm->nM.fn, sm->nM.rnuma, sm->nM.rnumb, sm->nM.rnumc ) == r )
+    return sm->nM.aluR;
+  if ( alu_dest( sm->nW.fn, sm->nW.rnuma, sm->nW.rnumb, sm->nW.rnumc ) == r )
+    return sm->nW.aluR;
+  if ( mem_dest( sm->nW.fn, sm->nW.rnuma, sm->nW.rnumb, sm->nW.rnumc ) == r )
+    return sm->nW.memV;
+  return sm->pipe_reg[ r ];
+}
+
+// Keep the instruction in decode, and the one fetch is on, for another
+// cycle, and send a bubble to execute in their place.
+void hold_decode( sm_context *sm )
+{
+  sm->perf.stalls[ PERF_LOAD_USE ]++;
+  sm->nF = sm->cF;
+  sm->nD = sm->cD;
+  sm->pipe_pc = sm->cF.pc;
+  memset( &sm->nE, 0, sizeof( sm->nE ) );
+  sm->nE.rnumb = 7;
+}
+
+long pipe_run( sm_context *sm, long pipe_count );
+void init_pipeline_regs( sm_context *sm );
+int compare_ISA_to_pipeline_prog_state( sm_context *sm );
+
+// Did sm and ref, a quiet rerun of its program on another pipeline,
+// both run the same program to the end?  They must retire as many
+// instructions and both end in the state the ISA-level run of sm did;
+// only then do their cycles compare.
+int same_run( sm_context *sm, sm_context *ref )
+{
+  int verbose = sm_verbose, same;
+
+  if ( ref->perf.retired != sm->perf.retired )
+    return 0;
+  memcpy( ref->mem, sm->mem, sizeof( ref->mem ) );
+  memcpy( ref->reg, sm->reg, sizeof( ref->reg ) );
+  sm_verbose = 0;
+  same = compare_ISA_to_pipeline_prog_state( sm ) && compare_ISA_to_pipeline_prog_state( ref );
+  sm_verbose = verbose;
+  return same;
+}
+
+static inline double cpi( sm_context *sm )
+{
+  return sm->perf.retired ? (double) sm->perf.cycles / sm->perf.retired : 0.0;
+}
+
+// Run program name again, quietly, on the stall-only pipeline and print
+// how its CPI compares with that of the forwarding run sm, if it ran
+// the same program.
+void forward_compare( sm_context *sm, char *name, long pipe_count )
+{
+  sm_context *ref = sm_new();
+  int verbose = sm_verbose;
+
+  ref->forward = 0;
+  sm_load( ref, name );
+  init_pipeline_regs( ref );
+  sm_verbose = 0;
+  pipe_run( ref, pipe_count );
+  sm_verbose = verbose;
+
+  printf( "Stall-only: %ld cycles, %ld instructions retired, CPI %.3f; ",
+          ref->perf.cycles, ref->perf.retired, cpi( ref ) );
+  if ( same_run( sm, ref ) )
+    printf( "forwarding divides the CPI by %.3f and saves %.1f%% of the cycles.\n",
+            cpi( sm ) ? cpi( ref ) / cpi( sm ) : 0.0,
+            100.0 * ( 1.0 - cpi( sm ) / cpi( ref ) ) );
+  else
+    printf( "it did not complete the same program as the forwarding run, "
+            "so there is no saving to report.\n" );
+  sm_free( ref );
+}
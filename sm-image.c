@@ -0,0 +1,349 @@
+// Memory images: the programs the simulators load, in two formats.
+//
+// Text images have one "<address> <value>" pair per line as sscanf's
+// "%u %i" reads them: the address in decimal, the value in decimal,
+// octal with a leading 0 or hex with 0x, either signed; lines that do
+// not start so are skipped.  The file is mapped and parsed in place, a
+// line at a time, rather than through stdio.
+//
+// Binary images, files whose name ends in .smimg, hold the words
+// themselves, in segments of consecutive addresses:
+//
+//   0   "SMIM"
+//   4   the format version, u16
+//   6   flags, u16: IMG_ENTRY, IMG_CHECKSUM
+//   8   IMG_ENTRY: the pc to start at, u16; 2 bytes zero
+//   12  the number of segments, u32
+//   16  IMG_CHECKSUM: the Fletcher-32 checksum of everything after the
+//       header, taken as little-endian u16; 4 bytes zero
+//   24  per segment, its first address and its length in words, u32
+//
+// and after that table the words of each segment in turn, little-endian
+// i16.  Loading one is a memcpy per segment out of the mapped file.  An
+// image sets only the addresses of its pairs or segments, so one can be
+// loaded over another, as -l does.
+//
+// sm-img.c converts between the two.
+//
+// This file is included by sm-context.c, and by the tools that read or
+// write images.
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define IMG_VERSION   1
+#define IMG_HEADER    24
+#define IMG_ENTRY     1
+#define IMG_CHECKSUM  2
+
+// Whether file name is a binary image.
+static inline int img_binary( const char *name )
+{
+  size_t n = strlen( name );
+
+  return n >= 6 && ! strcmp( name + n - 6, ".smimg" );
+}
+
+// Map file name, or read it whole when it cannot be mapped (a pipe,
+// say), into *buf, NULL for an empty file.  Returns 0, or 1 after
+// printing the error.
+static int img_map( char *name, char **buf, size_t *size, int *mapped )
+{
+  int fd = open( name, O_RDONLY );
+  struct stat st;
+
+  *buf = NULL;
+  *size = 0;
+  *mapped = 0;
+  if ( fd < 0 || fstat( fd, &st ) ) {
+    printf( "%s not found.\n", name );
+    if ( fd >= 0 )
+      close( fd );
+    return 1;
+  }
+  if ( S_ISREG( st.st_mode ) && st.st_size == 0 ) {
+    close( fd );
+    return 0;
+  }
+  *buf = S_ISREG( st.st_mode ) ? mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 ) : MAP_FAILED;
+  if ( *buf != MAP_FAILED ) {
+    *mapped = 1;
+    *size = st.st_size;
+    madvise( *buf, st.st_size, MADV_SEQUENTIAL );
+  } else {
+    size_t cap = 1 << 16;
+    ssize_t n;
+    *buf = malloc( cap );
+    while ( *buf != NULL && ( n = read( fd, *buf + *size, cap - *size ) ) > 0 )
+      if ( ( *size += n ) == cap )
+        *buf = realloc( *buf, cap *= 2 );
+    if ( *buf == NULL ) {
+      printf( "Out of memory for %s.\n", name );
+      close( fd );
+      return 1;
+    }
+  }
+  close( fd );
+  return 0;
+}
+
+static void img_unmap( char *buf, size_t size, int mapped )
+{
+  if ( mapped )
+    munmap( buf, size );
+  else
+    free( buf );
+}
+
+static inline const char *load_space( const char *p, const char *e )
+{
+  while ( p < e && ( *p == ' ' || *p == '\t' || *p == '\r' || *p == '\v' || *p == '\f' ) )
+    p++;
+  return p;
+}
+
+// Parse an integer at p, as %u does with base 10 and %i with base 0.
+// Returns the end of it, or NULL if there is none; *v stops growing
+// long before it could overflow, far out of any valid range.
+static inline const char *load_int( const char *p, const char *e, int base, long *v )
+{
+  int neg = 0, digits = 0;
+  long n = 0;
+
+  if ( p < e && ( *p == '+' || *p == '-' ) )
+    neg = *p++ == '-';
+  if ( ! base ) {
+    base = 10;
+    if ( p < e && *p == '0' ) {
+      base = 8;
+      if ( e - p > 2 && ( p[ 1 ] | 0x20 ) == 'x' && isxdigit( (unsigned char) p[ 2 ] ) ) {
+        base = 16;
+        p += 2;
+      }
+    }
+  }
+  for ( ; p < e; p++, digits++ ) {
+    int c = (unsigned char) *p, d;
+    if ( c >= '0' && c <= '9' )
+      d = c - '0';
+    else if ( ( c | 0x20 ) >= 'a' && ( c | 0x20 ) <= 'f' )
+      d = ( c | 0x20 ) - 'a' + 10;
+    else
+      break;
+    if ( d >= base )
+      break;
+    if ( n < 1L << 40 )
+      n = n * base + d;
+  }
+  if ( ! digits )
+    return NULL;
+  *v = neg ? -n : n;
+  return p;
+}
+
+static int img_load_text( i16 *m, unsigned char *set, char *name, const char *buf, size_t size )
+{
+  const char *p, *end = buf + size;
+  long line;
+
+  for ( p = buf, line = 1; p < end; line++ ) {
+    const char *eol = memchr( p, '\n', end - p );
+    const char *q;
+    long address, value;
+
+    if ( eol == NULL )
+      eol = end;
+    q = load_int( load_space( p, eol ), eol, 10, &address );
+    if ( q != NULL && ( q = load_int( load_space( q, eol ), eol, 0, &value ) ) != NULL ) {
+      if ( ! ( 0 <= address && address < 65536 ) ) {
+        printf( "%s:%ld: out of range address: %u.\n", name, line, (u32) address );
+        return 2;
+      }
+      if ( ! ( -32768 <= value && value < 65536 ) ) {
+        printf( "%s:%ld: out of range value at address: %ld, %ld.\n", name, line, address, value );
+        return 2;
+      }
+      m[ address ] = (i16) value;
+      if ( set )
+        set[ address ] = 1;
+    }
+    p = eol + 1;
+  }
+  return 0;
+}
+
+static inline u16 img_u16( const unsigned char *p )
+{
+  return p[ 0 ] | p[ 1 ] << 8;
+}
+
+static inline u32 img_u32( const unsigned char *p )
+{
+  return p[ 0 ] | p[ 1 ] << 8 | p[ 2 ] << 16 | (u32) p[ 3 ] << 24;
+}
+
+// Fletcher-32 of the n little-endian u16 at p.
+static u32 img_checksum( const unsigned char *p, size_t n )
+{
+  u32 a = 0xFFFF, b = 0xFFFF;
+
+  while ( n ) {
+    size_t k = n < 359 ? n : 359;   // the most before the sums can overflow
+    n -= k;
+    for ( ; k; k--, p += 2 ) {
+      a += img_u16( p );
+      b += a;
+    }
+    a = ( a & 0xFFFF ) + ( a >> 16 );
+    b = ( b & 0xFFFF ) + ( b >> 16 );
+  }
+  a = ( a & 0xFFFF ) + ( a >> 16 );
+  b = ( b & 0xFFFF ) + ( b >> 16 );
+  return b << 16 | a;
+}
+
+static int img_load_binary( i16 *m, unsigned char *set, u16 *entry, char *name,
+                            const unsigned char *buf, size_t size )
+{
+  const unsigned char *data;
+  u32 nseg, i, flags;
+  size_t words = 0;
+
+  if ( size < IMG_HEADER || memcmp( buf, "SMIM", 4 ) || img_u16( buf + 4 ) != IMG_VERSION ) {
+    printf( "%s is not an SM image, version %d.\n", name, IMG_VERSION );
+    return 2;
+  }
+  flags = img_u16( buf + 6 );
+  nseg = img_u32( buf + 12 );
+  if ( nseg > MEMSIZE || size < IMG_HEADER + 8 * (size_t) nseg ) {
+    printf( "%s: truncated segment table.\n", name );
+    return 2;
+  }
+  for ( i = 0; i < nseg; i++ ) {
+    u32 base = img_u32( buf + IMG_HEADER + 8 * i );
+    u32 len = img_u32( buf + IMG_HEADER + 8 * i + 4 );
+    if ( base > MEMSIZE || len > MEMSIZE - base ) {
+      printf( "%s: segment %u out of range: %u words at %u.\n", name, i, len, base );
+      return 2;
+    }
+    words += len;
+  }
+  data = buf + IMG_HEADER + 8 * (size_t) nseg;
+  if ( size != (size_t) ( data - buf ) + 2 * words ) {
+    printf( "%s: %zu bytes, but its segments take %zu.\n",
+            name, size, (size_t) ( data - buf ) + 2 * words );
+    return 2;
+  }
+  if ( ( flags & IMG_CHECKSUM ) &&
+       img_checksum( buf + IMG_HEADER, ( size - IMG_HEADER ) / 2 ) != img_u32( buf + 16 ) ) {
+    printf( "%s: checksum mismatch.\n", name );
+    return 2;
+  }
+
+  for ( i = 0; i < nseg; i++ ) {
+    u32 base = img_u32( buf + IMG_HEADER + 8 * i );
+    u32 len = img_u32( buf + IMG_HEADER + 8 * i + 4 );
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy( m + base, data, 2 * len );
+#else
+    u32 k;
+    for ( k = 0; k < len; k++ )
+      m[ base + k ] = (i16) img_u16( data + 2 * k );
+#endif
+    if ( set )
+      memset( set + base, 1, len );
+    data += 2 * len;
+  }
+  if ( ( flags & IMG_ENTRY ) && entry )
+    *entry = img_u16( buf + 8 );
+  return 0;
+}
+
+// Store the words of the image in file name into m, marking the
+// addresses it sets in set unless that is NULL, and its entry pc in
+// *entry if it has one and entry is not NULL.  Returns 0, or the
+// simulator's exit status after printing the error: 1 when the file
+// cannot be opened, 2 when it is not a valid image.
+int sm_load_image( i16 *m, char *name, unsigned char *set, u16 *entry )
+{
+  size_t size;
+  int mapped, status;
+  char *buf;
+
+  if ( ( status = img_map( name, &buf, &size, &mapped ) ) || buf == NULL )
+    return status;
+  if ( img_binary( name ) )
+    status = img_load_binary( m, set, entry, name, (const unsigned char *) buf, size );
+  else
+    status = img_load_text( m, set, name, buf, size );
+  img_unmap( buf, size, mapped );
+  return status;
+}
+
+// Write the addresses of m marked in set to file, as a binary image if
+// its name ends in .smimg, with entry pc entry unless that is -1, and
+// as text otherwise.  Returns 0, or 1 after printing the error.
+int sm_write_image( char *file, i16 *m, unsigned char *set, int entry )
+{
+  FILE *f = fopen( file, "wb" );
+  int a, ok = f != NULL;
+
+  if ( ok && img_binary( file ) ) {
+    static unsigned char buf[ IMG_HEADER + 8 * MEMSIZE + 2 * MEMSIZE ];
+    unsigned char *t = buf + IMG_HEADER, *d;
+    u32 nseg = 0, w;
+
+    for ( a = 0; a < MEMSIZE; a++ )
+      if ( set[ a ] && ( a == 0 || ! set[ a - 1 ] ) )
+        nseg++;
+    d = t + 8 * nseg;
+    memset( buf, 0, IMG_HEADER );
+    memcpy( buf, "SMIM", 4 );
+    buf[ 4 ] = IMG_VERSION;
+    buf[ 6 ] = IMG_CHECKSUM | ( entry >= 0 ? IMG_ENTRY : 0 );
+    if ( entry >= 0 ) {
+      buf[ 8 ] = entry;
+      buf[ 9 ] = entry >> 8;
+    }
+    buf[ 12 ] = nseg;
+    buf[ 13 ] = nseg >> 8;
+    buf[ 14 ] = nseg >> 16;
+    for ( a = 0; a < MEMSIZE; a++ ) {
+      if ( ! set[ a ] )
+        continue;
+      if ( a == 0 || ! set[ a - 1 ] ) {
+        u32 len;
+        for ( len = 1; a + len < MEMSIZE && set[ a + len ]; len++ )
+          ;
+        t[ 0 ] = a;
+        t[ 1 ] = a >> 8;
+        t[ 2 ] = t[ 3 ] = 0;
+        t[ 4 ] = len;
+        t[ 5 ] = len >> 8;
+        t[ 6 ] = len >> 16;
+        t[ 7 ] = 0;
+        t += 8;
+      }
+      *d++ = m[ a ];
+      *d++ = (u16) m[ a ] >> 8;
+    }
+    w = img_checksum( buf + IMG_HEADER, ( d - buf - IMG_HEADER ) / 2 );
+    buf[ 16 ] = w;
+    buf[ 17 ] = w >> 8;
+    buf[ 18 ] = w >> 16;
+    buf[ 19 ] = w >> 24;
+    ok = fwrite( buf, d - buf, 1, f ) == 1;
+  } else if ( ok ) {
+    for ( a = 0; a < MEMSIZE; a++ )
+      if ( set[ a ] )
+        fprintf( f, "%d %d\n", a, m[ a ] );
+  }
+  if ( f != NULL && fclose( f ) )
+    ok = 0;
+  if ( ! ok )
+    printf( "Cannot write the image to %s.\n", file );
+  return ! ok;
+}
@@ -0,0 +1,69 @@
+/*
+ Converter between the memory image formats of sm-image.c.
+
+  gcc -fno-asynchronous-unwind-tables -Wall -O2 -o sm-img sm-img.c
+
+  sm-img [-e <pc>] <input> <output>
+
+ Reads the image <input>, text or binary, and writes the same words to
+ <output>: a binary image if its name ends in .smimg, else text, one
+ "<address> <value>" line per word.  Only the addresses the input sets
+ are written, so a binary image has one segment per run of them.  -e
+ gives the binary image an entry pc; one the input has is kept.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef unsigned short u16;
+typedef short i16;
+typedef unsigned int u32;
+
+#define MEMSIZE    (65536)
+
+#include "sm-image.c"
+
+int main( int argc, char *argv[] )
+{
+  static i16 mem[ MEMSIZE ];
+  static unsigned char set[ MEMSIZE ];
+  int entry = -1, words = 0, segments = 0, status, a, i = 1;
+  u16 pc = 0xFFFF;            // unless the input has an entry pc
+
+  if ( argc == 5 && ! strcmp( argv[ 1 ], "-e" ) ) {
+    char *end;
+    entry = strtol( argv[ 2 ], &end, 0 );
+    if ( *end || entry < 0 || entry >= MEMSIZE ) {
+      printf( "Bad entry pc: %s.\n", argv[ 2 ] );
+      exit( 1 );
+    }
+    i = 3;
+  }
+  if ( argc - i != 2 ) {
+    printf( "Usage: sm-img [-e <pc>] <input> <output>\n" );
+    printf( "  Write the image <input> to <output>, as a binary image if\n" );
+    printf( "  its name ends in .smimg, else as text; -e sets its entry pc.\n" );
+    exit( 1 );
+  }
+
+  status = sm_load_image( mem, argv[ i ], set, &pc );
+  if ( status )
+    exit( status );
+  if ( entry < 0 && pc != 0xFFFF )
+    entry = pc;
+  if ( entry >= 0 && ! img_binary( argv[ i + 1 ] ) )
+    printf( "Text images have no entry pc; %d is dropped.\n", entry );
+  if ( sm_write_image( argv[ i + 1 ], mem, set, entry ) )
+    exit( 1 );
+
+  for ( a = 0; a < MEMSIZE; a++ )
+    if ( set[ a ] ) {
+      words++;
+      segments += a == 0 || ! set[ a - 1 ];
+    }
+  printf( "%s: %d words in %d segments", argv[ i + 1 ], words, segments );
+  if ( entry >= 0 && img_binary( argv[ i + 1 ] ) )
+    printf( ", entry pc %d", entry );
+  printf( ".\n" );
+  return 0;
+}
@@ -0,0 +1,500 @@
+// ISA-level emulator for the SM, shared by all pipeline variants.
+//
+// This file is included by each of the *-sm.c simulators after
+// sm-context.c.  Every function works on the ISA-level state (mem, reg,
+// pc) and decode cache of the context it is given.
+
+#include <time.h>
+
+// Decoded instruction cache (sm->dcache).  Every memory address has one
+// entry that holds the pre-decoded form of the instruction stored there,
+// so the shifts and masks in micro_step are done once per address
+// instead of once per executed instruction.  Entries are filled lazily
+// the first time an address is executed and reset when the program
+// writes to it.
+//
+// What that buys the step engine is bounded by the one indirect
+// dispatch and the loop test it still does per instruction: on
+// loop-heavy programs it runs 1.3 to 1.7 times as many instructions per
+// second as decoding at every step did, not twice as many.
+
+// Handler indices: sub-opcodes of fn 0 use their rnumb value, the
+// other functions use 15 + fn.
+#define DOP_NOOP00     ( 0)
+#define DOP_LDMEM      ( 1)
+#define DOP_STMEM      ( 2)
+#define DOP_CALL       ( 3)
+#define DOP_RETURN     ( 4)
+#define DOP_JUMP       ( 5)
+#define DOP_BRA        ( 6)
+#define DOP_UNASSIGN7  ( 7)
+#define DOP_UNASSIGN8  ( 8)
+#define DOP_NOT        ( 9)
+#define DOP_NEG        (10)
+#define DOP_CNOT       (11)
+#define DOP_POPCNT     (12)
+#define DOP_BITREV     (13)
+#define DOP_POP        (14)
+#define DOP_PUSH       (15)
+#define DOP_ADD        (16)
+#define DOP_SUB        (17)
+#define DOP_MUL        (18)
+#define DOP_DIV        (19)
+#define DOP_XOR        (20)
+#define DOP_AND        (21)
+#define DOP_LOR        (22)
+#define DOP_SLEFT      (23)
+#define DOP_SRIGHT     (24)
+#define DOP_LT         (25)
+#define DOP_LTEQ       (26)
+#define DOP_CMOVE      (27)
+#define DOP_CADD       (28)
+#define DOP_IMMLOW     (29)
+#define DOP_IMMHGH     (30)
+#define DOP_DECODE     (31)  // entry not decoded yet
+
+// Superinstructions, which cover the instruction at an address and the
+// one after it.  Only run_isa executes them.
+#define DOP_LI         (32)  // immlow rX, immhgh rX: load a 16-bit constant
+#define DOP_LT_JUMP    (33)  // lt rX, then jump on rX
+#define DOP_LT_BRA     (34)  // lt rX, then bra on rX
+#define DOP_LTEQ_JUMP  (35)  // lteq rX, then jump on rX
+#define DOP_LTEQ_BRA   (36)  // lteq rX, then bra on rX
+
+// Last load generation handed out; see sm_context.load_gen.
+unsigned long sm_loads;
+
+// div: rb / ra, rounded toward zero, and 0 when ra is 0.  Every engine
+// and pipeline divides with it, so none traps on the host, not even a
+// pipeline dividing by a stale or wrong-path operand.
+static inline i16 sm_div( i16 b, i16 a )
+{
+  return a ? b / a : 0;
+}
+
+// Mark every entry as not decoded and start a new load generation.
+// Must be called after the program is loaded into mem, since the
+// loader writes mem directly.
+void dcache_flush( sm_context *sm )
+{
+  unsigned int i;
+  for( i = 0; i < MEMSIZE; i++ )
+    sm->dcache[ i ].xop = sm->dcache[ i ].op = DOP_DECODE;
+  sm->load_gen = __atomic_add_fetch( &sm_loads, 1, __ATOMIC_RELAXED );
+}
+
+// Called for every ISA-level store into mem.  The entry in front of
+// addr goes too, since a superinstruction there may cover addr.
+static inline void dcache_invalidate( sm_context *sm, u16 addr )
+{
+  sm->dcache[ addr ].xop = sm->dcache[ addr ].op = DOP_DECODE;
+  addr--;
+  sm->dcache[ addr ].xop = sm->dcache[ addr ].op = DOP_DECODE;
+}
+
+decoded_inst *decode_at( sm_context *sm, u16 addr )
+{
+  u16 instruction = (u16) sm->mem[ addr ];
+  decoded_inst *d = &sm->dcache[ addr ];
+
+  u16 fn  = (u16) ((instruction >> OP_SHIFT  ) & BITS_4);
+  d->rnumc = (instruction >> REGC_SHIFT) & BITS_4;
+  d->rnumb = (instruction >> REGB_SHIFT) & BITS_4;
+  d->rnuma = (instruction >> REGA_SHIFT) & BITS_4;
+  d->data  = (instruction >> DATA_SHIFT) & BITS_8;
+  d->op    = fn ? 15 + fn : d->rnumb;
+  d->xop   = d->op;
+
+  // Look at the next instruction for a pair to fuse.  Nothing is fused
+  // across the end of memory.
+  if ( addr == MEMSIZE - 1 )
+    return d;
+
+  u16 next   = (u16) sm->mem[ addr + 1 ];
+  u16 nfn    = (next >> OP_SHIFT  ) & BITS_4;
+  u16 nrnumc = (next >> REGC_SHIFT) & BITS_4;
+  u16 nrnumb = (next >> REGB_SHIFT) & BITS_4;
+
+  if ( nrnumc != d->rnumc )
+    return d;
+
+  if ( d->op == DOP_IMMLOW && nfn == 15 ) {
+    d->xop = DOP_LI;
+    d->imm = (next & BITS_8) << 8 | d->data;
+  }
+  else if ( ( d->op == DOP_LT || d->op == DOP_LTEQ ) &&
+            nfn == 0 && ( nrnumb == 5 || nrnumb == 6 ) ) {
+    if ( d->op == DOP_LT )
+      d->xop = nrnumb == 5 ? DOP_LT_JUMP : DOP_LT_BRA;
+    else
+      d->xop = nrnumb == 5 ? DOP_LTEQ_JUMP : DOP_LTEQ_BRA;
+    d->imm = (next >> REGA_SHIFT) & BITS_4;
+  }
+  return d;
+}
+
+// Transfer control to target, after the delay slots of -S.
+static inline void isa_branch( sm_context *sm, u16 *pc, u16 target, int hooks )
+{
+  if ( ! hooks || ! sm->delay )
+    *pc = target;
+  else {
+    sm->isa_delay_pc[ sm->delay ] = target;
+    sm->isa_delay_set[ sm->delay ] = 1;
+  }
+}
+
+// Run the instruction at *pc.  hooks is a constant at each call;
+// without it the checks for -H, -r and -S are compiled out, and pc may
+// be a local of the caller's loop rather than &sm->pc.
+static inline __attribute__(( always_inline )) void isa_step( sm_context *sm, u16 *pc, int hooks )
+{
+  decoded_inst *d = &sm->dcache[ *pc ];
+  if ( d->op == DOP_DECODE )
+    d = decode_at( sm, *pc );
+  if ( hooks && sm->prof )           // -H
+    prof_isa( sm->prof, *pc, d->op );
+  *pc = (u16) *pc + 1;               // Increment program counter
+
+  u16 rnumc = d->rnumc;
+  u16 rnuma = d->rnuma;
+  u16 data  = d->data;
+  u16 addr;
+  int op    = d->op;   // a store may invalidate d itself
+
+  i16 regc  = sm->reg[ rnumc ];
+  i16 regb  = sm->reg[ d->rnumb ];
+  i16 rega  = sm->reg[ rnuma ];
+
+  // Instruction-by-instruction debugging statement
+  // printf(" %5d, %2d,  %3d,   %2d,   %2d,   %2d,  %5d,  %5d,  %5d.\n",
+  //        pc-1, d->op, data, rnumc, d->rnumb, rnuma, regc, regb, rega );
+
+  switch ( op ) {
+  case DOP_NOOP00:                                         break;  // noop00
+
+  case DOP_LDMEM:  sm->reg[ rnumc ] = sm->mem[ (u16) rega ];       break;  // ldmem
+
+  case DOP_STMEM:  sm->mem[ (u16) regc ] = rega;                       // stmem
+                   dcache_invalidate( sm, (u16) regc );        break;
+
+  case DOP_CALL:   addr = (u16) rega - 1;                          // call
+                   sm->reg[ rnuma ] = addr;
+                   sm->mem[ addr ] = *pc + ( hooks ? sm->delay : 0 );
+                   dcache_invalidate( sm, addr );
+                   isa_branch( sm, pc, (u16) regc, hooks );    break;
+
+  case DOP_RETURN: isa_branch( sm, pc, (u16) sm->mem[ (u16) rega ], hooks );  // return
+                   sm->reg[ rnuma ] = rega + 1;                break;
+
+  case DOP_JUMP:   if ( regc ) isa_branch( sm, pc, (u16) rega, hooks );        break;  // jump
+  case DOP_BRA:    if ( regc ) isa_branch( sm, pc, (u16) rega + *pc, hooks );  break;  // bra, branch
+
+  case DOP_UNASSIGN7:                                      break;  // unassigned
+  case DOP_UNASSIGN8:                                      break;  // unassigned
+
+  case DOP_NOT:    sm->reg[ rnumc ] = ~ rega;                  break;  // not
+  case DOP_NEG:    sm->reg[ rnumc ] = - rega;                  break;  // neg, negate
+  case DOP_CNOT:   sm->reg[ rnumc ] = ! rega;                  break;  // cnot
+  case DOP_POPCNT: sm->reg[ rnumc ] = pop_count( rega );       break;  // popcnt
+  case DOP_BITREV: sm->reg[ rnumc ] = bit_reverse( rega );     break;  // bitrev
+
+  case DOP_POP:    sm->reg[ rnumc ] = sm->mem[ (u16) rega ];               // pop
+                   sm->reg[ rnuma ] = rega + 1;                break;
+
+  case DOP_PUSH:   addr = (u16) rega - 1;                          // push
+                   sm->mem[ addr ] = regc;
+                   dcache_invalidate( sm, addr );
+                   sm->reg[ rnuma ] = addr;                    break;
+
+  case DOP_ADD:    sm->reg[ rnumc ] =  regb  +  rega;          break;  // add
+  case DOP_SUB:    sm->reg[ rnumc ] =  regb  -  rega;          break;  // sub
+  case DOP_MUL:    sm->reg[ rnumc ] =  regb  *  rega;          break;  // mul
+  case DOP_DIV:    sm->reg[ rnumc ] = sm_div( regb, rega );    break;  // div
+
+  case DOP_XOR:    sm->reg[ rnumc ] =  regb  ^  rega;          break;  // xor
+  case DOP_AND:    sm->reg[ rnumc ] =  regb  &  rega;          break;  // and
+  case DOP_LOR:    sm->reg[ rnumc ] =  regb  |  rega;          break;  // lor
+
+  case DOP_SLEFT:  sm->reg[ rnumc ] =  regb << (rega & 0xF);   break;  // sleft
+  case DOP_SRIGHT: sm->reg[ rnumc ] =  regb >> (rega & 0xF);   break;  // sright
+
+  case DOP_LT:     sm->reg[ rnumc ] =  regb  <  rega;          break;  // lt
+  case DOP_LTEQ:   sm->reg[ rnumc ] =  regb <=  rega;          break;  // lteq
+
+  case DOP_CMOVE:  sm->reg[ rnumc ] = (regb) ?  rega : regc;          break;  // cmove
+  case DOP_CADD:   sm->reg[ rnumc ] = (regb) ?  rega + regc : regc;   break;  // cadd
+
+  case DOP_IMMLOW: sm->reg[ rnumc ] = (regc & 0xFF00) | data;         break;  // immlow
+  case DOP_IMMHGH: sm->reg[ rnumc ] = (data << 8) | (regc & 0x00FF);  break;  // immhgh
+  default: break;
+  }
+  if ( hooks && sm->rtrace )         // -r
+    rt_isa( sm, d, op, regc, rega );
+
+  if ( hooks && sm->delay ) { // -S: one instruction nearer each pending transfer
+    if ( sm->isa_delay_set[ 0 ] )
+      *pc = sm->isa_delay_pc[ 0 ];
+    memmove( sm->isa_delay_pc, sm->isa_delay_pc + 1, 3 * sizeof( u16 ) );
+    memmove( sm->isa_delay_set, sm->isa_delay_set + 1, 3 );
+    sm->isa_delay_set[ 3 ] = 0;
+  }
+}
+
+void micro_step( sm_context *sm )
+{
+  isa_step( sm, &sm->pc, 1 );
+}
+
+// The step engine: count calls of micro_step, but with its checks for
+// -H, -r, -S and -v fetch made once for the run when none is on, and pc
+// kept in a local then.
+void step_isa( sm_context *sm, long count )
+{
+  long i;
+  u16 pc = sm->pc;
+
+  if ( sm->prof || sm->rtrace || sm->delay || ( SM_LOG_BUILT & sm_log & LOG_FETCH ) )
+    for ( i = 0; i < count; i++ ){
+      SM_LOG(LOG_FETCH, "pc = %d\n",sm->pc);
+      micro_step( sm );
+    }
+  else {
+    for ( i = 0; i < count; i++ )
+      isa_step( sm, &pc, 0 );
+    sm->pc = pc;
+  }
+}
+
+
+// Threaded-code engine.  Runs n instructions with the same semantics as
+// n calls to micro_step, but dispatches straight from one handler to the
+// next through a table of label addresses, and keeps pc and the
+// register file in locals for the whole run.
+//
+// A superinstruction needs two instructions of budget; with only one
+// left it runs the first instruction on its own.
+
+#define DISPATCH()                                              \
+  do {                                                          \
+    if ( n-- <= 0 ) goto done;                                  \
+    d = &sm->dcache[ lpc ];                                         \
+    lpc = (u16) lpc + 1;                                        \
+    goto *handler[ d->xop ];                                    \
+  } while ( 0 )
+
+void run_isa( sm_context *sm, long n )
+{
+  static void *handler[ DOP_LTEQ_BRA + 1 ] = {
+    &&noop00, &&ldmem, &&stmem, &&call, &&ret, &&jump, &&bra, &&noop00,
+    &&noop00, &&not, &&neg, &&cnot, &&popcnt, &&bitrev, &&pop, &&push,
+    &&add, &&sub, &&mul, &&div, &&xor, &&and, &&lor, &&sleft,
+    &&sright, &&lt, &&lteq, &&cmove, &&cadd, &&immlow, &&immhgh, &&decode,
+    &&li, &&lt_jump, &&lt_bra, &&lteq_jump, &&lteq_bra
+  };
+
+  i16 r[ REGS ];
+  u16 lpc = sm->pc;
+  decoded_inst *d;
+  i16 rega, regc;
+  u16 addr;
+  long fused = 0;
+
+  memcpy( r, sm->reg, sizeof( r ) );
+  DISPATCH();
+
+ decode:
+  d = decode_at( sm, (u16) (lpc - 1) );
+  goto *handler[ d->xop ];
+
+ li:      if ( ! n ) goto *handler[ d->op ];
+          r[ d->rnumc ] = d->imm;
+          lpc++; n--; fused++;                               DISPATCH();
+ lt_jump: if ( ! n ) goto *handler[ d->op ];
+          r[ d->rnumc ] = r[ d->rnumb ]  <  r[ d->rnuma ];
+          goto fused_jump;
+ lt_bra:  if ( ! n ) goto *handler[ d->op ];
+          r[ d->rnumc ] = r[ d->rnumb ]  <  r[ d->rnuma ];
+          goto fused_bra;
+ lteq_jump:
+          if ( ! n ) goto *handler[ d->op ];
+          r[ d->rnumc ] = r[ d->rnumb ] <=  r[ d->rnuma ];
+          goto fused_jump;
+ lteq_bra:
+          if ( ! n ) goto *handler[ d->op ];
+          r[ d->rnumc ] = r[ d->rnumb ] <=  r[ d->rnuma ];
+          goto fused_bra;
+ fused_jump:
+          lpc++; n--; fused++;
+          if ( r[ d->rnumc ] ) lpc = (u16) r[ d->imm ];
+          DISPATCH();
+ fused_bra:
+          lpc++; n--; fused++;
+          if ( r[ d->rnumc ] ) lpc += (u16) r[ d->imm ];
+          DISPATCH();
+
+ noop00:                                                     DISPATCH();
+ ldmem:   r[ d->rnumc ] = sm->mem[ (u16) r[ d->rnuma ] ];       DISPATCH();
+ stmem:   addr = (u16) r[ d->rnumc ];
+          sm->mem[ addr ] = r[ d->rnuma ];
+          dcache_invalidate( sm, addr );                         DISPATCH();
+ call:    rega = r[ d->rnuma ] - 1;
+          regc = r[ d->rnumc ];
+          r[ d->rnuma ] = rega;
+          sm->mem[ (u16) rega ] = lpc;
+          dcache_invalidate( sm, (u16) rega );
+          lpc = (u16) regc;                                  DISPATCH();
+ ret:     rega = r[ d->rnuma ];
+          lpc = (u16) sm->mem[ (u16) rega ];
+          r[ d->rnuma ] = rega + 1;                          DISPATCH();
+ jump:    if ( r[ d->rnumc ] ) lpc = (u16) r[ d->rnuma ];    DISPATCH();
+ bra:     if ( r[ d->rnumc ] ) lpc += (u16) r[ d->rnuma ];   DISPATCH();
+ not:     r[ d->rnumc ] = ~ r[ d->rnuma ];                   DISPATCH();
+ neg:     r[ d->rnumc ] = - r[ d->rnuma ];                   DISPATCH();
+ cnot:    r[ d->rnumc ] = ! r[ d->rnuma ];                   DISPATCH();
+ popcnt:  r[ d->rnumc ] = pop_count( r[ d->rnuma ] );        DISPATCH();
+ bitrev:  r[ d->rnumc ] = bit_reverse( r[ d->rnuma ] );      DISPATCH();
+ pop:     rega = r[ d->rnuma ];
+          r[ d->rnumc ] = sm->mem[ (u16) rega ];
+          r[ d->rnuma ] = rega + 1;                          DISPATCH();
+ push:    addr = (u16) r[ d->rnuma ] - 1;
+          sm->mem[ addr ] = r[ d->rnumc ];
+          dcache_invalidate( sm, addr );
+          r[ d->rnuma ] = addr;                              DISPATCH();
+
+ add:     r[ d->rnumc ] = r[ d->rnumb ]  +  r[ d->rnuma ];   DISPATCH();
+ sub:     r[ d->rnumc ] = r[ d->rnumb ]  -  r[ d->rnuma ];   DISPATCH();
+ mul:     r[ d->rnumc ] = r[ d->rnumb ]  *  r[ d->rnuma ];   DISPATCH();
+ div:     r[ d->rnumc ] = sm_div( r[ d->rnumb ], r[ d->rnuma ] ); DISPATCH();
+ xor:     r[ d->rnumc ] = r[ d->rnumb ]  ^  r[ d->rnuma ];   DISPATCH();
+ and:     r[ d->rnumc ] = r[ d->rnumb ]  &  r[ d->rnuma ];   DISPATCH();
+ lor:     r[ d->rnumc ] = r[ d->rnumb ]  |  r[ d->rnuma ];   DISPATCH();
+ sleft:   r[ d->rnumc ] = r[ d->rnumb ] << (r[ d->rnuma ] & 0xF);  DISPATCH();
+ sright:  r[ d->rnumc ] = r[ d->rnumb ] >> (r[ d->rnuma ] & 0xF);  DISPATCH();
+ lt:      r[ d->rnumc ] = r[ d->rnumb ]  <  r[ d->rnuma ];   DISPATCH();
+ lteq:    r[ d->rnumc ] = r[ d->rnumb ] <=  r[ d->rnuma ];   DISPATCH();
+ cmove:   if ( r[ d->rnumb ] ) r[ d->rnumc ] = r[ d->rnuma ];            DISPATCH();
+ cadd:    if ( r[ d->rnumb ] ) r[ d->rnumc ] += r[ d->rnuma ];           DISPATCH();
+ immlow:  r[ d->rnumc ] = (r[ d->rnumc ] & 0xFF00) | d->data;            DISPATCH();
+ immhgh:  r[ d->rnumc ] = (d->data << 8) | (r[ d->rnumc ] & 0x00FF);     DISPATCH();
+
+ done:
+  memcpy( sm->reg, r, sizeof( r ) );
+  sm->pc = lpc;
+  sm->isa_fused += fused;
+}
+
+#undef DISPATCH
+
+#include "sm-jit.c"
+
+// Host wall-clock time in seconds, for the engine timing report.
+double host_seconds()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Copy the ISA-level state of from into to, for -c.
+void isa_copy_state( sm_context *to, sm_context *from )
+{
+  memcpy( to->mem, from->mem, sizeof( to->mem ) );
+  memcpy( to->reg, from->reg, sizeof( to->reg ) );
+  to->pc = from->pc;
+  memcpy( to->isa_delay_pc, from->isa_delay_pc, sizeof( to->isa_delay_pc ) );
+  memcpy( to->isa_delay_set, from->isa_delay_set, sizeof( to->isa_delay_set ) );
+  dcache_flush( to );
+}
+
+// Run count instructions with micro_step in check, which holds the
+// start state, and compare with the state the engine left in sm.
+// Returns 0 on a mismatch.
+int isa_cross_check( sm_context *sm, sm_context *check, long count )
+{
+  long i;
+
+  for ( i = 0; i < count; i++ )
+    micro_step( check );
+
+  if ( check->pc != sm->pc ) {
+    SM_PRINTF( "Check FAILED:  pc is: %d, micro_step gives: %d.\n", sm->pc, check->pc );
+    return 0;
+  }
+  for ( i = 0; i < REGS; i++ )
+    if ( check->reg[ i ] != sm->reg[ i ] ) {
+      SM_PRINTF( "Check FAILED:  reg[ %ld ] is: %d, micro_step gives: %d.\n",
+                 i, sm->reg[ i ], check->reg[ i ] );
+      return 0;
+    }
+  for ( i = 0; i < MEMSIZE; i++ )
+    if ( check->mem[ i ] != sm->mem[ i ] ) {
+      SM_PRINTF( "Check FAILED:  mem[ %ld ] is: %d, micro_step gives: %d.\n",
+                 i, sm->mem[ i ], check->mem[ i ] );
+      return 0;
+    }
+  SM_PRINTF( "Check against micro_step passed.\n" );
+  return 1;
+}
+
+// Run count ISA-level instructions with the engine selected by -e.
+// Returns 0 when -c found a mismatch.
+int isa_run( sm_context *sm, long count )
+{
+  int passed = 1;
+  int engine = isa_engine;
+  sm_context *check = NULL;
+
+#ifdef SM_HAVE_JIT
+  if ( engine == ENGINE_JIT && ! jit_init() ) {
+    SM_PRINTF( "No executable memory for the JIT, using the threaded engine.\n" );
+    engine = ENGINE_THREADED;
+  }
+#else
+  if ( engine == ENGINE_JIT ) {
+    SM_PRINTF( "No JIT on this host, using the threaded engine.\n" );
+    engine = ENGINE_THREADED;
+  }
+#endif
+
+  if ( isa_check ) {
+    check = sm_new();
+    isa_copy_state( check, sm );
+  }
+
+  double start = host_seconds();
+
+  switch ( engine ) {
+  case ENGINE_THREADED:
+    run_isa( sm, count );
+    break;
+#ifdef SM_HAVE_JIT
+  case ENGINE_JIT:
+    jit_run( sm, count );
+    break;
+#endif
+  default:
+    step_isa( sm, count );
+  }
+
+  SM_PRINTF( "ISA-level engine %s: %ld instructions in %.6f s.\n",
+          engine == ENGINE_JIT ? "jit" :
+          engine == ENGINE_THREADED ? "threaded" : "step",
+          count, host_seconds() - start );
+  if ( engine == ENGINE_THREADED && count )
+    SM_PRINTF( "Fused: %ld superinstructions covering %ld instructions, %.1f%% fewer dispatches.\n",
+            sm->isa_fused, 2 * sm->isa_fused, 100.0 * sm->isa_fused / count );
+#ifdef SM_HAVE_JIT
+  if ( engine == ENGINE_JIT )
+    SM_PRINTF( "JIT: %ld blocks translated, %ld flushes, %ld instructions interpreted.\n",
+            jit_blocks, jit_flushes, jit_interpreted );
+#endif
+
+  if ( isa_check ) {
+    passed = isa_cross_check( sm, check, count );
+    sm_free( check );
+  }
+  return passed;
+}
+
+#include "sm-lanes.c"
@@ -0,0 +1,503 @@
+// Basic-block JIT for the ISA-level emulator (x86-64 hosts only).
+//
+// A block starts at any address the emulator reaches and runs up to and
+// including the first jump, bra, call or return, or up to JIT_MAX_BLOCK
+// instructions.  div, popcnt and bitrev are not translated: a block ends
+// in front of them and micro_step executes them.
+//
+// Host register assignment inside translated code:
+//
+//   rbx  reg[]      base of the SM register file
+//   rbp  dcache[]   so stores can drop stale decoded entries
+//   r12  mem[]      base of SM memory
+//   r13  jit_block  entry point of the block starting at each address
+//   r14  jit_covered  nonzero for each address inside some block
+//   r15  budget     number of instructions still to run
+//
+// The SM registers stay in reg[] and are used as memory operands; the
+// host has too few spare registers to pin all sixteen next to these
+// bases and the scratch registers that div and the shifts need.
+//
+// Every block starts by checking the budget against its length and
+// ends by looking up the next pc in jit_block; when the successor is
+// already translated it jumps there directly, otherwise it returns to
+// jit_run.  A store into an address covered by a block leaves the
+// translated code right after the store and throws all blocks away.
+//
+// Unlike the other engines the JIT is not reentrant: the code buffer
+// and block tables hold the blocks of one program at a time, and only
+// one thread may use it.  The blocks are thrown away when jit_run is
+// given a context whose load generation (sm->load_gen, new with every
+// dcache_flush) is not the one they were translated from: another
+// context, or the same one reloaded.
+
+#if defined( __x86_64__ ) && defined( __linux__ )
+#define SM_HAVE_JIT 1
+#endif
+
+#ifdef SM_HAVE_JIT
+
+#include <stdarg.h>
+#include <sys/mman.h>
+
+#define JIT_CODE_SIZE   (16 << 20)   // bytes of host code
+#define JIT_MAX_BLOCK   (64)         // SM instructions per block
+#define JIT_MAX_BYTES   (JIT_MAX_BLOCK * 64 + 128)
+#define JIT_FLUSH       (0x10000)    // returned with the pc: flush blocks
+
+// Host registers used as scratch.
+#define H_EAX  0
+#define H_ECX  1
+#define H_EDX  2
+
+// Values the prologue loads into the pinned registers.  The epilogue
+// writes the remaining budget back.
+typedef struct{
+  i16           *reg;
+  decoded_inst  *dcache;
+  i16           *mem;
+  void         **block;
+  unsigned char *covered;
+  long           budget;
+} jit_frame;
+
+unsigned char *jit_code;                 // code buffer, NULL until jit_init
+unsigned long  jit_used;                 // bytes of jit_code in use
+unsigned long  jit_base;                 // bytes taken by prologue/epilogue
+unsigned char *jit_epilogue;
+unsigned int (*jit_enter)( void *entry, jit_frame *frame );
+
+void          *jit_block[ MEMSIZE ];
+unsigned char  jit_len[ MEMSIZE ];       // instructions in each block
+unsigned char  jit_covered[ MEMSIZE ];
+
+jit_frame      jit_state;
+sm_context    *jit_owner;                // context jit_run is running
+unsigned long  jit_gen;                  // its load_gen the blocks are from
+
+// Statistics
+long jit_blocks, jit_flushes, jit_interpreted;
+
+static unsigned char *jp;                // emit cursor
+
+static void emit( int n, ... )
+{
+  va_list ap;
+  va_start( ap, n );
+  while ( n-- )
+    *jp++ = (unsigned char) va_arg( ap, int );
+  va_end( ap );
+}
+
+static void emit32( u32 v )
+{
+  memcpy( jp, &v, 4 );
+  jp += 4;
+}
+
+// rel32 operand of a jump or call that ends at jp + 4.
+static void emit_rel32( unsigned char *target )
+{
+  emit32( (u32) (target - (jp + 4)) );
+}
+
+// movsx / movzx h, word [rbx + 2 * r]
+static void ld_sx( int h, int r ) { emit( 4, 0x0F, 0xBF, 0x43 | h << 3, 2 * r ); }
+static void ld_zx( int h, int r ) { emit( 4, 0x0F, 0xB7, 0x43 | h << 3, 2 * r ); }
+
+// mov word [rbx + 2 * r], h
+static void st_reg( int h, int r ) { emit( 4, 0x66, 0x89, 0x43 | h << 3, 2 * r ); }
+
+// cmp word [rbx + 2 * r], 0
+static void test_reg( int r ) { emit( 5, 0x66, 0x83, 0x7B, 2 * r, 0x00 ); }
+
+// op dst, src for the two-operand ALU group (add, sub, and, or, xor, cmp)
+static void alu_rr( int op, int dst, int src ) { emit( 2, op, 0xC0 | src << 3 | dst ); }
+
+// movzx h, word [r12 + 2 * rax]
+static void ld_mem( int h ) { emit( 5, 0x41, 0x0F, 0xB7, 0x04 | h << 3, 0x44 ); }
+
+// mov word [r12 + 2 * rax], h
+static void st_mem( int h ) { emit( 5, 0x66, 0x41, 0x89, 0x04 | h << 3, 0x44 ); }
+
+// movzx eax, ax
+static void zx_eax() { emit( 3, 0x0F, 0xB7, 0xC0 ); }
+
+// Leave translated code with eax holding the next pc.
+static void exit_to_epilogue()
+{
+  emit( 1, 0xE9 );
+  emit_rel32( jit_epilogue );
+}
+
+// After a store to mem[ rax ]: drop the decoded entry, and if a block
+// covers the address leave with the pc in next_h (a host register) or
+// next_pc (when next_h < 0) and the flush flag set.  The budget gets
+// back the rest instructions of the block that will not run.
+static void after_store( int next_h, u16 next_pc, int rest )
+{
+  // Reset xop and op of the entries at rax and rax - 1, as
+  // dcache_invalidate does.
+  emit( 5, 0x66, 0xC7, 0x44, 0xC5, 0x00 );        // mov word [rbp + 8 * rax], ...
+  emit( 2, DOP_DECODE, DOP_DECODE );
+  emit( 3, 0x8D, 0x48, 0xFF );                    // lea ecx, [rax - 1]
+  emit( 3, 0x0F, 0xB7, 0xC9 );                    // movzx ecx, cx
+  emit( 5, 0x66, 0xC7, 0x44, 0xCD, 0x00 );        // mov word [rbp + 8 * rcx], ...
+  emit( 2, DOP_DECODE, DOP_DECODE );
+  emit( 5, 0x41, 0x80, 0x3C, 0x06, 0x00 );        // cmp byte [r14 + rax], 0
+  if ( next_h < 0 ) {
+    emit( 2, 0x74, 14 );                          // je over the exit
+    emit( 1, 0xB8 ); emit32( next_pc | JIT_FLUSH );
+  }
+  else {
+    emit( 2, 0x74, 16 );
+    emit( 2, 0x89, 0xC0 | next_h << 3 );          // mov eax, next_h
+    emit( 1, 0x0D ); emit32( JIT_FLUSH );         // or eax, JIT_FLUSH
+  }
+  emit( 4, 0x49, 0x83, 0xC7, rest );              // add r15, rest
+  exit_to_epilogue();
+}
+
+// Continue at the pc in eax: jump to its block or return to jit_run.
+static void chain()
+{
+  zx_eax();
+  emit( 5, 0x49, 0x8B, 0x4C, 0xC5, 0x00 );  // mov rcx, [r13 + 8 * rax]
+  emit( 3, 0x48, 0x85, 0xC9 );              // test rcx, rcx
+  emit( 2, 0x0F, 0x84 );                    // jz epilogue
+  emit_rel32( jit_epilogue );
+  emit( 2, 0xFF, 0xE1 );                    // jmp rcx
+}
+
+static void chain_to( u16 next_pc )
+{
+  emit( 1, 0xB8 ); emit32( next_pc );       // mov eax, next_pc
+  chain();
+}
+
+static int jit_supported( int op )
+{
+  return op != DOP_DIV && op != DOP_POPCNT && op != DOP_BITREV;
+}
+
+static int jit_ends_block( int op )
+{
+  return op == DOP_CALL || op == DOP_RETURN || op == DOP_JUMP || op == DOP_BRA;
+}
+
+void jit_flush()
+{
+  jit_used = jit_base;
+  memset( jit_block, 0, sizeof( jit_block ) );
+  memset( jit_covered, 0, sizeof( jit_covered ) );
+  jit_flushes++;
+}
+
+// Allocate the code buffer and emit the prologue and epilogue.
+// Returns 0 when the host refuses executable memory.
+int jit_init()
+{
+  if ( jit_code )
+    return 1;
+
+  void *code = mmap( NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+  if ( code == MAP_FAILED )
+    return 0;
+  jit_code = code;
+  jp = jit_code;
+
+  // unsigned jit_enter( void *entry /* rdi */, jit_frame *frame /* rsi */ )
+  jit_enter = (void *) jp;
+  emit( 1, 0x53 );                   // push rbx
+  emit( 1, 0x55 );                   // push rbp
+  emit( 2, 0x41, 0x54 );             // push r12
+  emit( 2, 0x41, 0x55 );             // push r13
+  emit( 2, 0x41, 0x56 );             // push r14
+  emit( 2, 0x41, 0x57 );             // push r15
+  emit( 1, 0x56 );                   // push rsi
+  emit( 3, 0x48, 0x8B, 0x1E );       // mov rbx, [rsi]
+  emit( 4, 0x48, 0x8B, 0x6E, 0x08 ); // mov rbp, [rsi + 8]
+  emit( 4, 0x4C, 0x8B, 0x66, 0x10 ); // mov r12, [rsi + 16]
+  emit( 4, 0x4C, 0x8B, 0x6E, 0x18 ); // mov r13, [rsi + 24]
+  emit( 4, 0x4C, 0x8B, 0x76, 0x20 ); // mov r14, [rsi + 32]
+  emit( 4, 0x4C, 0x8B, 0x7E, 0x28 ); // mov r15, [rsi + 40]
+  emit( 2, 0xFF, 0xE7 );             // jmp rdi
+
+  jit_epilogue = jp;
+  emit( 1, 0x5E );                   // pop rsi
+  emit( 4, 0x4C, 0x89, 0x7E, 0x28 ); // mov [rsi + 40], r15
+  emit( 2, 0x41, 0x5F );             // pop r15
+  emit( 2, 0x41, 0x5E );             // pop r14
+  emit( 2, 0x41, 0x5D );             // pop r13
+  emit( 2, 0x41, 0x5C );             // pop r12
+  emit( 1, 0x5D );                   // pop rbp
+  emit( 1, 0x5B );                   // pop rbx
+  emit( 1, 0xC3 );                   // ret
+
+  jit_base = jp - jit_code;
+  jit_state.block = jit_block;
+  jit_state.covered = jit_covered;
+  jit_flush();
+  jit_flushes = 0;
+  return 1;
+}
+
+// Translate one SM instruction, followed by rest more in the block.
+// Returns 1 when it ended the block.
+static int jit_inst( decoded_inst *d, u16 next_pc, int rest )
+{
+  int c = d->rnumc, b = d->rnumb, a = d->rnuma;
+
+  switch ( d->op ) {
+  case DOP_NOOP00:
+  case DOP_UNASSIGN7:
+  case DOP_UNASSIGN8:
+    break;
+
+  case DOP_LDMEM:
+    ld_zx( H_EAX, a );
+    ld_mem( H_EAX );
+    st_reg( H_EAX, c );
+    break;
+
+  case DOP_STMEM:
+    ld_zx( H_EAX, c );
+    ld_zx( H_ECX, a );
+    st_mem( H_ECX );
+    after_store( -1, next_pc, rest );
+    break;
+
+  case DOP_CALL:
+    ld_zx( H_EDX, c );                     // target, read before rA changes
+    ld_zx( H_EAX, a );
+    emit( 2, 0xFF, 0xC8 );                 // dec eax
+    zx_eax();
+    st_reg( H_EAX, a );
+    emit( 5, 0x66, 0x41, 0xC7, 0x04, 0x44 );   // mov word [r12 + 2 * rax], next_pc
+    emit( 2, next_pc & 0xFF, next_pc >> 8 );
+    after_store( H_EDX, 0, rest );
+    emit( 2, 0x89, 0xD0 );                 // mov eax, edx
+    chain();
+    return 1;
+
+  case DOP_RETURN:
+    ld_zx( H_EAX, a );
+    ld_mem( H_EDX );
+    emit( 2, 0xFF, 0xC0 );                 // inc eax
+    st_reg( H_EAX, a );
+    emit( 2, 0x89, 0xD0 );                 // mov eax, edx
+    chain();
+    return 1;
+
+  case DOP_JUMP:
+  case DOP_BRA:
+    ld_zx( H_EDX, a );
+    if ( d->op == DOP_BRA ) {
+      emit( 2, 0x81, 0xC2 ); emit32( next_pc );  // add edx, next_pc
+    }
+    test_reg( c );
+    emit( 1, 0xB8 ); emit32( next_pc );      // mov eax, next_pc
+    emit( 3, 0x0F, 0x45, 0xC2 );             // cmovne eax, edx
+    chain();
+    return 1;
+
+  case DOP_NOT:
+  case DOP_NEG:
+    ld_zx( H_EAX, a );
+    emit( 2, 0xF7, d->op == DOP_NOT ? 0xD0 : 0xD8 );
+    st_reg( H_EAX, c );
+    break;
+
+  case DOP_CNOT:
+    emit( 2, 0x31, 0xC0 );                   // xor eax, eax
+    test_reg( a );
+    emit( 3, 0x0F, 0x94, 0xC0 );             // sete al
+    st_reg( H_EAX, c );
+    break;
+
+  case DOP_POP:
+    ld_zx( H_EAX, a );
+    ld_mem( H_ECX );
+    st_reg( H_ECX, c );
+    emit( 2, 0xFF, 0xC0 );                   // inc eax
+    st_reg( H_EAX, a );
+    break;
+
+  case DOP_PUSH:
+    ld_zx( H_EAX, a );
+    emit( 2, 0xFF, 0xC8 );                   // dec eax
+    zx_eax();
+    ld_zx( H_ECX, c );
+    st_mem( H_ECX );
+    st_reg( H_EAX, a );
+    after_store( -1, next_pc, rest );
+    break;
+
+  case DOP_ADD:
+  case DOP_SUB:
+  case DOP_MUL:
+  case DOP_XOR:
+  case DOP_AND:
+  case DOP_LOR:
+    ld_sx( H_EAX, b );
+    ld_sx( H_ECX, a );
+    switch ( d->op ) {
+    case DOP_ADD: alu_rr( 0x01, H_EAX, H_ECX );    break;
+    case DOP_SUB: alu_rr( 0x29, H_EAX, H_ECX );    break;
+    case DOP_MUL: emit( 3, 0x0F, 0xAF, 0xC1 );     break;  // imul eax, ecx
+    case DOP_XOR: alu_rr( 0x31, H_EAX, H_ECX );    break;
+    case DOP_AND: alu_rr( 0x21, H_EAX, H_ECX );    break;
+    case DOP_LOR: alu_rr( 0x09, H_EAX, H_ECX );    break;
+    }
+    st_reg( H_EAX, c );
+    break;
+
+  case DOP_SLEFT:
+  case DOP_SRIGHT:
+    ld_sx( H_EAX, b );
+    ld_zx( H_ECX, a );
+    emit( 3, 0x83, 0xE1, 0x0F );             // and ecx, 0xF
+    emit( 2, 0xD3, d->op == DOP_SLEFT ? 0xE0 : 0xF8 );  // shl / sar eax, cl
+    st_reg( H_EAX, c );
+    break;
+
+  case DOP_LT:
+  case DOP_LTEQ:
+    ld_sx( H_ECX, b );
+    ld_sx( H_EDX, a );
+    emit( 2, 0x31, 0xC0 );                   // xor eax, eax
+    alu_rr( 0x39, H_ECX, H_EDX );            // cmp ecx, edx
+    emit( 3, 0x0F, d->op == DOP_LT ? 0x9C : 0x9E, 0xC0 );  // setl / setle al
+    st_reg( H_EAX, c );
+    break;
+
+  case DOP_CMOVE:
+  case DOP_CADD:
+    ld_zx( H_EAX, a );
+    ld_zx( H_EDX, c );
+    if ( d->op == DOP_CADD )
+      alu_rr( 0x01, H_EAX, H_EDX );          // add eax, edx
+    test_reg( b );
+    emit( 3, 0x0F, 0x44, 0xC2 );             // cmove eax, edx
+    st_reg( H_EAX, c );
+    break;
+
+  case DOP_IMMLOW:                           // mov byte [rbx + 2 * c], data
+    emit( 4, 0xC6, 0x43, 2 * c, d->data );
+    break;
+
+  case DOP_IMMHGH:                           // mov byte [rbx + 2 * c + 1], data
+    emit( 4, 0xC6, 0x43, 2 * c + 1, d->data );
+    break;
+  }
+  return 0;
+}
+
+// Translate the block starting at start.  Returns its entry point, or
+// NULL when the first instruction is one the JIT leaves to micro_step.
+void *jit_compile( u16 start )
+{
+  decoded_inst *d;
+  int len = 0;
+  u16 a = start;
+
+  // Find the block length first; the entry code checks the budget
+  // against it.
+  while ( len < JIT_MAX_BLOCK ) {
+    d = &jit_owner->dcache[ a ];
+    if ( d->op == DOP_DECODE )
+      d = decode_at( jit_owner, a );
+    if ( ! jit_supported( d->op ) )
+      break;
+    len++;
+    a++;
+    if ( jit_ends_block( d->op ) )
+      break;
+  }
+  if ( len == 0 )
+    return NULL;
+
+  if ( jit_used + JIT_MAX_BYTES > JIT_CODE_SIZE )
+    jit_flush();
+  jp = jit_code + jit_used;
+
+  // Out of budget: leave with the pc of this block.
+  unsigned char *no_budget = jp;
+  emit( 1, 0xB8 ); emit32( start );        // mov eax, start
+  exit_to_epilogue();
+
+  void *entry = jp;
+  emit( 4, 0x49, 0x83, 0xFF, len );        // cmp r15, len
+  emit( 2, 0x0F, 0x8C );                   // jl no_budget
+  emit_rel32( no_budget );
+  emit( 4, 0x49, 0x83, 0xEF, len );        // sub r15, len
+
+  int i, ended = 0;
+  for ( i = 0, a = start; i < len; i++, a++ ) {
+    jit_covered[ a ] = 1;
+    ended = jit_inst( &jit_owner->dcache[ a ], (u16) (a + 1), len - i - 1 );
+  }
+  if ( ! ended )
+    chain_to( a );
+
+  jit_used = jp - jit_code;
+  jit_block[ start ] = entry;
+  jit_len[ start ] = len;
+  jit_blocks++;
+  return entry;
+}
+
+// Run one instruction in micro_step and flush the blocks if it stored
+// into translated code.
+static void jit_interpret_one( sm_context *sm )
+{
+  decoded_inst *d = &sm->dcache[ sm->pc ];
+  int store = 0;
+  u16 addr = 0;
+
+  if ( d->op == DOP_DECODE )
+    d = decode_at( sm, sm->pc );
+  switch ( d->op ) {
+  case DOP_STMEM: store = 1; addr = sm->reg[ d->rnumc ];     break;
+  case DOP_CALL:
+  case DOP_PUSH:  store = 1; addr = sm->reg[ d->rnuma ] - 1; break;
+  }
+  micro_step( sm );
+  jit_interpreted++;
+  if ( store && jit_covered[ addr ] )
+    jit_flush();
+}
+
+// Run n instructions, translating blocks as they are reached.
+void jit_run( sm_context *sm, long n )
+{
+  if ( sm->load_gen != jit_gen ) {
+    if ( jit_gen )
+      jit_flush();
+    jit_gen = sm->load_gen;
+  }
+  jit_owner = sm;
+  jit_state.reg = sm->reg;
+  jit_state.dcache = sm->dcache;
+  jit_state.mem = sm->mem;
+
+  jit_state.budget = n;
+  while ( jit_state.budget > 0 ) {
+    void *entry = jit_block[ sm->pc ];
+    if ( ! entry )
+      entry = jit_compile( sm->pc );
+    if ( entry && jit_len[ sm->pc ] <= jit_state.budget ) {
+      unsigned int r = jit_enter( entry, &jit_state );
+      sm->pc = (u16) r;
+      if ( r & JIT_FLUSH )
+        jit_flush();
+    }
+    else {
+      jit_interpret_one( sm );
+      jit_state.budget--;
+    }
+  }
+}
+
+#endif // SM_HAVE_JIT
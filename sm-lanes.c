@@ -0,0 +1,391 @@
+// Lockstep execution of one SM program over many memory images.
+//
+// "-l <list>" names a file with one memory image per line.  Every lane
+// starts from the program file given on the command line, overlaid with
+// its own image, and runs <n> ISA-level instructions.
+//
+// Lane state is kept as structure-of-arrays: lane_reg[ r ][ l ] is
+// register r of lane l, so one SM instruction executed by many lanes is
+// a vector operation over a row.  Each step runs the lanes that sit at
+// the lowest pc (and hold the same instruction word there) together,
+// so lanes that left a loop early wait further on for the others, and
+// a group runs on without a rescan until it reaches a waiting lane.
+// Register-only instructions run as vector code on 16-bit lanes;
+// loads, stores and control transfers run lane by lane, and so does a
+// group too small to be worth the full vector width.
+//
+// The vectors are as wide as the build allows, and GCC does not widen
+// them at run time: 512 bits when built with -mavx512bw, 256 with
+// -mavx2 (or a -march= that has either), else 128, which is SSE2 on
+// x86-64.  The plain build line of the simulators gets 128; add, say,
+//
+//   gcc -fno-asynchronous-unwind-tables -Wall -O2 -pthread -mavx2 ...
+//
+// for AVX2.  The statistics printed after a run give the width used.
+//
+// Memory is kept lane after lane, MEMSIZE words each, so 4096 lanes take
+// 512 MiB.
+
+#if defined( __AVX512BW__ )
+#define LANE_BYTES (64)
+#define LANE_ISA   "AVX-512"
+#elif defined( __AVX2__ )
+#define LANE_BYTES (32)
+#define LANE_ISA   "AVX2"
+#else
+#define LANE_BYTES (16)
+#define LANE_ISA   "128-bit"
+#endif
+#define LANE_VL    (LANE_BYTES / 2)   // lanes per vector
+
+typedef i16 lane_vec __attribute__(( vector_size( LANE_BYTES ) ));
+
+int   lanes_n;                  // lanes in use
+int   lanes_pad;                // lanes_n rounded up to LANE_VL
+i16  *lane_mem;                 // lanes_n images, MEMSIZE words each
+i16  *lane_reg[ REGS ];         // lane_reg[ r ][ l ]
+u16  *lane_pc;
+long *lane_left;                // instructions lane l still has to run
+i16  *lane_act;                 // -1 for lanes in the current group, else 0
+int  *lane_group;               // the lanes in the current group
+
+// Nonzero while an address holds the same word in every lane and no
+// lane has stored to it.  A group only keeps running past an address
+// without a rescan when it is.
+unsigned char lane_code_shared[ MEMSIZE ];
+
+// Statistics
+long lanes_steps;               // groups run
+long lanes_vector_steps;        // groups run as vector code
+long lanes_slots;               // sum of group sizes
+
+static void *lanes_alloc( size_t bytes )
+{
+  void *p = aligned_alloc( LANE_BYTES, ( bytes + LANE_BYTES - 1 ) / LANE_BYTES * LANE_BYTES );
+  if ( p == NULL ) {
+    printf( "Out of memory for %d lanes.\n", lanes_n );
+    exit( 1 );
+  }
+  memset( p, 0, bytes );
+  return p;
+}
+
+// Overlay the image in file name onto the image m, and set *pc to its
+// entry pc if it has one.
+static void lanes_load( i16 *m, char *name, u16 *pc )
+{
+  int status = sm_load_image( m, name, NULL, pc );
+
+  if ( status )
+    exit( status );
+}
+
+// Run one instruction in lane l.  Control transfers set the lane's pc;
+// for everything else the caller advances it.
+static void lane_exec( int l, u16 ipc, int op, int c, int b, int a, int data )
+{
+  i16 *m   = lane_mem + (size_t) l * MEMSIZE;
+  i16 regc = lane_reg[ c ][ l ];
+  i16 regb = lane_reg[ b ][ l ];
+  i16 rega = lane_reg[ a ][ l ];
+  u16 npc  = ipc + 1;
+  u16 addr;
+
+  switch ( op ) {
+  case DOP_LDMEM:  lane_reg[ c ][ l ] = m[ (u16) rega ];           break;
+  case DOP_STMEM:  m[ (u16) regc ] = rega;
+                   lane_code_shared[ (u16) regc ] = 0;             break;
+  case DOP_CALL:   rega = rega - 1;
+                   lane_reg[ a ][ l ] = rega;
+                   m[ (u16) rega ] = npc;
+                   lane_code_shared[ (u16) rega ] = 0;
+                   lane_pc[ l ] = (u16) regc;                      break;
+  case DOP_RETURN: lane_pc[ l ] = (u16) m[ (u16) rega ];
+                   lane_reg[ a ][ l ] = rega + 1;                  break;
+  case DOP_JUMP:   lane_pc[ l ] = regc ? (u16) rega : npc;         break;
+  case DOP_BRA:    lane_pc[ l ] = regc ? (u16) rega + npc : npc;   break;
+  case DOP_NOT:    lane_reg[ c ][ l ] = ~ rega;                    break;
+  case DOP_NEG:    lane_reg[ c ][ l ] = - rega;                    break;
+  case DOP_CNOT:   lane_reg[ c ][ l ] = ! rega;                    break;
+  case DOP_POPCNT: lane_reg[ c ][ l ] = pop_count( rega );         break;
+  case DOP_BITREV: lane_reg[ c ][ l ] = bit_reverse( rega );       break;
+  case DOP_POP:    lane_reg[ c ][ l ] = m[ (u16) rega ];
+                   lane_reg[ a ][ l ] = rega + 1;                  break;
+  case DOP_PUSH:   addr = (u16) rega - 1;
+                   m[ addr ] = regc;
+                   lane_code_shared[ addr ] = 0;
+                   lane_reg[ a ][ l ] = addr;                      break;
+  case DOP_ADD:    lane_reg[ c ][ l ] = regb  +  rega;             break;
+  case DOP_SUB:    lane_reg[ c ][ l ] = regb  -  rega;             break;
+  case DOP_MUL:    lane_reg[ c ][ l ] = regb  *  rega;             break;
+  case DOP_DIV:    lane_reg[ c ][ l ] = sm_div( regb, rega );     break;
+  case DOP_XOR:    lane_reg[ c ][ l ] = regb  ^  rega;             break;
+  case DOP_AND:    lane_reg[ c ][ l ] = regb  &  rega;             break;
+  case DOP_LOR:    lane_reg[ c ][ l ] = regb  |  rega;             break;
+  case DOP_SLEFT:  lane_reg[ c ][ l ] = regb << (rega & 0xF);      break;
+  case DOP_SRIGHT: lane_reg[ c ][ l ] = regb >> (rega & 0xF);      break;
+  case DOP_LT:     lane_reg[ c ][ l ] = regb  <  rega;             break;
+  case DOP_LTEQ:   lane_reg[ c ][ l ] = regb <=  rega;             break;
+  case DOP_CMOVE:  lane_reg[ c ][ l ] = regb ? rega : regc;        break;
+  case DOP_CADD:   lane_reg[ c ][ l ] = regb ? rega + regc : regc; break;
+  case DOP_IMMLOW: lane_reg[ c ][ l ] = (regc & 0xFF00) | data;    break;
+  case DOP_IMMHGH: lane_reg[ c ][ l ] = (data << 8) | (regc & 0x00FF); break;
+  default: break;
+  }
+}
+
+static int lane_is_control( int op )
+{
+  return op == DOP_CALL || op == DOP_RETURN || op == DOP_JUMP || op == DOP_BRA;
+}
+
+// Register-only instructions that have a vector form.
+static int lane_is_vector( int op )
+{
+  return op >= DOP_ADD ? op != DOP_DIV
+                       : op == DOP_NOT || op == DOP_NEG || op == DOP_CNOT;
+}
+
+// Apply expr to every vector of lanes and keep the result in lanes of
+// the group only.
+#define LANE_LOOP( expr )                                             \
+  for ( k = 0; k < lanes_pad; k += LANE_VL ) {                        \
+    lane_vec m  = *(lane_vec *) &lane_act[ k ];                       \
+    lane_vec va = *(lane_vec *) &lane_reg[ a ][ k ];                  \
+    lane_vec vb = *(lane_vec *) &lane_reg[ b ][ k ];                  \
+    lane_vec vc = *(lane_vec *) &lane_reg[ c ][ k ];                  \
+    lane_vec vr;                                                      \
+    (void) va; (void) vb;                                             \
+    vr = ( expr );                                                    \
+    *(lane_vec *) &lane_reg[ c ][ k ] = ( vr & m ) | ( vc & ~m );     \
+  }
+
+static void lanes_vector( int op, int c, int b, int a, i16 data )
+{
+  int k;
+
+  switch ( op ) {
+  case DOP_NOT:    LANE_LOOP( ~ va );                              break;
+  case DOP_NEG:    LANE_LOOP( - va );                              break;
+  case DOP_CNOT:   LANE_LOOP( ( va == 0 ) & 1 );                   break;
+  case DOP_ADD:    LANE_LOOP( vb + va );                           break;
+  case DOP_SUB:    LANE_LOOP( vb - va );                           break;
+  case DOP_MUL:    LANE_LOOP( vb * va );                           break;
+  case DOP_XOR:    LANE_LOOP( vb ^ va );                           break;
+  case DOP_AND:    LANE_LOOP( vb & va );                           break;
+  case DOP_LOR:    LANE_LOOP( vb | va );                           break;
+  case DOP_SLEFT:  LANE_LOOP( vb << ( va & 0xF ) );                break;
+  case DOP_SRIGHT: LANE_LOOP( vb >> ( va & 0xF ) );                break;
+  case DOP_LT:     LANE_LOOP( ( vb <  va ) & 1 );                  break;
+  case DOP_LTEQ:   LANE_LOOP( ( vb <= va ) & 1 );                  break;
+  case DOP_CMOVE:  LANE_LOOP( ( va & ( vb != 0 ) ) | ( vc & ( vb == 0 ) ) ); break;
+  case DOP_CADD:   LANE_LOOP( vc + ( va & ( vb != 0 ) ) );         break;
+  case DOP_IMMLOW: LANE_LOOP( ( vc & (i16) 0xFF00 ) | data );      break;
+  case DOP_IMMHGH: LANE_LOOP( (i16) ( data << 8 ) | ( vc & 0x00FF ) ); break;
+  default: break;
+  }
+}
+
+#undef LANE_LOOP
+
+// Run the instruction word at ipc in every lane of the group.
+static void lanes_exec_group( u16 ipc, u16 word, int size )
+{
+  int fn = (word >> OP_SHIFT  ) & BITS_4;
+  int c  = (word >> REGC_SHIFT) & BITS_4;
+  int b  = (word >> REGB_SHIFT) & BITS_4;
+  int a  = (word >> REGA_SHIFT) & BITS_4;
+  int op = fn ? 15 + fn : b;
+  int i;
+
+  lanes_steps++;
+  lanes_slots += size;
+
+  if ( lane_is_vector( op ) && size > lanes_pad / LANE_VL ) {
+    lanes_vector( op, c, b, a, word & BITS_8 );
+    lanes_vector_steps++;
+    return;
+  }
+  for ( i = 0; i < size; i++ )
+    lane_exec( lane_group[ i ], ipc, op, c, b, a, word & BITS_8 );
+}
+
+// Run count instructions in each lane.
+static void lanes_step_all( long count )
+{
+  int l;
+  long unfinished = count ? lanes_n : 0;
+
+  for ( l = 0; l < lanes_n; l++ )
+    lane_left[ l ] = count;
+
+  while ( unfinished ) {
+    // The group is the lanes at the lowest pc that hold the same word
+    // there.  Lanes at the same pc with different code wait a round.
+    int leader = -1;
+    for ( l = 0; l < lanes_n; l++ )
+      if ( lane_left[ l ] && ( leader < 0 || lane_pc[ l ] < lane_pc[ leader ] ) )
+        leader = l;
+
+    u16  upc    = lane_pc[ leader ];
+    u16  word   = lane_mem[ (size_t) leader * MEMSIZE + upc ];
+    int  shared = lane_code_shared[ upc ];
+    long min_left = lane_left[ leader ];
+    u32  next_pc  = MEMSIZE;     // lowest pc of a waiting lane above upc
+    int  size = 0;
+
+    for ( l = 0; l < lanes_n; l++ ) {
+      int take = 0;
+      if ( lane_left[ l ] ) {
+        if ( lane_pc[ l ] == upc &&
+             ( shared || (u16) lane_mem[ (size_t) l * MEMSIZE + upc ] == word ) ) {
+          take = 1;
+          lane_group[ size++ ] = l;
+          if ( lane_left[ l ] < min_left )
+            min_left = lane_left[ l ];
+        }
+        else if ( lane_pc[ l ] > upc && lane_pc[ l ] < next_pc )
+          next_pc = lane_pc[ l ];
+      }
+      lane_act[ l ] = take ? -1 : 0;
+    }
+
+    // Keep running the group without a rescan until a control transfer,
+    // code some lane has changed, the first of its lanes running out of
+    // instructions, or the pc of a waiting lane, which then joins.
+    long steps = 0;
+    int control;
+    for ( ;; ) {
+      int fn = (word >> OP_SHIFT) & BITS_4;
+      control = ! fn && lane_is_control( (word >> REGB_SHIFT) & BITS_4 );
+      lanes_exec_group( upc, word, size );
+      steps++;
+      upc++;
+      if ( control || steps == min_left || upc >= next_pc ||
+           ! lane_code_shared[ upc ] )
+        break;
+      word = lane_mem[ upc ];
+    }
+
+    int i;
+    for ( i = 0; i < size; i++ ) {
+      l = lane_group[ i ];
+      lane_left[ l ] -= steps;
+      if ( ! lane_left[ l ] )
+        unfinished--;
+      if ( ! control )
+        lane_pc[ l ] = upc;
+    }
+  }
+}
+
+// Rerun every lane with micro_step, starting from the program in sm,
+// and compare.  Exits on a mismatch.
+static void lanes_check( sm_context *sm, long count, char **names )
+{
+  int l;
+  long i;
+  sm_context *check = sm_new();
+  i16 *mem = check->mem;
+  i16 *reg = check->reg;
+
+  for ( l = 0; l < lanes_n; l++ ) {
+    i16 *m = lane_mem + (size_t) l * MEMSIZE;
+    u16 pc;
+
+    isa_copy_state( check, sm );
+    lanes_load( mem, names[ l ], &check->pc );
+    dcache_flush( check );
+    for ( i = 0; i < count; i++ )
+      micro_step( check );
+    pc = check->pc;
+
+    if ( pc != lane_pc[ l ] ) {
+      printf( "Check FAILED:  lane %d pc is: %d, micro_step gives: %d.\n", l, lane_pc[ l ], pc );
+      exit( 3 );
+    }
+    for ( i = 0; i < REGS; i++ )
+      if ( reg[ i ] != lane_reg[ i ][ l ] ) {
+        printf( "Check FAILED:  lane %d reg[ %ld ] is: %d, micro_step gives: %d.\n",
+                l, i, lane_reg[ i ][ l ], reg[ i ] );
+        exit( 3 );
+      }
+    for ( i = 0; i < MEMSIZE; i++ )
+      if ( mem[ i ] != m[ i ] ) {
+        printf( "Check FAILED:  lane %d mem[ %ld ] is: %d, micro_step gives: %d.\n",
+                l, i, m[ i ], mem[ i ] );
+        exit( 3 );
+      }
+  }
+  printf( "Check against micro_step passed for %d lanes.\n", lanes_n );
+  sm_free( check );
+}
+
+// -l: run count instructions of the program loaded in sm in one lane
+// per image named in list, and print each lane's final pc and registers.
+void lanes_run( sm_context *sm, long count, char *list )
+{
+  char buf[ MAX_LINE_LEN ];
+  char **names = NULL;
+  int l, r, a;
+  FILE *file = fopen( list, "r" );
+
+  if ( file == NULL ) {
+    printf( "%s not found.\n", list );
+    exit( 1 );
+  }
+  while ( fgets( buf, sizeof( buf ), file ) != NULL ) {
+    char *name = strtok( buf, " \t\r\n" );
+    if ( name == NULL )
+      continue;
+    names = realloc( names, ( lanes_n + 1 ) * sizeof( *names ) );
+    names[ lanes_n++ ] = strdup( name );
+  }
+  fclose( file );
+  if ( ! lanes_n ) {
+    printf( "%s names no memory images.\n", list );
+    exit( 1 );
+  }
+  lanes_pad = ( lanes_n + LANE_VL - 1 ) / LANE_VL * LANE_VL;
+
+  lane_mem  = lanes_alloc( (size_t) lanes_n * MEMSIZE * sizeof( i16 ) );
+  lane_pc   = lanes_alloc( lanes_pad * sizeof( u16 ) );
+  lane_left = lanes_alloc( lanes_pad * sizeof( long ) );
+  lane_act  = lanes_alloc( lanes_pad * sizeof( i16 ) );
+  lane_group = lanes_alloc( lanes_pad * sizeof( int ) );
+  for ( r = 0; r < REGS; r++ )
+    lane_reg[ r ] = lanes_alloc( lanes_pad * sizeof( i16 ) );
+
+  for ( l = 0; l < lanes_n; l++ ) {
+    memcpy( lane_mem + (size_t) l * MEMSIZE, sm->mem, sizeof( sm->mem ) );
+    lane_pc[ l ] = sm->pc;
+    lanes_load( lane_mem + (size_t) l * MEMSIZE, names[ l ], &lane_pc[ l ] );
+    for ( r = 0; r < REGS; r++ )
+      lane_reg[ r ][ l ] = sm->reg[ r ];
+  }
+  for ( a = 0; a < MEMSIZE; a++ ) {
+    lane_code_shared[ a ] = 1;
+    for ( l = 1; l < lanes_n && lane_code_shared[ a ]; l++ )
+      if ( lane_mem[ (size_t) l * MEMSIZE + a ] != lane_mem[ a ] )
+        lane_code_shared[ a ] = 0;
+  }
+
+  double start = host_seconds();
+  lanes_step_all( count );
+  double seconds = host_seconds() - start;
+
+  for ( l = 0; l < lanes_n; l++ ) {
+    printf( "lane %d: pc = %d, reg =", l, lane_pc[ l ] );
+    for ( r = 0; r < REGS; r++ )
+      printf( " %d", lane_reg[ r ][ l ] );
+    printf( "\n" );
+  }
+  printf( "Lanes: %d lanes x %ld instructions in %.6f s.\n", lanes_n, count, seconds );
+  if ( lanes_steps )
+    printf( "Lanes: %ld groups, %ld as %s vector code, %.1f%% lane utilisation.\n",
+            lanes_steps, lanes_vector_steps, LANE_ISA,
+            100.0 * lanes_slots / ( (double) lanes_steps * lanes_n ) );
+
+  if ( isa_check )
+    lanes_check( sm, count, names );
+}
@@ -0,0 +1,20 @@
+// Names of the SM opcodes.  Opcodes are numbered like the DOP_*
+// handlers of sm-isa.c: the sub-op rnumb of fn 0, 15 + fn for the
+// others, 7 and 8 being the unassigned sub-ops.
+//
+// This file is included by sm-prof.c, and by sm-asm.c and sm-analyze.c,
+// which need the mnemonics and nothing else of a simulator.
+
+#define PROF_OPS   31
+
+const char *prof_op_name[ PROF_OPS ] = {
+  "noop",   "ldmem",  "stmem",  "call",   "return", "jump",   "bra",    "unas7",
+  "unas8",  "not",    "neg",    "cnot",   "popcnt", "bitrev", "pop",    "push",
+  "add",    "sub",    "mul",    "div",    "xor",    "and",    "lor",    "sleft",
+  "sright", "lt",     "lteq",   "cmove",  "cadd",   "immlow", "immhgh"
+};
+
+static inline int prof_op( u4 fn, u4 rnumb )
+{
+  return fn ? 15 + fn : rnumb;
+}
@@ -0,0 +1,308 @@
+// Command-line options shared by the SM simulators.
+//
+// Options come before the three positional arguments:
+//
+//   sm [options] <n> <p> <filename>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// ISA-level engines
+#define ENGINE_STEP     0   // step_isa, micro_step one instruction at a time
+#define ENGINE_THREADED 1   // run_isa, threaded-code dispatch
+#define ENGINE_JIT      2   // jit_run, basic blocks translated to host code
+
+// Branch predictors of jump-opt's front end; see sm-bpred.c.
+#define BP_NONE    0   // none: fetch pauses on every control instruction
+#define BP_STATIC  1   // every jump and bra not taken
+#define BP_BIMODAL 2   // 2-bit counters indexed by pc
+#define BP_GSHARE  3   // 2-bit counters indexed by pc xor global history
+#define BP_FLUSH   4   // every control instruction not taken
+
+int isa_engine = ENGINE_STEP;
+int isa_check = 0;          // rerun with micro_step and compare
+char *lanes_file = NULL;    // -l: list of memory images, one lane each
+char *batch_file = NULL;    // -b: manifest of batch jobs
+int batch_threads = 0;      // -j: batch worker threads, 0 for one per core
+int pipe_forward = 0;       // -f: forwarding instead of stalls on hazards
+int bp_kind = BP_NONE;      // -p: branch predictor
+int bp_index_bits = 10;     // -p: log2 of its counters
+int bp_hist_bits = 8;       // -p: gshare history length
+int btb_entries = 0;        // -B: branch target buffer entries, 0 for none
+int btb_ways = 4;           // -B: and their associativity
+int ras_depth = 0;          // -R: return address stack entries, 0 for none
+int early_resolve = 0;      // -D: resolve jump and bra in decode
+int delay_slots = -1;       // -S: delay slots of control instructions, -1 for none
+char *perf_file = NULL;     // -P: file for the performance counters
+char *prof_file = NULL;     // -H: file for the folded profile
+char *trace_file = NULL;    // -T: file for the pipeline trace
+char *rtrace_file = NULL;   // -r: file for the retirement trace
+char *rcheck_file = NULL;   // -k: retirement trace to check write-back against
+char *cycles_file = NULL;   // -C: file for the per-cycle pipeline records
+
+// Per-run and per-cycle output of a simulation goes through SM_PRINTF,
+// so batch jobs, which report one line each, can turn it off.
+int sm_verbose = 1;
+
+#define SM_PRINTF( ... ) \
+  do { if ( sm_verbose ) printf( __VA_ARGS__ ); } while ( 0 )
+
+// Debug output of the pipelines goes through SM_LOG, by category:
+//
+//   fetch     what fetch and micro_step are on, every cycle
+//   hazard    stalls: the stage determine_stage finds, blocking and
+//             unblocking decode, the pause counter
+//   control   jump-opt: fetch pausing on control instructions, and
+//             write-back or -D sending it elsewhere
+//   state     the pipe registers and pipe_reg, every cycle
+//
+// SM_LOG_LEVEL picks the categories compiled in: 0 none, 1 hazard and
+// control, 2 all of them (the default); build with -DSM_LOG_LEVEL=0 for
+// timing runs.  -v picks the ones printed of those, all by default, so
+// a category that is compiled in costs one test of sm_log when off.
+#define LOG_FETCH    1
+#define LOG_HAZARD   2
+#define LOG_CONTROL  4
+#define LOG_STATE    8
+#define LOG_ALL      15
+
+#ifndef SM_LOG_LEVEL
+#define SM_LOG_LEVEL 2
+#endif
+
+#if SM_LOG_LEVEL >= 2
+#define SM_LOG_BUILT LOG_ALL
+#elif SM_LOG_LEVEL == 1
+#define SM_LOG_BUILT ( LOG_HAZARD | LOG_CONTROL )
+#else
+#define SM_LOG_BUILT 0
+#endif
+
+int sm_log = LOG_ALL;       // -v: categories printed
+
+#define SM_LOG( cat, ... ) \
+  do { if ( ( SM_LOG_BUILT & ( cat ) ) && ( sm_log & ( cat ) ) ) SM_PRINTF( __VA_ARGS__ ); } while ( 0 )
+
+void print_options()
+{
+  printf( "Options:\n" );
+  printf( "  -e <engine>   ISA-level engine: step (default), threaded or jit.\n" );
+  printf( "  -c            Check the engine against micro_step.\n" );
+  printf( "  -f            Forward results to decode instead of stalling on\n" );
+  printf( "                hazards (alu-opt, mem-alu-opt and jump-opt).\n" );
+  printf( "  -p <pred>     Fetch past jumps on a branch predictor (jump-opt):\n" );
+  printf( "                static, bimodal[:<bits>] or gshare[:<bits>[:<history>]],\n" );
+  printf( "                with 2^<bits> counters (default 10) and <history>\n" );
+  printf( "                outcomes of history (default 8, at most <bits>).\n" );
+  printf( "                flush fetches straight on past every control\n" );
+  printf( "                instruction and squashes the wrong path.\n" );
+  printf( "  -B <n>[:<w>]  Give -p a <w>-way (default 4) branch target buffer\n" );
+  printf( "                of <n> entries, a power of two up to 4096.\n" );
+  printf( "  -R <depth>    Give -p a return address stack of 1 to 64 entries.\n" );
+  printf( "  -D            Resolve jump and bra in decode instead of write-back\n" );
+  printf( "                (jump-opt, with -f).\n" );
+  printf( "  -S <n>        Give jump, bra, call and return <n> delay slots, 0 to 3:\n" );
+  printf( "                the <n> instructions after one run before it takes\n" );
+  printf( "                effect (jump-opt, with -f and the step engine).\n" );
+  printf( "  -P <file>     Write the performance counters to <file> at exit,\n" );
+  printf( "                as CSV if its name ends in .csv, else as JSON.\n" );
+  printf( "  -H <file>     Profile the hottest addresses and the opcode mix, and\n" );
+  printf( "                write folded stacks for flame graphs to <file>.\n" );
+  printf( "  -T <file>     Trace every instruction through the pipeline stages\n" );
+  printf( "                to <file>, in the Kanata format of the Konata viewer.\n" );
+  printf( "  -r <file>     Write a binary record of every instruction executed\n" );
+  printf( "                and retired to <file> (the step engine only),\n" );
+  printf( "                packed and indexed if its name ends in .smz.\n" );
+  printf( "  -k <file>     Check every instruction the pipeline retires against\n" );
+  printf( "                the ISA-level records of the -r trace <file>.\n" );
+  printf( "  -C <file>     Write a binary record of the pipeline in every cycle\n" );
+  printf( "                to <file>, for the sm-analyze tool.\n" );
+  printf( "  -v <list>     Print the debug output of the categories in <list>,\n" );
+  printf( "                comma-separated: fetch, hazard, control, state, all\n" );
+  printf( "                (default) or none.\n" );
+  printf( "  -l <list>     Run the program in lockstep lanes, one per memory\n" );
+  printf( "                image named in <list>, and skip the pipeline.\n" );
+  printf( "  -b <manifest> Run the jobs listed in <manifest> instead, one line\n" );
+  printf( "                \"<filename> <n> <p> [<variant> [<state>]]\" per job,\n" );
+  printf( "                <state> the expected checksum, as in workloads/.\n" );
+  printf( "  -j <threads>  Worker threads for -b (default: one per core).\n" );
+  printf( "\n" );
+}
+
+// Parse the leading options.  Returns the index of the first positional
+// argument; exits on an unknown option.
+int parse_options( int argc, char *argv[] )
+{
+  int i = 1;
+
+  while ( i < argc && argv[ i ][ 0 ] == '-' && argv[ i ][ 1 ] != '\0' ) {
+    char *opt = argv[ i ];
+
+    if ( ! strcmp( opt, "--" ) )
+      return i + 1;
+
+    if ( ! strcmp( opt, "-c" ) ) {
+      isa_check = 1;
+      i++;
+      continue;
+    }
+
+    if ( ! strcmp( opt, "-f" ) ) {
+      pipe_forward = 1;
+      i++;
+      continue;
+    }
+
+    if ( ! strcmp( opt, "-D" ) ) {
+      early_resolve = 1;
+      i++;
+      continue;
+    }
+
+    if ( i + 1 >= argc ) {
+      printf( "Option %s needs a value.\n", opt );
+      exit( 1 );
+    }
+
+    if ( ! strcmp( opt, "-e" ) ) {
+      char *val = argv[ i + 1 ];
+      if ( ! strcmp( val, "step" ) )
+        isa_engine = ENGINE_STEP;
+      else if ( ! strcmp( val, "threaded" ) )
+        isa_engine = ENGINE_THREADED;
+      else if ( ! strcmp( val, "jit" ) )
+        isa_engine = ENGINE_JIT;
+      else {
+        printf( "Unknown ISA-level engine: %s.\n", val );
+        exit( 1 );
+      }
+    }
+    else if ( ! strcmp( opt, "-p" ) ) {
+      char *val = argv[ i + 1 ];
+      int n = strcspn( val, ":" ), sizes = 0;
+      if ( n == 6 && ! strncmp( val, "static", n ) )
+        bp_kind = BP_STATIC;
+      else if ( n == 7 && ! strncmp( val, "bimodal", n ) )
+        bp_kind = BP_BIMODAL;
+      else if ( n == 6 && ! strncmp( val, "gshare", n ) )
+        bp_kind = BP_GSHARE;
+      else if ( n == 5 && ! strncmp( val, "flush", n ) )
+        bp_kind = BP_FLUSH;
+      else {
+        printf( "Unknown branch predictor: %s.\n", val );
+        exit( 1 );
+      }
+      if ( val[ n ] == ':' )
+        sizes = sscanf( val + n + 1, "%d:%d", &bp_index_bits, &bp_hist_bits );
+      if ( sizes == 1 && bp_hist_bits > bp_index_bits )
+        bp_hist_bits = bp_index_bits;
+      if ( ( val[ n ] == ':' && sizes < 1 ) ||
+           bp_index_bits < 1 || bp_index_bits > 16 ||
+           bp_hist_bits < 0 || bp_hist_bits > bp_index_bits ) {
+        printf( "Bad branch predictor size: %s.\n", val );
+        exit( 1 );
+      }
+    }
+    else if ( ! strcmp( opt, "-B" ) ) {
+      int sizes = sscanf( argv[ i + 1 ], "%d:%d", &btb_entries, &btb_ways );
+      if ( sizes == 1 && btb_ways > btb_entries )
+        btb_ways = btb_entries;
+      if ( sizes < 1 || btb_entries < 1 || btb_entries > 4096 ||
+           ( btb_entries & ( btb_entries - 1 ) ) ||
+           btb_ways < 1 || btb_entries % btb_ways ||
+           ( ( btb_entries / btb_ways ) & ( btb_entries / btb_ways - 1 ) ) ) {
+        printf( "Bad branch target buffer size: %s.\n", argv[ i + 1 ] );
+        exit( 1 );
+      }
+    }
+    else if ( ! strcmp( opt, "-R" ) ) {
+      ras_depth = atoi( argv[ i + 1 ] );
+      if ( ras_depth < 1 || ras_depth > 64 ) {
+        printf( "Bad return address stack depth: %s.\n", argv[ i + 1 ] );
+        exit( 1 );
+      }
+    }
+    else if ( ! strcmp( opt, "-S" ) ) {
+      char *end;
+      delay_slots = strtol( argv[ i + 1 ], &end, 10 );
+      if ( *end || delay_slots < 0 || delay_slots > 3 ) {
+        printf( "Bad number of delay slots: %s.\n", argv[ i + 1 ] );
+        exit( 1 );
+      }
+    }
+    else if ( ! strcmp( opt, "-P" ) )
+      perf_file = argv[ i + 1 ];
+    else if ( ! strcmp( opt, "-H" ) )
+      prof_file = argv[ i + 1 ];
+    else if ( ! strcmp( opt, "-T" ) )
+      trace_file = argv[ i + 1 ];
+    else if ( ! strcmp( opt, "-r" ) )
+      rtrace_file = argv[ i + 1 ];
+    else if ( ! strcmp( opt, "-k" ) )
+      rcheck_file = argv[ i + 1 ];
+    else if ( ! strcmp( opt, "-C" ) )
+      cycles_file = argv[ i + 1 ];
+    else if ( ! strcmp( opt, "-v" ) ) {
+      char *val = argv[ i + 1 ];
+      sm_log = 0;
+      while ( *val ) {
+        int n = strcspn( val, "," );
+        if ( n == 5 && ! strncmp( val, "fetch", n ) )
+          sm_log |= LOG_FETCH;
+        else if ( n == 6 && ! strncmp( val, "hazard", n ) )
+          sm_log |= LOG_HAZARD;
+        else if ( n == 7 && ! strncmp( val, "control", n ) )
+          sm_log |= LOG_CONTROL;
+        else if ( n == 5 && ! strncmp( val, "state", n ) )
+          sm_log |= LOG_STATE;
+        else if ( n == 3 && ! strncmp( val, "all", n ) )
+          sm_log |= LOG_ALL;
+        else if ( ! ( n == 4 && ! strncmp( val, "none", n ) ) ) {
+          printf( "Unknown log category: %.*s.\n", n, val );
+          exit( 1 );
+        }
+        val += n + ( val[ n ] == ',' );
+      }
+    }
+    else if ( ! strcmp( opt, "-l" ) )
+      lanes_file = argv[ i + 1 ];
+    else if ( ! strcmp( opt, "-b" ) )
+      batch_file = argv[ i + 1 ];
+    else if ( ! strcmp( opt, "-j" ) ) {
+      batch_threads = atoi( argv[ i + 1 ] );
+      if ( batch_threads < 1 ) {
+        printf( "Bad thread count: %s.\n", argv[ i + 1 ] );
+        exit( 1 );
+      }
+    }
+    else {
+      printf( "Unknown option: %s.\n", opt );
+      exit( 1 );
+    }
+    i += 2;
+  }
+  if ( ( btb_entries || ras_depth ) && ( bp_kind == BP_NONE || bp_kind == BP_FLUSH ) ) {
+    printf( "-B and -R need a branch predictor, -p, other than flush.\n" );
+    exit( 1 );
+  }
+  if ( early_resolve && ! pipe_forward ) {
+    printf( "-D needs forwarding, -f.\n" );
+    exit( 1 );
+  }
+  if ( rtrace_file != NULL && isa_engine != ENGINE_STEP ) {
+    printf( "-r records what micro_step executes, and needs -e step.\n" );
+    exit( 1 );
+  }
+  if ( delay_slots >= 0 ) {
+    // The ISA with delay slots is only in micro_step, and the pipeline
+    // only in jump-opt's speculative fetch.
+    if ( strcmp( SM_VARIANT, "jump-opt" ) || ! pipe_forward ||
+         bp_kind != BP_NONE || early_resolve ||
+         isa_engine != ENGINE_STEP || lanes_file != NULL ) {
+      printf( "-S is for jump-opt with -f, and neither -p, -D, -l nor -e.\n" );
+      exit( 1 );
+    }
+  }
+  return i;
+}
@@ -0,0 +1,117 @@
+// Performance counters of the pipelined SM.
+//
+// Every cycle pipe_step runs is counted, and what write-back did in it:
+// retire an instruction, or pass a bubble down; the four cycles that
+// fill the pipe from reset are neither.  A cycle in which fetch got no
+// instruction is a stall, counted under its cause:
+//
+//   raw_e, raw_m, raw_w   decode waits for the register the instruction
+//                         in execute, memory or write-back has yet to
+//                         write back (determine_stage, stages 3 to 1)
+//   load_use              -f: decode holds for a load in execute
+//   control               fetch pauses on a control instruction
+//                         (jump_detect)
+//   throttle              basic: inst_ctrl fetches once in four cycles
+//
+// Slots squashed off a wrong path (jump-opt's -p, -D and -S) are
+// counted apart from the stalls.
+//
+// "-P <file>" writes the counters there at exit, as one header line and
+// one row of CSV when the name ends in .csv and as a JSON object
+// otherwise.
+//
+// This file is included by sm-context.c, which keeps one block of
+// counters in each context.
+
+#define PERF_RAW_W     0
+#define PERF_RAW_M     1
+#define PERF_RAW_E     2
+#define PERF_LOAD_USE  3
+#define PERF_CONTROL   4
+#define PERF_THROTTLE  5
+#define PERF_CAUSES    6
+
+const char *perf_cause_name[ PERF_CAUSES ] = {
+  "raw_w", "raw_m", "raw_e", "load_use", "control", "throttle"
+};
+
+typedef struct{
+  long cycles;
+  long retired;
+  long bubbles;                  // bubbles that reached write-back
+  long squashed;
+  long stalls[ PERF_CAUSES ];
+} sm_perf;
+
+// Count the cycle just run; fn and rnumb are those of the instruction
+// write-back finished in it.
+static inline void perf_cycle( sm_perf *p, u4 fn, u4 rnumb )
+{
+  if ( p->cycles >= 4 ) {
+    if ( ! fn && rnumb == 7 )
+      p->bubbles++;
+    else
+      p->retired++;
+  }
+  p->cycles++;
+}
+
+// Count a cycle fetch spent paused with the given stage: 1 to 3 from
+// determine_stage, 4 from jump_detect.
+static inline void perf_pause( sm_perf *p, int stage )
+{
+  if ( stage == 4 )
+    p->stalls[ PERF_CONTROL ]++;
+  else if ( stage >= 1 && stage <= 3 )
+    p->stalls[ PERF_RAW_W + stage - 1 ]++;
+}
+
+// The counters in the report at the end of a run.
+void perf_print( sm_perf *p )
+{
+  printf( "Stalls: %ld bubbles; RAW on E %ld, M %ld, W %ld, load-use %ld, "
+          "control %ld, throttled %ld cycles.\n",
+          p->bubbles, p->stalls[ PERF_RAW_E ], p->stalls[ PERF_RAW_M ],
+          p->stalls[ PERF_RAW_W ], p->stalls[ PERF_LOAD_USE ],
+          p->stalls[ PERF_CONTROL ], p->stalls[ PERF_THROTTLE ] );
+}
+
+// Write the counters of the run of program name on the simulator
+// variant to file; see above.
+void perf_write( sm_perf *p, const char *variant, char *name, char *file )
+{
+  size_t n = strlen( file );
+  int csv = n >= 4 && ! strcmp( file + n - 4, ".csv" );
+  double cpi = p->retired ? (double) p->cycles / p->retired : 0.0;
+  FILE *f = fopen( file, "w" );
+  int i;
+
+  if ( f == NULL ) {
+    printf( "Cannot write the counters to %s.\n", file );
+    return;
+  }
+  if ( csv ) {
+    fprintf( f, "variant,program,cycles,retired,cpi,bubbles,squashed" );
+    for ( i = 0; i < PERF_CAUSES; i++ )
+      fprintf( f, ",%s", perf_cause_name[ i ] );
+    fprintf( f, "\n%s,%s,%ld,%ld,%.4f,%ld,%ld",
+             variant, name, p->cycles, p->retired, cpi, p->bubbles, p->squashed );
+    for ( i = 0; i < PERF_CAUSES; i++ )
+      fprintf( f, ",%ld", p->stalls[ i ] );
+    fprintf( f, "\n" );
+  } else {
+    fprintf( f, "{\n  \"variant\": \"%s\",\n  \"program\": \"", variant );
+    for ( i = 0; name[ i ]; i++ ) {
+      if ( name[ i ] == '"' || name[ i ] == '\\' )
+        fputc( '\\', f );
+      fputc( name[ i ], f );
+    }
+    fprintf( f, "\",\n  \"cycles\": %ld,\n  \"retired\": %ld,\n  \"cpi\": %.4f,\n"
+             "  \"bubbles\": %ld,\n  \"squashed\": %ld,\n  \"stalls\": {",
+             p->cycles, p->retired, cpi, p->bubbles, p->squashed );
+    for ( i = 0; i < PERF_CAUSES; i++ )
+      fprintf( f, "%s\n    \"%s\": %ld", i ? "," : "", perf_cause_name[ i ], p->stalls[ i ] );
+    fprintf( f, "\n  }\n}\n" );
+  }
+  fclose( f );
+}
@@ -0,0 +1,136 @@
+// Hotspot and instruction-mix profile of an SM program (-H).
+//
+// For every address: the instructions micro_step executed there, the
+// instructions the pipeline retired from there, and the pipeline's
+// stall cycles, which are the bubbles write-back saw since the
+// instruction retired before; and for every opcode, the instructions
+// of each level executed.  Opcodes are numbered like the DOP_* handlers
+// of sm-isa.c: the sub-op rnumb of fn 0, 15 + fn for the others.
+// Counting is a few array increments per instruction and per cycle.
+//
+// At exit the hottest addresses and the opcode mix are printed, and
+// "-H <file>" gets one line per address in the folded-stack format of
+// flame-graph tools:
+//
+//   <variant>;<opcode>;<pc> <pipeline cycles, or ISA count without them>
+//
+// The ISA-level counts come from micro_step, so only from -e step.
+//
+// This file is included by sm-context.c, which keeps a pointer to the
+// profile in each context, NULL when there is none.
+
+#include "sm-opnames.c"
+
+#define PROF_TOP   20
+
+typedef struct{
+  unsigned long isa_count[ MEMSIZE ];
+  unsigned long retired[ MEMSIZE ];
+  unsigned long stalls[ MEMSIZE ];
+  unsigned long isa_op[ PROF_OPS ];
+  unsigned long pipe_op[ PROF_OPS ];
+  unsigned long waiting;         // bubbles since the last retirement
+} sm_prof;
+
+sm_prof *prof_new()
+{
+  sm_prof *p = calloc( 1, sizeof( sm_prof ) );
+
+  if ( p == NULL ) {
+    printf( "Out of memory for the profile.\n" );
+    exit( 1 );
+  }
+  return p;
+}
+
+// micro_step is running handler op at pc.
+static inline void prof_isa( sm_prof *p, u16 pc, int op )
+{
+  p->isa_count[ pc ]++;
+  p->isa_op[ op ]++;
+}
+
+// pipe_step has counted cycle number cycles, in which write-back
+// finished fn/rnumb from valP - 1.
+static inline void prof_cycle( sm_prof *p, long cycles, u4 fn, u4 rnumb, u16 valP )
+{
+  u16 pc = valP - 1;
+
+  if ( cycles <= 4 )   // the pipe filling from reset
+    return;
+  if ( ! fn && rnumb == 7 ) {
+    p->waiting++;
+    return;
+  }
+  p->retired[ pc ]++;
+  p->stalls[ pc ] += p->waiting;
+  p->waiting = 0;
+  p->pipe_op[ prof_op( fn, rnumb ) ]++;
+}
+
+static sm_prof *prof_sort_by;
+
+static unsigned long prof_weight( sm_prof *p, int pc )
+{
+  unsigned long cycles = p->retired[ pc ] + p->stalls[ pc ];
+
+  return cycles ? cycles : p->isa_count[ pc ];
+}
+
+static int prof_cmp( const void *a, const void *b )
+{
+  unsigned long wa = prof_weight( prof_sort_by, *(const int *) a );
+  unsigned long wb = prof_weight( prof_sort_by, *(const int *) b );
+
+  if ( wa != wb )
+    return wa < wb ? 1 : -1;
+  return *(const int *) a - *(const int *) b;
+}
+
+// Print the report and write the folded stacks to file; mem holds the
+// instructions at the end of the run.
+void prof_report( sm_prof *p, i16 *mem, char *file )
+{
+  static int pcs[ MEMSIZE ];
+  unsigned long isa_total = 0, pipe_total = 0;
+  int n = 0, i;
+  FILE *f;
+
+  for ( i = 0; i < MEMSIZE; i++ )
+    if ( p->isa_count[ i ] || p->retired[ i ] )
+      pcs[ n++ ] = i;
+  prof_sort_by = p;
+  qsort( pcs, n, sizeof( int ), prof_cmp );
+  for ( i = 0; i < PROF_OPS; i++ ) {
+    isa_total += p->isa_op[ i ];
+    pipe_total += p->pipe_op[ i ];
+  }
+
+  printf( "Profile: %d addresses; the hottest:\n", n );
+  printf( "     pc    word  op         ISA count      retired       stalls\n" );
+  for ( i = 0; i < n && i < PROF_TOP; i++ ) {
+    u16 w = mem[ pcs[ i ] ];
+    printf( "  %5d  0x%04x  %-7s %12lu %12lu %12lu\n", pcs[ i ], w,
+            prof_op_name[ prof_op( w >> 12, ( w >> 4 ) & 0xF ) ],
+            p->isa_count[ pcs[ i ] ], p->retired[ pcs[ i ] ], p->stalls[ pcs[ i ] ] );
+  }
+  printf( "Opcode mix:        ISA count       %%      retired       %%\n" );
+  for ( i = 0; i < PROF_OPS; i++ )
+    if ( p->isa_op[ i ] || p->pipe_op[ i ] )
+      printf( "  %-7s %15lu %6.2f %12lu %6.2f\n", prof_op_name[ i ],
+              p->isa_op[ i ], isa_total ? 100.0 * p->isa_op[ i ] / isa_total : 0.0,
+              p->pipe_op[ i ], pipe_total ? 100.0 * p->pipe_op[ i ] / pipe_total : 0.0 );
+
+  f = fopen( file, "w" );
+  if ( f == NULL ) {
+    printf( "Cannot write the profile to %s.\n", file );
+    return;
+  }
+  for ( i = 0; i < n; i++ ) {
+    u16 w = mem[ pcs[ i ] ];
+    fprintf( f, "%s;%s;%d %lu\n", SM_VARIANT,
+             prof_op_name[ prof_op( w >> 12, ( w >> 4 ) & 0xF ) ],
+             pcs[ i ], prof_weight( p, pcs[ i ] ) );
+  }
+  fclose( f );
+}
@@ -0,0 +1,665 @@
+// Binary retirement trace (-r <file>): one fixed-size record for every
+// instruction micro_step executes and every instruction write-back
+// retires, with what it changed.
+//
+// The file is a 16-byte header, "SMRT", the format version and the
+// record size as two little-endian u16, 8 bytes zero, then the records.
+// The ISA-level run comes first, its records without RT_PIPE, then the
+// pipeline's.  A record gives the register the instruction wrote with
+// a computed value (the ALU result in the pipeline), and for a memory
+// access its address and the value loaded or stored; a load also
+// writes the value loaded to rC.
+//
+// When the name ends in .smz the records are packed instead; see
+// "Packed traces" below.
+//
+// The simulator thread only copies records into a ring buffer; a
+// writer thread takes them out, packs them if need be, and writes them
+// in large blocks.  The ring has one producer and one consumer, so each
+// side owns its index and publishes it to the other with a release
+// store, and reads the other's with an acquire load only when its
+// cached copy says the ring is full or empty.
+//
+// rt_reader reads either kind back, from any point, and -k uses it to
+// check write-back against the ISA-level records of a trace.
+//
+// This file is included by each of the *-sm.c simulators after their
+// pipeline control functions and before sm-isa.c; sm-context.c keeps a
+// pointer to the trace in each context, NULL when there is none.
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define RT_VERSION  2
+#define RT_RING     ( 1 << 18 )   // records in the ring, a power of two
+#define RT_BLOCK    ( 1 << 14 )   // records the writer takes at most at once
+
+#define RT_NO_REG   0xFF
+
+// Record flags
+#define RT_PIPE     1   // retired by write-back, else executed by micro_step
+#define RT_LOAD     2
+#define RT_STORE    4
+
+typedef struct{
+  u32  cycle;                // micro_step: the instruction's number from 0;
+                             // write-back: the cycle it retired in
+  u16  pc;
+  u16  inst;                 // the instruction word
+  u16  value;                // the value written to dest
+  u16  addr;                 // RT_LOAD, RT_STORE: the address accessed
+  u16  mval;                 // and the value loaded or stored
+  unsigned char dest;        // register written, or RT_NO_REG
+  unsigned char flags;
+} rt_record;
+
+// Packed traces (.smz).  After a 16-byte header, "SMRZ", the version
+// and the records per chunk as little-endian u16, come chunks of up to
+// RT_CHUNK records of one run, each a u32 record count and a u32 byte
+// count, then the records.  A record is a byte of flags:
+//
+//   bits 0-2  the RT_* flags
+//   bit 3     dest is set
+//   bit 4     pc is the last one + 1
+//   bit 5     inst is the one last seen at this pc (a 256-entry cache)
+//   bit 6     cycle is the last one + 1
+//
+// followed by what the flags do not give, in this order: the pc delta
+// less one, the instruction word (2 bytes), the cycle delta, dest (a
+// byte) and value xor the last value written to dest, the address
+// delta and the memory value xor the last one.  Deltas are zigzag
+// varints, the xors plain varints.  All of it starts from zero in each
+// chunk, so a chunk decodes on its own.
+//
+// After the chunks comes the index, one rt_chunk per chunk, then a
+// 16-byte trailer: the index offset (u64), the chunk count (u32) and
+// "SMRI".
+
+#define RT_CHUNK        4096
+#define RT_MAX_PACKED   21        // bytes of the longest packed record
+#define RT_INST_CACHE   256
+
+#define RT_F_DEST       0x08
+#define RT_F_NEXT_PC    0x10
+#define RT_F_SAME_INST  0x20
+#define RT_F_NEXT_CYCLE 0x40
+
+typedef struct{
+  unsigned long long offset;     // of the chunk's record count
+  u32  first_cycle;
+  u32  first_seq;                // records of the run before the chunk
+  u32  records;
+  u32  pipe;                     // the run: 0 micro_step, 1 write-back
+} rt_chunk;
+
+// Delta state of a packed chunk, the same on both sides.
+typedef struct{
+  u16  pc, addr, mval;
+  u32  cycle;
+  u16  last[ REGS ];
+  u32  cache_pc[ RT_INST_CACHE ];    // pc + 1, 0 for none
+  u16  cache_inst[ RT_INST_CACHE ];
+} rt_pack_state;
+
+struct sm_rtrace{
+  FILE *f;
+  pthread_t writer;
+  rt_record *ring;
+
+  // Packed: the chunk being filled, its state and the index so far.
+  int  packed;
+  unsigned char *chunk;
+  long chunk_bytes;
+  u32  chunk_records, chunk_pipe, chunk_first_cycle;
+  u32  written[ 2 ];
+  rt_pack_state pack;
+  rt_chunk *index;
+  int  nchunks;
+  unsigned long long offset;
+
+  // Producer side: its index, and the consumer's as last read.
+  _Alignas( 64 ) unsigned long head;
+  unsigned long tail_seen;
+  u32  seq[ 2 ];             // records written by micro_step, write-back
+
+  // Consumer side, and the flag that tells it no more records come.
+  _Alignas( 64 ) _Atomic unsigned long tail;
+  _Atomic unsigned long head_pub;
+  _Atomic int done;
+};
+
+static inline unsigned char *rt_put_varint( unsigned char *p, u32 v )
+{
+  while ( v >= 0x80 ) {
+    *p++ = v | 0x80;
+    v >>= 7;
+  }
+  *p++ = v;
+  return p;
+}
+
+static inline u32 rt_zigzag( i16 d )
+{
+  return d < 0 ? ( (u32) ~d << 1 ) | 1 : (u32) d << 1;
+}
+
+static void rt_end_chunk( sm_rtrace *t )
+{
+  unsigned char head[ 8 ];
+  rt_chunk *c;
+  int i;
+
+  if ( ! t->chunk_records )
+    return;
+  if ( ! ( t->nchunks & ( t->nchunks - 1 ) ) ) {
+    t->index = realloc( t->index, ( t->nchunks ? 2 * t->nchunks : 1 ) * sizeof( rt_chunk ) );
+    if ( t->index == NULL ) {
+      printf( "Out of memory for the retirement trace index.\n" );
+      exit( 1 );
+    }
+  }
+  c = &t->index[ t->nchunks++ ];
+  c->offset = t->offset;
+  c->first_cycle = t->chunk_first_cycle;
+  c->first_seq = t->written[ t->chunk_pipe ];
+  c->records = t->chunk_records;
+  c->pipe = t->chunk_pipe;
+  for ( i = 0; i < 4; i++ ) {
+    head[ i ] = t->chunk_records >> 8 * i;
+    head[ 4 + i ] = t->chunk_bytes >> 8 * i;
+  }
+  fwrite( head, 1, 8, t->f );
+  fwrite( t->chunk, 1, t->chunk_bytes, t->f );
+  t->offset += 8 + t->chunk_bytes;
+  t->written[ t->chunk_pipe ] += t->chunk_records;
+  t->chunk_records = 0;
+  t->chunk_bytes = 0;
+}
+
+static void rt_pack( sm_rtrace *t, const rt_record *r )
+{
+  rt_pack_state *s = &t->pack;
+  unsigned char *p, *flags;
+  u32 pipe = r->flags & RT_PIPE;
+  int slot = r->pc & ( RT_INST_CACHE - 1 );
+
+  if ( t->chunk_records == RT_CHUNK || ( t->chunk_records && pipe != t->chunk_pipe ) )
+    rt_end_chunk( t );
+  if ( ! t->chunk_records ) {
+    memset( s, 0, sizeof( *s ) );
+    t->chunk_pipe = pipe;
+    t->chunk_first_cycle = r->cycle;
+  }
+  p = t->chunk + t->chunk_bytes;
+  flags = p++;
+  *flags = r->flags;
+  if ( r->pc == (u16) ( s->pc + 1 ) )
+    *flags |= RT_F_NEXT_PC;
+  else
+    p = rt_put_varint( p, rt_zigzag( r->pc - s->pc - 1 ) );
+  if ( s->cache_pc[ slot ] == r->pc + 1u && s->cache_inst[ slot ] == r->inst )
+    *flags |= RT_F_SAME_INST;
+  else {
+    *p++ = r->inst;
+    *p++ = r->inst >> 8;
+    s->cache_pc[ slot ] = r->pc + 1u;
+    s->cache_inst[ slot ] = r->inst;
+  }
+  if ( r->cycle == s->cycle + 1 )
+    *flags |= RT_F_NEXT_CYCLE;
+  else
+    p = rt_put_varint( p, r->cycle - s->cycle );
+  if ( r->dest != RT_NO_REG ) {
+    *flags |= RT_F_DEST;
+    *p++ = r->dest;
+    p = rt_put_varint( p, r->value ^ s->last[ r->dest ] );
+    s->last[ r->dest ] = r->value;
+  }
+  if ( r->flags & ( RT_LOAD | RT_STORE ) ) {
+    p = rt_put_varint( p, rt_zigzag( r->addr - s->addr ) );
+    p = rt_put_varint( p, r->mval ^ s->mval );
+    s->addr = r->addr;
+    s->mval = r->mval;
+  }
+  s->pc = r->pc;
+  s->cycle = r->cycle;
+  t->chunk_bytes = p - t->chunk;
+  t->chunk_records++;
+}
+
+static void *rt_writer( void *arg )
+{
+  sm_rtrace *t = arg;
+  unsigned long tail = atomic_load_explicit( &t->tail, memory_order_relaxed );
+  struct timespec nap = { 0, 100000 };
+  unsigned long i;
+
+  for ( ;; ) {
+    int done = atomic_load_explicit( &t->done, memory_order_acquire );
+    unsigned long head = atomic_load_explicit( &t->head_pub, memory_order_acquire );
+    unsigned long n = head - tail, start = tail & ( RT_RING - 1 );
+
+    if ( n == 0 ) {
+      if ( done )
+        return NULL;
+      nanosleep( &nap, NULL );
+      continue;
+    }
+    if ( n > RT_RING - start )   // up to the end of the ring
+      n = RT_RING - start;
+    if ( n > RT_BLOCK )
+      n = RT_BLOCK;
+    if ( t->packed )
+      for ( i = 0; i < n; i++ )
+        rt_pack( t, &t->ring[ start + i ] );
+    else
+      fwrite( t->ring + start, sizeof( rt_record ), n, t->f );
+    tail += n;
+    atomic_store_explicit( &t->tail, tail, memory_order_release );
+  }
+}
+
+sm_rtrace *rt_open( char *file )
+{
+  sm_rtrace *t = aligned_alloc( 64, sizeof( sm_rtrace ) );
+  size_t len = strlen( file );
+  unsigned char header[ 16 ] = { 'S', 'M', 'R', 'T', RT_VERSION, 0, sizeof( rt_record ), 0 };
+
+  if ( t == NULL || ( t->ring = malloc( RT_RING * sizeof( rt_record ) ) ) == NULL ) {
+    printf( "Out of memory for the retirement trace.\n" );
+    exit( 1 );
+  }
+  t->packed = len >= 4 && ! strcmp( file + len - 4, ".smz" );
+  t->chunk = NULL;
+  t->chunk_bytes = t->chunk_records = 0;
+  t->written[ 0 ] = t->written[ 1 ] = 0;
+  t->index = NULL;
+  t->nchunks = 0;
+  t->offset = sizeof( header );
+  if ( t->packed ) {
+    header[ 3 ] = 'Z';
+    header[ 6 ] = RT_CHUNK & 0xFF;
+    header[ 7 ] = RT_CHUNK >> 8;
+    t->chunk = malloc( RT_CHUNK * RT_MAX_PACKED );
+    if ( t->chunk == NULL ) {
+      printf( "Out of memory for the retirement trace.\n" );
+      exit( 1 );
+    }
+  }
+  t->f = fopen( file, "wb" );
+  if ( t->f == NULL ) {
+    printf( "Cannot write the retirement trace to %s.\n", file );
+    exit( 1 );
+  }
+  setvbuf( t->f, NULL, _IOFBF, RT_BLOCK * sizeof( rt_record ) );
+  fwrite( header, 1, sizeof( header ), t->f );
+  t->head = t->tail_seen = 0;
+  t->seq[ 0 ] = t->seq[ 1 ] = 0;
+  atomic_init( &t->tail, 0 );
+  atomic_init( &t->head_pub, 0 );
+  atomic_init( &t->done, 0 );
+  if ( pthread_create( &t->writer, NULL, rt_writer, t ) ) {
+    printf( "Cannot start the retirement trace writer.\n" );
+    exit( 1 );
+  }
+  return t;
+}
+
+// Let the writer write out what is left, and close the file.
+void rt_close( sm_rtrace *t )
+{
+  atomic_store_explicit( &t->done, 1, memory_order_release );
+  pthread_join( t->writer, NULL );
+  if ( t->packed ) {
+    unsigned char trailer[ 16 ] = { 0 };
+    int i;
+
+    rt_end_chunk( t );
+    fwrite( t->index, sizeof( rt_chunk ), t->nchunks, t->f );
+    for ( i = 0; i < 8; i++ )
+      trailer[ i ] = t->offset >> 8 * i;
+    for ( i = 0; i < 4; i++ )
+      trailer[ 8 + i ] = t->nchunks >> 8 * i;
+    memcpy( trailer + 12, "SMRI", 4 );
+    fwrite( trailer, 1, sizeof( trailer ), t->f );
+  }
+  fclose( t->f );
+  free( t->index );
+  free( t->chunk );
+  free( t->ring );
+  free( t );
+}
+
+// Take a slot in the ring, waiting for the writer while it is full.
+static inline rt_record *rt_slot( sm_rtrace *t )
+{
+  if ( t->head - t->tail_seen == RT_RING )
+    while ( t->head - ( t->tail_seen = atomic_load_explicit( &t->tail, memory_order_acquire ) ) == RT_RING )
+      sched_yield();
+  return &t->ring[ t->head & ( RT_RING - 1 ) ];
+}
+
+static inline void rt_publish( sm_rtrace *t )
+{
+  atomic_store_explicit( &t->head_pub, ++t->head, memory_order_release );
+}
+
+// Fill in the register and memory fields of r for instruction
+// fn/rnumc/rnumb/rnuma; reg is the register file after it ran.
+static inline void rt_effects( rt_record *r, i16 *reg, u4 fn, u4 rnumc, u4 rnumb, u4 rnuma )
+{
+  int access = mem_access_ctrl( fn, rnuma, rnumb, rnumc );
+
+  r->dest = RT_NO_REG;
+  r->value = 0;
+  if ( alu_wb_ctrl( fn, rnuma, rnumb, rnumc ) ) {
+    r->dest = reg_ctrl( fn, rnuma, rnumb, rnumc ) ? rnumc : rnuma;
+    r->value = reg[ r->dest ];
+  }
+  r->flags |= access == 0 ? RT_LOAD : access == 1 ? RT_STORE : 0;
+}
+
+// micro_step ran the instruction d decoded, handler op; regc and rega
+// are the values rC and rA had before.
+static inline void rt_isa( sm_context *sm, decoded_inst *d, int op, i16 regc, i16 rega )
+{
+  sm_rtrace *t = sm->rtrace;
+  rt_record *r = rt_slot( t );
+  u4 fn = op >= 16 ? op - 15 : 0;
+
+  r->cycle = t->seq[ 0 ]++;
+  r->pc = d - sm->dcache;
+  r->inst = fn << 12 | d->rnumc << 8 | d->rnumb << 4 | d->rnuma;
+  r->flags = 0;
+  r->addr = r->mval = 0;
+  rt_effects( r, sm->reg, fn, d->rnumc, d->rnumb, d->rnuma );
+  if ( r->flags ) {
+    switch ( d->rnumb ) {
+    case  2: r->addr = regc; break;           // stmem
+    case  3:                                  // call
+    case 15: r->addr = rega - 1; break;       // push
+    default: r->addr = rega; break;           // ldmem, return, pop
+    }
+    r->mval = sm->mem[ r->addr ];
+  }
+  rt_publish( t );
+}
+
+// The record of the instruction write-back is retiring from cW.
+static inline void rt_pipe_record( sm_context *sm, rt_record *r )
+{
+  r->cycle = sm->perf.cycles;
+  r->pc = sm->cW.valP - 1;
+  r->inst = sm->cW.fn << 12 | sm->cW.rnumc << 8 | sm->cW.rnumb << 4 | sm->cW.rnuma;
+  r->flags = RT_PIPE;
+  r->addr = r->mval = 0;
+  rt_effects( r, sm->pipe_reg, sm->cW.fn, sm->cW.rnumc, sm->cW.rnumb, sm->cW.rnuma );
+  if ( r->flags & ( RT_LOAD | RT_STORE ) ) {
+    r->addr = sm->cW.addr;
+    r->mval = sm->cW.memV;
+  }
+}
+
+static inline void rt_pipe( sm_context *sm )
+{
+  sm_rtrace *t = sm->rtrace;
+
+  rt_pipe_record( sm, rt_slot( t ) );
+  t->seq[ 1 ]++;
+  rt_publish( t );
+}
+
+
+// Reading a trace back, plain or packed, in order from any point.
+
+struct rt_reader{
+  FILE *f;
+  int  packed;
+  long records;                  // plain: records in the file
+
+  // Packed: the index, and the chunk being read.
+  rt_chunk *index;
+  int  nchunks, chunk;
+  unsigned char *buf;
+  long pos, len;
+  u32  left;
+  rt_pack_state pack;
+
+  long next;                     // plain: the next record
+  rt_record ahead;               // rt_read_seek read one too far
+  int  have_ahead;
+
+  // -k: retirements checked, and whether one differed.
+  long matched;
+  int  mismatched;
+};
+
+static u32 rt_le( const unsigned char *p, int n )
+{
+  u32 v = 0;
+
+  while ( n-- )
+    v = v << 8 | p[ n ];
+  return v;
+}
+
+rt_reader *rt_read_open( char *file )
+{
+  rt_reader *r = calloc( 1, sizeof( rt_reader ) );
+  unsigned char header[ 16 ], trailer[ 16 ];
+  long size;
+
+  if ( r == NULL ) {
+    printf( "Out of memory for reading %s.\n", file );
+    exit( 1 );
+  }
+  r->f = fopen( file, "rb" );
+  if ( r->f == NULL || fread( header, 1, 16, r->f ) != 16 || memcmp( header, "SMR", 3 ) ||
+       rt_le( header + 4, 2 ) != RT_VERSION ) {
+    printf( "%s is not a retirement trace of this version.\n", file );
+    exit( 1 );
+  }
+  fseek( r->f, 0, SEEK_END );
+  size = ftell( r->f );
+  r->packed = header[ 3 ] == 'Z';
+  if ( ! r->packed ) {
+    r->records = ( size - 16 ) / sizeof( rt_record );
+    fseek( r->f, 16, SEEK_SET );
+    return r;
+  }
+  fseek( r->f, size - 16, SEEK_SET );
+  if ( fread( trailer, 1, 16, r->f ) != 16 || memcmp( trailer + 12, "SMRI", 4 ) ) {
+    printf( "%s has no chunk index.\n", file );
+    exit( 1 );
+  }
+  r->nchunks = rt_le( trailer + 8, 4 );
+  r->index = malloc( r->nchunks * sizeof( rt_chunk ) + 1 );
+  r->buf = malloc( RT_CHUNK * RT_MAX_PACKED );
+  if ( r->index == NULL || r->buf == NULL ) {
+    printf( "Out of memory for reading %s.\n", file );
+    exit( 1 );
+  }
+  fseek( r->f, (long) rt_le( trailer, 4 ) | (long) rt_le( trailer + 4, 4 ) << 32, SEEK_SET );
+  if ( fread( r->index, sizeof( rt_chunk ), r->nchunks, r->f ) != (size_t) r->nchunks ) {
+    printf( "%s has a short chunk index.\n", file );
+    exit( 1 );
+  }
+  r->chunk = -1;
+  return r;
+}
+
+void rt_read_close( rt_reader *r )
+{
+  fclose( r->f );
+  free( r->index );
+  free( r->buf );
+  free( r );
+}
+
+// Load chunk c.  Returns 0 past the last one.
+static int rt_load_chunk( rt_reader *r, int c )
+{
+  unsigned char head[ 8 ];
+
+  r->chunk = c;
+  if ( c >= r->nchunks )
+    return 0;
+  fseek( r->f, r->index[ c ].offset, SEEK_SET );
+  if ( fread( head, 1, 8, r->f ) != 8 )
+    return 0;
+  r->left = rt_le( head, 4 );
+  r->len = rt_le( head + 4, 4 );
+  if ( r->len > RT_CHUNK * RT_MAX_PACKED || fread( r->buf, 1, r->len, r->f ) != (size_t) r->len )
+    return 0;
+  r->pos = 0;
+  memset( &r->pack, 0, sizeof( r->pack ) );
+  return 1;
+}
+
+static inline u32 rt_get_varint( rt_reader *r )
+{
+  u32 v = 0;
+  int shift = 0;
+  unsigned char b;
+
+  do {
+    b = r->buf[ r->pos++ ];
+    v |= (u32) ( b & 0x7F ) << shift;
+    shift += 7;
+  } while ( b & 0x80 );
+  return v;
+}
+
+static inline i16 rt_unzigzag( u32 v )
+{
+  return v & 1 ? ~( v >> 1 ) : v >> 1;
+}
+
+// The next record into rec.  Returns 0 at the end of the trace.
+int rt_read_next( rt_reader *r, rt_record *rec )
+{
+  rt_pack_state *s = &r->pack;
+  unsigned char f;
+  int slot;
+
+  if ( r->have_ahead ) {
+    *rec = r->ahead;
+    r->have_ahead = 0;
+    return 1;
+  }
+  if ( ! r->packed ) {
+    if ( r->next >= r->records || fread( rec, sizeof( rt_record ), 1, r->f ) != 1 )
+      return 0;
+    r->next++;
+    return 1;
+  }
+  while ( ! r->left )
+    if ( ! rt_load_chunk( r, r->chunk + 1 ) )
+      return 0;
+  r->left--;
+  f = r->buf[ r->pos++ ];
+  rec->flags = f & 7;
+  rec->pc = f & RT_F_NEXT_PC ? s->pc + 1 : s->pc + 1 + rt_unzigzag( rt_get_varint( r ) );
+  slot = rec->pc & ( RT_INST_CACHE - 1 );
+  if ( f & RT_F_SAME_INST )
+    rec->inst = s->cache_inst[ slot ];
+  else {
+    rec->inst = r->buf[ r->pos ] | r->buf[ r->pos + 1 ] << 8;
+    r->pos += 2;
+    s->cache_pc[ slot ] = rec->pc + 1u;
+    s->cache_inst[ slot ] = rec->inst;
+  }
+  rec->cycle = f & RT_F_NEXT_CYCLE ? s->cycle + 1 : s->cycle + rt_get_varint( r );
+  rec->dest = RT_NO_REG;
+  rec->value = 0;
+  if ( f & RT_F_DEST ) {
+    rec->dest = r->buf[ r->pos++ ] & ( REGS - 1 );
+    rec->value = s->last[ rec->dest ] ^= rt_get_varint( r );
+  }
+  rec->addr = rec->mval = 0;
+  if ( rec->flags & ( RT_LOAD | RT_STORE ) ) {
+    rec->addr = s->addr += rt_unzigzag( rt_get_varint( r ) );
+    rec->mval = s->mval ^= rt_get_varint( r );
+  }
+  s->pc = rec->pc;
+  s->cycle = rec->cycle;
+  return 1;
+}
+
+// Go to the first record of the run pipe (0 micro_step, 1 write-back)
+// with a cycle of at least cycle.  Returns 0 when there is none.
+int rt_read_seek( rt_reader *r, int pipe, u32 cycle )
+{
+  rt_record rec;
+  long lo = 0, hi;
+
+  r->have_ahead = 0;
+  if ( r->packed ) {
+    // The last chunk of the run starting at or before cycle.
+    hi = r->nchunks;
+    while ( lo < hi ) {
+      long mid = ( lo + hi ) / 2;
+      if ( r->index[ mid ].pipe < (u32) pipe ||
+           ( r->index[ mid ].pipe == (u32) pipe && r->index[ mid ].first_cycle <= cycle ) )
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if ( lo > 0 && r->index[ lo - 1 ].pipe == (u32) pipe )
+      lo--;
+    if ( ! rt_load_chunk( r, lo ) )
+      return 0;
+  } else {
+    // The first record of the run at or after cycle.
+    hi = r->records;
+    while ( lo < hi ) {
+      long mid = ( lo + hi ) / 2;
+      fseek( r->f, 16 + mid * sizeof( rt_record ), SEEK_SET );
+      if ( fread( &rec, sizeof( rt_record ), 1, r->f ) != 1 )
+        return 0;
+      if ( ( rec.flags & RT_PIPE ) < pipe || ( ( rec.flags & RT_PIPE ) == pipe && rec.cycle < cycle ) )
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    r->next = lo;
+    fseek( r->f, 16 + lo * sizeof( rt_record ), SEEK_SET );
+  }
+  while ( rt_read_next( r, &rec ) )
+    if ( ( rec.flags & RT_PIPE ) == pipe && rec.cycle >= cycle ) {
+      r->ahead = rec;
+      r->have_ahead = 1;
+      return 1;
+    } else if ( ( rec.flags & RT_PIPE ) > pipe )
+      return 0;
+  return 0;
+}
+
+// -k: check the instruction write-back is retiring against the next
+// micro_step record of the trace; report the first that differs.
+void rt_check( sm_context *sm )
+{
+  rt_reader *r = sm->rcheck;
+  rt_record got, want;
+
+  if ( r->mismatched )
+    return;
+  rt_pipe_record( sm, &got );
+  if ( ! rt_read_next( r, &want ) || ( want.flags & RT_PIPE ) ) {
+    printf( "Retirement check: cycle %u retires pc %d past the end of the trace.\n", got.cycle, got.pc );
+    r->mismatched = 1;
+  } else if ( got.pc != want.pc || got.inst != want.inst || got.dest != want.dest ||
+              got.value != want.value ||
+              ( got.flags & ( RT_LOAD | RT_STORE ) ) != ( want.flags & ( RT_LOAD | RT_STORE ) ) ||
+              got.addr != want.addr || got.mval != want.mval ) {
+    printf( "Retirement check: instruction %ld, cycle %u: write-back has pc %d, %04x, "
+            "r%d = %d, [%d] %d; the trace pc %d, %04x, r%d = %d, [%d] %d.\n",
+            r->matched, got.cycle, got.pc, got.inst, got.dest, (i16) got.value,
+            got.addr, (i16) got.mval, want.pc, want.inst, want.dest, (i16) want.value,
+            want.addr, (i16) want.mval );
+    r->mismatched = 1;
+  } else
+    r->matched++;
+}
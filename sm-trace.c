@@ -0,0 +1,211 @@
+// Pipeline occupancy trace (-T <file>), in the Kanata log format that
+// the Konata pipeline viewer loads.
+//
+// fetch numbers every instruction it takes from memory, and the number
+// rides down the pipe registers with it; bubbles and squashed slots
+// carry 0.  At the end of each cycle trace_pipe looks up where each
+// numbered instruction is:
+//
+//   F    in nD, just fetched
+//   D    in cD, being decoded
+//   Ds   waiting in decode: parked by a RAW stall (pause_caused_by*),
+//        or held by -f for a load-use hazard
+//   E, M, W
+//
+// and records an event when one is new, has moved to another stage or
+// has left the pipe: retired from W, or squashed from any other stage,
+// which Konata shows as a flush.  Whatever is still in the pipe when the
+// run ends is flushed at the cycle after the last, so that no
+// instruction is left open.
+//
+// The events go into a buffer of fixed-size records; only when that
+// fills, and at exit, are they formatted and written, so a cycle costs
+// a scan of six pipe registers and a few stores.
+//
+// This file is included by each of the *-sm.c simulators after
+// sm-context.c, which keeps a pointer to the trace in each context,
+// NULL when there is none.
+
+#define TRACE_EVENTS  65536   // events buffered between writes
+#define TRACE_LIVE    8       // numbered instructions in the pipe
+
+#define TRACE_F       0
+#define TRACE_D       1
+#define TRACE_DS      2
+#define TRACE_E       3
+#define TRACE_M       4
+#define TRACE_W       5
+#define TRACE_STAGES  6
+
+const char *trace_stage_name[ TRACE_STAGES ] = { "F", "D", "Ds", "E", "M", "W" };
+
+// Events: a new instruction in F; one moving from stage from to to; one
+// leaving the pipe from stage from, squashed unless from is W; one still
+// in stage from when the run ends.
+#define TRACE_NEW     0
+#define TRACE_MOVE    1
+#define TRACE_LEAVE   2
+#define TRACE_END     3
+
+typedef struct{
+  u32  cycle;
+  u32  id;                   // Kanata id: fetched instructions in order
+  u32  tid;                  // TRACE_NEW: the number fetch gave it
+  unsigned char kind;
+  unsigned char from, to;
+  u16  pc, word;             // TRACE_NEW
+} trace_event;
+
+typedef struct{
+  u32  tid, id;
+  unsigned char stage, seen;
+} trace_live;
+
+struct sm_trace{
+  FILE *f;
+  u32  next_id, retired;
+  u32  cycle;                // the last cycle trace_pipe recorded
+  long last_cycle;           // of the events written, -1 before any
+  int  nlive;
+  trace_live live[ TRACE_LIVE ];
+  int  n;
+  trace_event ev[ TRACE_EVENTS ];
+};
+
+sm_trace *trace_open( char *file )
+{
+  sm_trace *t = calloc( 1, sizeof( sm_trace ) );
+
+  if ( t == NULL ) {
+    printf( "Out of memory for the trace.\n" );
+    exit( 1 );
+  }
+  t->f = fopen( file, "w" );
+  if ( t->f == NULL ) {
+    printf( "Cannot write the trace to %s.\n", file );
+    exit( 1 );
+  }
+  fprintf( t->f, "Kanata\t0004\n" );
+  t->last_cycle = -1;
+  return t;
+}
+
+// Format and write the buffered events.
+void trace_flush( sm_trace *t )
+{
+  int i;
+
+  for ( i = 0; i < t->n; i++ ) {
+    trace_event *e = &t->ev[ i ];
+    if ( t->last_cycle < 0 )
+      fprintf( t->f, "C=\t%u\n", e->cycle );
+    else if ( e->cycle != t->last_cycle )
+      fprintf( t->f, "C\t%ld\n", e->cycle - t->last_cycle );
+    t->last_cycle = e->cycle;
+    switch ( e->kind ) {
+    case TRACE_NEW:
+      fprintf( t->f, "I\t%u\t%u\t0\nL\t%u\t0\t%5u: %04x %s\nS\t%u\t0\tF\n",
+               e->id, e->tid, e->id, e->pc, e->word,
+               prof_op_name[ prof_op( e->word >> 12, ( e->word >> 4 ) & 0xF ) ], e->id );
+      break;
+    case TRACE_MOVE:
+      fprintf( t->f, "E\t%u\t0\t%s\nS\t%u\t0\t%s\n",
+               e->id, trace_stage_name[ e->from ], e->id, trace_stage_name[ e->to ] );
+      break;
+    case TRACE_LEAVE:
+    case TRACE_END:
+      fprintf( t->f, "E\t%u\t0\t%s\nR\t%u\t%u\t%d\n", e->id, trace_stage_name[ e->from ],
+               e->id, t->retired++, e->kind == TRACE_END || e->from != TRACE_W );
+      break;
+    }
+  }
+  t->n = 0;
+}
+
+static inline trace_event *trace_add( sm_trace *t, u32 cycle, int kind, u32 id )
+{
+  trace_event *e = &t->ev[ t->n++ ];
+
+  e->cycle = cycle;
+  e->kind = kind;
+  e->id = id;
+  return e;
+}
+
+// Flush what is still in the pipe, then write out the trace.
+void trace_close( sm_trace *t )
+{
+  int i;
+
+  trace_flush( t );
+  for ( i = 0; i < t->nlive; i++ )
+    trace_add( t, t->cycle + 1, TRACE_END, t->live[ i ].id )->from = t->live[ i ].stage;
+  t->nlive = 0;
+  trace_flush( t );
+  fclose( t->f );
+  free( t );
+}
+
+// Record where the instructions are at the end of the cycle pipe_step
+// has just run, before it counts the cycle.
+void trace_pipe( sm_context *sm )
+{
+  sm_trace *t = sm->trace;
+  u32 tid[ TRACE_STAGES ] = { 0 };
+  u32 cycle = sm->perf.cycles;
+  int s, i;
+
+  if ( t->n > TRACE_EVENTS - 2 * TRACE_LIVE )
+    trace_flush( t );
+  t->cycle = cycle;
+
+  if ( sm->nD.tid != sm->cD.tid )
+    tid[ TRACE_F ] = sm->nD.tid;
+  else if ( sm->cD.tid )      // -f: decode holds it another cycle
+    tid[ TRACE_DS ] = sm->cD.tid;
+  if ( ! tid[ TRACE_DS ] )
+    tid[ TRACE_D ] = sm->cD.tid;
+  if ( sm->paused )
+    switch ( sm->stage ) {
+    case 1: tid[ TRACE_DS ] = sm->pause_caused_byW.tid; break;
+    case 2: tid[ TRACE_DS ] = sm->pause_caused_byM.tid; break;
+    case 3: tid[ TRACE_DS ] = sm->pause_caused_byE.tid; break;
+    }
+  tid[ TRACE_E ] = sm->cE.tid;
+  tid[ TRACE_M ] = sm->cM.tid;
+  tid[ TRACE_W ] = sm->cW.tid;
+
+  for ( s = 0; s < TRACE_STAGES; s++ ) {
+    if ( ! tid[ s ] )
+      continue;
+    for ( i = 0; i < t->nlive && t->live[ i ].tid != tid[ s ]; i++ )
+      ;
+    if ( i == t->nlive ) {
+      trace_event *e;
+      if ( t->nlive == TRACE_LIVE )   // cannot happen with six stages
+        continue;
+      t->nlive++;
+      t->live[ i ].tid = tid[ s ];
+      t->live[ i ].id = t->next_id++;
+      t->live[ i ].stage = s;
+      e = trace_add( t, cycle, TRACE_NEW, t->live[ i ].id );
+      e->tid = tid[ s ];
+      e->pc = sm->nD.valP - 1;
+      e->word = sm->nD.fn << 12 | sm->nD.rnumc << 8 | sm->nD.rnumb << 4 | sm->nD.rnuma;
+    } else if ( t->live[ i ].stage != s ) {
+      trace_event *e = trace_add( t, cycle, TRACE_MOVE, t->live[ i ].id );
+      e->from = t->live[ i ].stage;
+      e->to = s;
+      t->live[ i ].stage = s;
+    }
+    t->live[ i ].seen = 1;
+  }
+
+  for ( i = 0; i < t->nlive; )
+    if ( t->live[ i ].seen ) {
+      t->live[ i++ ].seen = 0;
+    } else {
+      trace_add( t, cycle, TRACE_LEAVE, t->live[ i ].id )->from = t->live[ i ].stage;
+      t->live[ i ] = t->live[ --t->nlive ];
+    }
+}
@@ -0,0 +1,39 @@
+; alu-chain: tight ALU dependency chains.
+;
+; Each instruction of the loop needs the result of the one before it, so
+; a stalling pipeline waits on nearly every instruction and forwarding
+; removes nearly all of it.  The loop mixes mul, add, xor, shifts and
+; logic on a 16-bit hash of the counter.
+;
+; Dynamic instructions: 39021, state checksum 146c7790.
+
+ITER    = 3000
+result  = 0x4000
+
+        li r14, 1
+        li r1, ITER             ; counter
+        li r2, 12345            ; x
+        li r3, 3
+        li r4, 0x5a5a
+        li r5, 7
+        li r12, loop
+loop:   mul r2, r2, r3          ; x = x * 3 + 7
+        add r2, r2, r5
+        xor r2, r2, r4          ; x ^= 0x5a5a
+        sright r6, r2, r5       ; x += x >> 7
+        add r2, r2, r6
+        sub r7, r2, r6
+        and r7, r7, r4
+        lor r8, r7, r1
+        add r9, r9, r8          ; acc += (x - t) & 0x5a5a | i
+        sleft r10, r9, r3
+        xor r11, r11, r10       ; mix ^= acc << 3
+        sub r1, r1, r14
+        jump r1, r12
+
+        li r10, result
+        stmem r10, r2
+        add r10, r10, r14
+        stmem r10, r9
+        add r10, r10, r14
+        stmem r10, r11
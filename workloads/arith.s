@@ -0,0 +1,57 @@
+; arith: mul and div heavy kernels.
+;
+; For PAIRS pairs of generated numbers: their gcd by Euclid's algorithm,
+; with the remainder as a - a / b * b, and the integer square root of
+; the first by Newton's method, x = ( x + n / x ) / 2.  Every step is a
+; div whose result the next instruction multiplies or adds.
+;
+; Dynamic instructions: 43478, state checksum f581985d.
+
+PAIRS   = 300
+out     = 0x4000                ; gcd, root per pair
+
+        li r14, 1
+        li r0, 0
+        li r15, out
+        li r1, PAIRS
+        li r2, 1                ; generator state
+        li r3, 25173
+        li r4, 13849
+        li r12, 0x3fff
+        li r13, pair
+pair:   mul r2, r2, r3          ; a = ( x & 0x3fff ) + 1
+        add r2, r2, r4
+        and r5, r2, r12
+        add r5, r5, r14
+        add r8, r5, r0          ; n = a, for the root
+        mul r2, r2, r3          ; b = ( x & 0x3fff ) | 1
+        add r2, r2, r4
+        and r6, r2, r12
+        lor r6, r6, r14
+
+        li r11, gcd
+gcd:    div r7, r5, r6          ; t = a - a / b * b
+        mul r7, r7, r6
+        sub r7, r5, r7
+        add r5, r6, r0          ; a = b
+        add r6, r7, r0          ; b = t
+        jump r6, r11
+        stmem r15, r5
+        add r15, r15, r14
+
+        add r9, r8, r0          ; x = n
+        li r11, root
+        li r6, rdone
+root:   div r10, r8, r9         ; y = ( x + n / x ) >> 1
+        add r10, r10, r9
+        sright r10, r10, r14
+        lt r7, r10, r9          ; until y >= x
+        cnot r7, r7
+        jump r7, r6
+        add r9, r10, r0
+        jump r14, r11
+rdone:  stmem r15, r9
+        add r15, r15, r14
+
+        sub r1, r1, r14
+        jump r1, r13
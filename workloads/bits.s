@@ -0,0 +1,49 @@
+; bits: bit manipulation.
+;
+; For N generated words: the population count, the bit reversal, and a
+; reversal checked by reversing back, mixed with shifts, not, neg and
+; cnot, into a running hash; each word's popcount is also added to a
+; histogram.  Few loads, but each result feeds the next.
+;
+; Dynamic instructions: 42025, state checksum d525d82e.
+
+N       = 2000
+hist    = 0x4000                ; 17 counts, by popcount
+result  = 0x4020                ; hash, bad reversals
+
+        li r14, 1
+        li r1, N
+        li r2, 7                ; generator state
+        li r3, 25173
+        li r4, 13849
+        li r5, 0                ; hash
+        li r6, 0                ; reversals that did not come back
+        li r10, hist
+        li r11, 5
+        li r13, word
+word:   mul r2, r2, r3
+        add r2, r2, r4
+        popcnt r7, r2
+        add r8, r10, r7         ; hist[ popcount ]++
+        ldmem r9, r8
+        add r9, r9, r14
+        stmem r8, r9
+        bitrev r8, r2
+        bitrev r9, r8           ; back again
+        xor r9, r9, r2
+        cnot r9, r9
+        cnot r9, r9
+        add r6, r6, r9
+        sleft r12, r5, r11      ; hash = ( hash << 5 ) ^ ~rev + -( hash >> popcount )
+        not r9, r8
+        xor r12, r12, r9
+        sright r9, r5, r7
+        neg r9, r9
+        add r5, r12, r9
+        sub r1, r1, r14
+        jump r1, r13
+
+        li r10, result
+        stmem r10, r5
+        add r10, r10, r14
+        stmem r10, r6
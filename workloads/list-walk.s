@@ -0,0 +1,62 @@
+; list-walk: load-use chains through a linked list.
+;
+; Builds a list of NODES two-word nodes (next pointer, value) scattered
+; through memory, then walks it PASSES times summing the values.  Each
+; step loads the next pointer with ldmem and the very next instruction
+; uses it, and so does the add of the value: load-use hazards on every
+; step of the walk.
+;
+; Dynamic instructions: 56761, state checksum f09f27e6.
+
+NODES   = 256
+PASSES  = 40
+list    = 0x4000                ; nodes at list + 2 * (i * 37 % NODES)
+result  = 0x3000
+
+        li r14, 1
+        li r13, 37
+        li r12, NODES - 1       ; mask
+        li r11, list
+        li r0, 0
+
+        ; build: node i points at node i + 1, the last one at 0
+        li r1, 0                ; i
+        li r10, build
+build:  mul r2, r1, r13         ; addr( i )
+        and r2, r2, r12
+        add r2, r2, r2
+        add r2, r2, r11
+        add r3, r1, r14         ; addr( i + 1 )
+        mul r4, r3, r13
+        and r4, r4, r12
+        add r4, r4, r4
+        add r4, r4, r11
+        lteq r6, r3, r12        ; i + 1 < NODES ?
+        cnot r6, r6
+        cmove r4, r6, r0        ; i + 1 == NODES: the end
+        stmem r2, r4            ; next
+        add r7, r1, r1
+        add r7, r7, r1
+        add r7, r7, r14
+        add r8, r2, r14
+        stmem r8, r7            ; value = 3 * i + 1
+        add r1, r3, r0
+        lteq r5, r1, r12
+        jump r5, r10
+
+        ; walk
+        li r8, 0                ; sum
+        li r9, PASSES
+        li r10, pass
+        li r12, walk
+pass:   li r4, list             ; node 0 is at list
+walk:   add r6, r4, r14
+        ldmem r7, r6            ; value
+        add r8, r8, r7          ; sum += value
+        ldmem r4, r4            ; p = next
+        jump r4, r12            ; while p
+        sub r9, r9, r14
+        jump r9, r10
+
+        li r1, result
+        stmem r1, r8
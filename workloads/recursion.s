@@ -0,0 +1,57 @@
+; recursion: deep call chains through call, return, push and pop.
+;
+; fib( FIB ) by the doubly recursive definition, then sum( SUM ) =
+; SUM + sum( SUM - 1 ), which nests SUM calls deep.  Each call pushes
+; its return address and saves its argument with push; every return
+; loads the address back from the stack, so the pipeline cannot know
+; where fetch goes next until the load is done.
+;
+; Dynamic instructions: 31974, state checksum 7e9272dd.
+
+FIB     = 16
+SUM     = 1000
+stack   = 0x8000
+result  = 0x4000
+
+        li r14, 1
+        li r13, main
+        jump r14, r13
+
+; fib( r1 ) in r1; r15 the stack pointer.
+fib:    lt r2, r1, r3           ; n < 2: fib( n ) = n
+        jump r2, r11
+        push r1, r15
+        sub r1, r1, r14
+        call r10, r15           ; fib( n - 1 )
+        pop r4, r15
+        push r1, r15
+        sub r1, r4, r3
+        call r10, r15           ; fib( n - 2 )
+        pop r4, r15
+        add r1, r1, r4
+fibret: return r15
+
+; sum( r1 ) in r1.
+sum:    cnot r2, r1             ; sum( 0 ) = 0
+        jump r2, r9
+        push r1, r15
+        sub r1, r1, r14
+        call r8, r15            ; sum( n - 1 )
+        pop r4, r15
+        add r1, r1, r4
+sumret: return r15
+
+main:   li r15, stack
+        li r3, 2
+        li r10, fib
+        li r11, fibret
+        li r8, sum
+        li r9, sumret
+        li r1, FIB
+        call r10, r15
+        li r12, result
+        stmem r12, r1
+        li r1, SUM
+        call r8, r15
+        add r12, r12, r14
+        stmem r12, r1
@@ -0,0 +1,51 @@
+; sort: insertion sort, branchy and data dependent.
+;
+; Fills an array of N words from a linear congruential generator, then
+; sorts it in place, ascending as signed words.  The inner loop leaves
+; on one of two conditions that depend on the data, and goes back with
+; a relative bra, so a predictor sees branches of every kind.
+;
+; Dynamic instructions: 73227, state checksum 5dc6313a.
+
+N       = 160
+array   = 0x4000
+
+        li r14, 1
+        li r1, array
+        li r3, array + N
+
+        ; fill: x = x * 25173 + 13849
+        li r2, array
+        li r4, 25173
+        li r5, 13849
+        li r6, 1
+        li r12, fill
+fill:   mul r6, r6, r4
+        add r6, r6, r5
+        stmem r2, r6
+        add r2, r2, r14
+        lt r8, r2, r3
+        jump r8, r12
+
+        ; sort
+        li r2, array + 1        ; pi
+        li r10, inner - ( back + 1 )
+        li r11, place
+        li r12, outer
+outer:  ldmem r4, r2            ; key
+        sub r5, r2, r14         ; pj = pi - 1
+inner:  lt r8, r5, r1           ; pj < array ?
+        jump r8, r11
+        ldmem r6, r5
+        lt r8, r4, r6           ; key < a[ pj ] ?
+        cnot r8, r8
+        jump r8, r11
+        add r7, r5, r14
+        stmem r7, r6            ; a[ pj + 1 ] = a[ pj ]
+        sub r5, r5, r14
+back:   bra r14, r10
+place:  add r7, r5, r14
+        stmem r7, r4            ; a[ pj + 1 ] = key
+        add r2, r2, r14
+        lt r8, r2, r3
+        jump r8, r12